@@ -0,0 +1,121 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// accelerators/instance.cpp*
+#include "accelerators/instance.h"
+#include "interaction.h"
+#include "stats.h"
+
+namespace pbrt {
+
+  STAT_MEMORY_COUNTER("Memory/Instance primitives", instanceBytes);
+
+  // InstancePrimitive Method Definitions
+  InstancePrimitive::InstancePrimitive(std::shared_ptr<Primitive> primitive,
+    const Transform* instanceToWorld)
+    : primitive(std::move(primitive)),
+    instanceToWorld(instanceToWorld),
+    worldToInstance(Inverse(*instanceToWorld)),
+    worldBound((*instanceToWorld)(this->primitive->WorldBound())) {
+    instanceBytes += sizeof(*this);
+  }
+
+  bool InstancePrimitive::Intersect(const Ray& r,
+    SurfaceInteraction* isect) const {
+    // Transform ray to instance space and intersect the shared aggregate
+    Ray ray = worldToInstance(r);
+    if (!primitive->Intersect(ray, isect)) return false;
+    r.tMax = ray.tMax;
+    // Transform instance-space intersection back to world space
+    if (!instanceToWorld->IsIdentity()) *isect = (*instanceToWorld)(*isect);
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0);
+    return true;
+  }
+
+  bool InstancePrimitive::IntersectP(const Ray& r) const {
+    return primitive->IntersectP(worldToInstance(r));
+  }
+
+  void InstancePrimitive::ComputeScatteringFunctions(
+    SurfaceInteraction* isect, MemoryArena& arena, TransportMode mode,
+    bool allowMultipleLobes) const {
+    LOG(FATAL) << "InstancePrimitive::ComputeScatteringFunctions() shouldn't be "
+      "called";
+  }
+
+  // AnimatedInstancePrimitive Method Definitions
+  AnimatedInstancePrimitive::AnimatedInstancePrimitive(
+    std::shared_ptr<Primitive> primitive, const Transform* startTransform,
+    Float startTime, const Transform* endTransform, Float endTime)
+    : primitive(std::move(primitive)),
+    instanceToWorld(startTransform, startTime, endTransform, endTime),
+    startTime(startTime),
+    endTime(endTime),
+    worldBound(instanceToWorld.MotionBounds(this->primitive->WorldBound())) {
+    instanceBytes += sizeof(*this);
+  }
+
+  bool AnimatedInstancePrimitive::Intersect(const Ray& r,
+    SurfaceInteraction* isect) const {
+    // Compute _ray_ after transformation by _instanceToWorld_ at its time
+    Transform interpolatedInstanceToWorld;
+    instanceToWorld.Interpolate(r.time, &interpolatedInstanceToWorld);
+    Ray ray = Inverse(interpolatedInstanceToWorld)(r);
+    if (!primitive->Intersect(ray, isect)) return false;
+    r.tMax = ray.tMax;
+    // Transform instance-space intersection back to world space
+    if (!interpolatedInstanceToWorld.IsIdentity())
+      *isect = interpolatedInstanceToWorld(*isect);
+    CHECK_GE(Dot(isect->n, isect->shading.n), 0);
+    return true;
+  }
+
+  bool AnimatedInstancePrimitive::IntersectP(const Ray& r) const {
+    Transform interpolatedInstanceToWorld;
+    instanceToWorld.Interpolate(r.time, &interpolatedInstanceToWorld);
+    Transform interpolatedWorldToInstance = Inverse(interpolatedInstanceToWorld);
+    return primitive->IntersectP(interpolatedWorldToInstance(r));
+  }
+
+  Bounds3f AnimatedInstancePrimitive::WorldBound(Float time0,
+    Float time1) const {
+    return instanceToWorld.MotionBounds(primitive->WorldBound(), time0, time1);
+  }
+
+  void AnimatedInstancePrimitive::ComputeScatteringFunctions(
+    SurfaceInteraction* isect, MemoryArena& arena, TransportMode mode,
+    bool allowMultipleLobes) const {
+    LOG(FATAL) << "AnimatedInstancePrimitive::ComputeScatteringFunctions() "
+      "shouldn't be called";
+  }
+
+}  // namespace pbrt
@@ -0,0 +1,110 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_ACCELERATORS_INSTANCE_H
+#define PBRT_ACCELERATORS_INSTANCE_H
+
+// accelerators/instance.h*
+#include "pbrt.h"
+#include "primitive.h"
+#include "transform.h"
+
+namespace pbrt {
+
+  // InstancePrimitive Declarations
+
+  // Places a shared bottom-level aggregate in the scene with a static
+  // transformation. Unlike _TransformedPrimitive_, no _AnimatedTransform_
+  // is interpolated per ray: the world-to-instance matrix is computed once
+  // and the world-space bounds are cached for the top-level aggregate.
+  class InstancePrimitive : public Primitive {
+  public:
+    // InstancePrimitive Public Methods
+    InstancePrimitive(std::shared_ptr<Primitive> primitive,
+      const Transform* instanceToWorld);
+    bool Intersect(const Ray& r, SurfaceInteraction* isect) const;
+    bool IntersectP(const Ray& r) const;
+    const AreaLight* GetAreaLight() const { return nullptr; }
+    const Material* GetMaterial() const { return nullptr; }
+    void ComputeScatteringFunctions(SurfaceInteraction* isect,
+      MemoryArena& arena, TransportMode mode,
+      bool allowMultipleLobes) const;
+    Bounds3f WorldBound() const { return worldBound; }
+
+  private:
+    // InstancePrimitive Private Data
+    std::shared_ptr<Primitive> primitive;
+    const Transform* instanceToWorld;
+    const Transform worldToInstance;
+    const Bounds3f worldBound;
+  };
+
+  // AnimatedInstancePrimitive Declarations
+
+  // Places a primitive in the scene with an animated transformation, like
+  // _TransformedPrimitive_, but also bounds its motion over parts of the
+  // shutter interval so that motion-aware aggregates can use tighter
+  // boxes for rays with known times.
+  class AnimatedInstancePrimitive : public Primitive {
+  public:
+    // AnimatedInstancePrimitive Public Methods
+    AnimatedInstancePrimitive(std::shared_ptr<Primitive> primitive,
+      const Transform* startTransform, Float startTime,
+      const Transform* endTransform, Float endTime);
+    bool Intersect(const Ray& r, SurfaceInteraction* isect) const;
+    bool IntersectP(const Ray& r) const;
+    const AreaLight* GetAreaLight() const { return nullptr; }
+    const Material* GetMaterial() const { return nullptr; }
+    void ComputeScatteringFunctions(SurfaceInteraction* isect,
+      MemoryArena& arena, TransportMode mode,
+      bool allowMultipleLobes) const;
+    Bounds3f WorldBound() const { return worldBound; }
+    Bounds3f WorldBound(Float time0, Float time1) const;
+    Float StartTime() const { return startTime; }
+    Float EndTime() const { return endTime; }
+
+  private:
+    // AnimatedInstancePrimitive Private Data
+    std::shared_ptr<Primitive> primitive;
+    const AnimatedTransform instanceToWorld;
+    const Float startTime, endTime;
+    const Bounds3f worldBound;
+  };
+
+}  // namespace pbrt
+
+#endif  // PBRT_ACCELERATORS_INSTANCE_H
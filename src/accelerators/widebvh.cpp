@@ -0,0 +1,2507 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// accelerators/widebvh.cpp*
+#include "accelerators/widebvh.h"
+#include "accelerators/instance.h"
+#include "interaction.h"
+#include "nestedparallel.h"
+#include "parallel.h"
+#include "paramset.h"
+#include "stats.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// WideBVHAccel SIMD Definitions
+#if !defined(PBRT_FLOAT_AS_DOUBLE) && \
+    (defined(__SSE2__) || defined(_M_X64) || \
+     (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#define PBRT_WIDEBVH_SSE
+#include <emmintrin.h>
+#if defined(__AVX__)
+#define PBRT_WIDEBVH_AVX
+#include <immintrin.h>
+#endif
+#endif
+
+namespace pbrt {
+
+  STAT_MEMORY_COUNTER("Memory/Wide BVH tree", treeBytes);
+  STAT_RATIO("Wide BVH/Primitives per leaf node", totalPrimitives, totalLeafNodes);
+  STAT_COUNTER("Wide BVH/Interior nodes", interiorNodes);
+  STAT_RATIO("Wide BVH/Children per interior node", totalChildren,
+    totalInteriorNodes);
+  STAT_RATIO("Wide BVH/Rays per packet", totalPacketRays, totalPackets);
+  STAT_RATIO("Wide BVH/Rays per shadow packet", totalShadowPacketRays,
+    totalShadowPackets);
+  STAT_COUNTER("Wide BVH/Build time (ms)", buildTimeMs);
+  STAT_COUNTER("Wide BVH/Cache hits", cacheHits);
+  STAT_COUNTER("Wide BVH/Cache misses", cacheMisses);
+  STAT_COUNTER("Wide BVH/Refits", refits);
+  STAT_COUNTER("Wide BVH/Rebuilds after refit", refitRebuilds);
+  STAT_COUNTER("Wide BVH/Spatial splits", spatialSplits);
+  STAT_COUNTER("Wide BVH/Split primitive references", splitReferences);
+  STAT_COUNTER("Wide BVH/Time segments", timeSegmentTrees);
+
+  // WideBVHAccel Local Declarations
+  struct WideBVHPrimitiveInfo {
+    WideBVHPrimitiveInfo() {}
+    WideBVHPrimitiveInfo(size_t primitiveNumber, const Bounds3f& bounds)
+      : primitiveNumber(primitiveNumber),
+      bounds(bounds),
+      centroid(.5f * bounds.pMin + .5f * bounds.pMax) {}
+    size_t primitiveNumber;
+    Bounds3f bounds;
+    Point3f centroid;
+  };
+
+  struct WideBVHBuildNode {
+    // WideBVHBuildNode Public Methods
+    void InitLeaf(int first, int n, const Bounds3f& b) {
+      firstPrimOffset = first;
+      nPrimitives = n;
+      bounds = b;
+      children[0] = children[1] = nullptr;
+    }
+    void InitInterior(WideBVHBuildNode* c0, WideBVHBuildNode* c1) {
+      children[0] = c0;
+      children[1] = c1;
+      bounds = Union(c0->bounds, c1->bounds);
+      nPrimitives = 0;
+    }
+    Bounds3f bounds;
+    WideBVHBuildNode* children[2];
+    int firstPrimOffset, nPrimitives;
+  };
+
+  // Child bounds are stored per axis in structure-of-arrays form so that all
+  // eight children of a node can be tested against a ray with a handful of
+  // SIMD instructions. Unused child slots get an empty (inverted) box, which
+  // never passes the slab test.
+  struct alignas(32) WideBVHNode {
+    float bMin[3][WideBVHWidth];
+    float bMax[3][WideBVHWidth];
+    int32_t offset[WideBVHWidth];       // interior: node index, leaf: primitive
+    int32_t nPrimitives[WideBVHWidth];  // 0 -> interior child, -1 -> empty
+  };
+  static_assert(sizeof(WideBVHNode) == 256, "WideBVHNode should be 256 bytes");
+
+  // Compressed node layout: each child's bounds are stored as 8-bit
+  // offsets from the node's origin in units of a per-axis power of two.
+  // Interior children are stored contiguously starting at _childBase_ and
+  // the primitives of the leaf children contiguously starting at
+  // _primBase_, so only an 8-bit count is needed per child.
+  struct alignas(16) WideBVHQuantizedNode {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t pad;
+    uint8_t qMin[3][WideBVHWidth];
+    uint8_t qMax[3][WideBVHWidth];
+    int32_t childBase, primBase;
+    uint8_t meta[WideBVHWidth];  // 0 -> interior, 255 -> empty, else count
+  };
+  static_assert(sizeof(WideBVHQuantizedNode) == 80,
+    "WideBVHQuantizedNode should be 80 bytes");
+
+  // WideBVHAccel Utility Functions
+  inline float RoundBoundDown(Float v) {
+    float f = (float)v;
+    return (Float)f > v ? NextFloatDown(f) : f;
+  }
+
+  inline float RoundBoundUp(Float v) {
+    float f = (float)v;
+    return (Float)f < v ? NextFloatUp(f) : f;
+  }
+
+  inline float QuantizationScale(int exponent) {
+    // Construct $2^e$ directly from its exponent bits
+    return BitsToFloat((uint32_t)(exponent + 127) << 23);
+  }
+
+  // Dequantized bounds are computed as _origin + q * scale_; since _q_ has
+  // at most 8 significant bits and _scale_ is a power of two, the product is
+  // exact and the result is the same whether or not the compiler fuses the
+  // multiply and add. The builder relies on this to verify that every
+  // dequantized box encloses its child.
+  inline float Dequantize(float origin, uint8_t q, float scale) {
+    return origin + (float)q * scale;
+  }
+
+  inline void DecompressNode(const WideBVHQuantizedNode& q, WideBVHNode* node) {
+    for (int a = 0; a < 3; ++a) {
+      float scale = QuantizationScale(q.exponent[a]);
+      for (int i = 0; i < WideBVHWidth; ++i) {
+        node->bMin[a][i] = Dequantize(q.origin[a], q.qMin[a][i], scale);
+        node->bMax[a][i] = Dequantize(q.origin[a], q.qMax[a][i], scale);
+      }
+    }
+    int child = q.childBase, prim = q.primBase;
+    for (int i = 0; i < WideBVHWidth; ++i) {
+      if (q.meta[i] == 255) {
+        for (int a = 0; a < 3; ++a) {
+          node->bMin[a][i] = Infinity;
+          node->bMax[a][i] = -Infinity;
+        }
+        node->offset[i] = 0;
+        node->nPrimitives[i] = -1;
+      }
+      else if (q.meta[i] == 0) {
+        node->offset[i] = child++;
+        node->nPrimitives[i] = 0;
+      }
+      else {
+        node->offset[i] = prim;
+        node->nPrimitives[i] = q.meta[i];
+        prim += q.meta[i];
+      }
+    }
+  }
+
+  // Tests the ray against all children of _node_ at once, following the same
+  // conservative slab test as _Bounds3::IntersectP()_: the far distances are
+  // scaled up by $1 + 2\gamma_3$ and the running interval is updated with the
+  // operands ordered so that a NaN slab distance leaves it unchanged. Returns
+  // a bit mask of the children that were hit, with their entry distances in
+  // _tNear_.
+  inline uint32_t IntersectChildren(const WideBVHNode& node,
+    const RayQuery& query, Float tNear[WideBVHWidth]) {
+    const Point3f& o = query.Origin();
+    const Vector3f& invDir = query.invDir;
+    const int* dirIsNeg = query.dirIsNeg;
+    Float tMax = query.TMax();
+#if defined(PBRT_WIDEBVH_AVX)
+    const __m256 robust = _mm256_set1_ps(1 + 2 * gamma(3));
+    __m256 t0 = _mm256_setzero_ps(), t1 = _mm256_set1_ps(tMax);
+    for (int a = 0; a < 3; ++a) {
+      const float* nearB = dirIsNeg[a] ? node.bMax[a] : node.bMin[a];
+      const float* farB = dirIsNeg[a] ? node.bMin[a] : node.bMax[a];
+      __m256 oa = _mm256_set1_ps(o[a]), inv = _mm256_set1_ps(invDir[a]);
+      __m256 tn = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(nearB), oa), inv);
+      __m256 tf = _mm256_mul_ps(
+        _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(farB), oa), inv), robust);
+      t0 = _mm256_max_ps(tn, t0);
+      t1 = _mm256_min_ps(tf, t1);
+    }
+    _mm256_storeu_ps(tNear, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#elif defined(PBRT_WIDEBVH_SSE)
+    const __m128 robust = _mm_set1_ps(1 + 2 * gamma(3));
+    uint32_t mask = 0;
+    for (int g = 0; g < WideBVHWidth; g += 4) {
+      __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(tMax);
+      for (int a = 0; a < 3; ++a) {
+        const float* nearB = dirIsNeg[a] ? node.bMax[a] : node.bMin[a];
+        const float* farB = dirIsNeg[a] ? node.bMin[a] : node.bMax[a];
+        __m128 oa = _mm_set1_ps(o[a]), inv = _mm_set1_ps(invDir[a]);
+        __m128 tn = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(nearB + g), oa), inv);
+        __m128 tf = _mm_mul_ps(
+          _mm_mul_ps(_mm_sub_ps(_mm_load_ps(farB + g), oa), inv), robust);
+        t0 = _mm_max_ps(tn, t0);
+        t1 = _mm_min_ps(tf, t1);
+      }
+      _mm_storeu_ps(tNear + g, t0);
+      mask |= (uint32_t)_mm_movemask_ps(_mm_cmple_ps(t0, t1)) << g;
+    }
+    return mask;
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < WideBVHWidth; ++i) {
+      Float t0 = 0, t1 = tMax;
+      for (int a = 0; a < 3; ++a) {
+        Float nearB = dirIsNeg[a] ? node.bMax[a][i] : node.bMin[a][i];
+        Float farB = dirIsNeg[a] ? node.bMin[a][i] : node.bMax[a][i];
+        Float tn = (nearB - o[a]) * invDir[a];
+        Float tf = (farB - o[a]) * invDir[a];
+        tf *= 1 + 2 * gamma(3);
+        t0 = tn > t0 ? tn : t0;
+        t1 = tf < t1 ? tf : t1;
+      }
+      tNear[i] = t0;
+      if (t0 <= t1) mask |= 1u << i;
+    }
+    return mask;
+#endif
+  }
+
+  inline bool IntersectChild(const WideBVHNode& node, int i, const Point3f& o,
+    const Vector3f& invDir, const int dirIsNeg[3],
+    Float tMax) {
+    Float t0 = 0, t1 = tMax;
+    for (int a = 0; a < 3; ++a) {
+      Float nearB = dirIsNeg[a] ? node.bMax[a][i] : node.bMin[a][i];
+      Float farB = dirIsNeg[a] ? node.bMin[a][i] : node.bMax[a][i];
+      Float tn = (nearB - o[a]) * invDir[a];
+      Float tf = (farB - o[a]) * invDir[a];
+      tf *= 1 + 2 * gamma(3);
+      t0 = tn > t0 ? tn : t0;
+      t1 = tf < t1 ? tf : t1;
+    }
+    return t0 <= t1;
+  }
+
+  // Interval version of _IntersectChildren()_ for a packet of rays that share
+  // direction signs: the slab distances are bounded over the ranges of the
+  // packet's origins and reciprocal directions. Rounding is monotonic in each
+  // operand, so a child is only rejected if every ray's own test would
+  // reject it. _tNear_ receives a lower bound on the rays' entry distances.
+  inline uint32_t IntersectChildrenInterval(
+    const WideBVHNode& node, const Point3f& oMin, const Point3f& oMax,
+    const Vector3f& invDirMin, const Vector3f& invDirMax,
+    const int dirIsNeg[3], Float tMax, Float tNear[WideBVHWidth]) {
+    uint32_t mask = 0;
+    for (int i = 0; i < WideBVHWidth; ++i) {
+      Float t0 = 0, t1 = tMax;
+      for (int a = 0; a < 3; ++a) {
+        Float dNear = dirIsNeg[a] ? node.bMax[a][i] - oMin[a]
+          : node.bMin[a][i] - oMax[a];
+        Float dFar = dirIsNeg[a] ? node.bMin[a][i] - oMax[a]
+          : node.bMax[a][i] - oMin[a];
+        Float tn = std::min(dNear * invDirMin[a], dNear * invDirMax[a]);
+        Float tf = std::max(dFar * invDirMin[a], dFar * invDirMax[a]);
+        tf *= 1 + 2 * gamma(3);
+        t0 = tn > t0 ? tn : t0;
+        t1 = tf < t1 ? tf : t1;
+      }
+      tNear[i] = t0;
+      if (t0 <= t1) mask |= 1u << i;
+    }
+    return mask;
+  }
+
+  // WideBVHAccel Triangle Leaf Definitions
+
+  // The vertices of up to eight triangles, stored per vertex and axis in
+  // structure-of-arrays form. Block _b_ holds primitives $[8b, 8b + 8)$ in
+  // tree order; lanes holding other kinds of primitives are left zeroed.
+  struct alignas(32) WideBVHTriangleBlock {
+    float p[3][3][WideBVHWidth];
+  };
+  static_assert(sizeof(WideBVHTriangleBlock) == 288,
+    "WideBVHTriangleBlock should be 288 bytes");
+
+  // Runs the watertight ray-triangle test against all lanes of a block and
+  // returns a mask of the lanes the ray may hit within $(0, tMax]$. Every
+  // comparison is widened by a bound on the rounding error of the edge
+  // functions and of the scaled hit distance, computed from the magnitudes
+  // of the sheared coordinates before cancellation, so a triangle is only
+  // culled if the exact test in _Triangle::Intersect()_ would miss it
+  // whatever order or fusing of operations the compiler chose there.
+  inline uint32_t IntersectTriangles(const WideBVHTriangleBlock& block,
+    const RayQuery& query, float tMax) {
+    PBRT_CONSTEXPR float tol = 8 * std::numeric_limits<float>::epsilon();
+    const int kx = query.kx, ky = query.ky, kz = query.kz;
+    const Point3f& origin = query.Origin();
+    const float o[3] = { (float)origin[kx], (float)origin[ky],
+                         (float)origin[kz] };
+    const float sx = query.Sx, sy = query.Sy, sz = query.Sz;
+#if defined(PBRT_WIDEBVH_AVX)
+    const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+    const __m256 zero = _mm256_setzero_ps();
+    __m256 Sx = _mm256_set1_ps(sx), Sy = _mm256_set1_ps(sy);
+    __m256 Sz = _mm256_set1_ps(sz);
+    __m256 absSx = _mm256_set1_ps(std::abs(sx));
+    __m256 absSy = _mm256_set1_ps(std::abs(sy));
+    __m256 x[3], y[3], z[3], m = zero;
+    for (int v = 0; v < 3; ++v) {
+      __m256 dx = _mm256_sub_ps(_mm256_load_ps(block.p[v][kx]),
+        _mm256_set1_ps(o[0]));
+      __m256 dy = _mm256_sub_ps(_mm256_load_ps(block.p[v][ky]),
+        _mm256_set1_ps(o[1]));
+      __m256 dz = _mm256_sub_ps(_mm256_load_ps(block.p[v][kz]),
+        _mm256_set1_ps(o[2]));
+      x[v] = _mm256_add_ps(dx, _mm256_mul_ps(Sx, dz));
+      y[v] = _mm256_add_ps(dy, _mm256_mul_ps(Sy, dz));
+      z[v] = _mm256_mul_ps(Sz, dz);
+      __m256 adz = _mm256_and_ps(dz, absMask);
+      m = _mm256_max_ps(m, _mm256_max_ps(
+        _mm256_add_ps(_mm256_and_ps(dx, absMask), _mm256_mul_ps(absSx, adz)),
+        _mm256_add_ps(_mm256_and_ps(dy, absMask), _mm256_mul_ps(absSy, adz))));
+    }
+    __m256 e0 = _mm256_sub_ps(_mm256_mul_ps(x[1], y[2]),
+      _mm256_mul_ps(y[1], x[2]));
+    __m256 e1 = _mm256_sub_ps(_mm256_mul_ps(x[2], y[0]),
+      _mm256_mul_ps(y[2], x[0]));
+    __m256 e2 = _mm256_sub_ps(_mm256_mul_ps(x[0], y[1]),
+      _mm256_mul_ps(y[0], x[1]));
+    __m256 eTol = _mm256_mul_ps(_mm256_set1_ps(2 * tol), _mm256_mul_ps(m, m));
+    __m256 negETol = _mm256_sub_ps(zero, eTol);
+    __m256 anyNeg = _mm256_or_ps(_mm256_or_ps(
+      _mm256_cmp_ps(e0, negETol, _CMP_LT_OQ),
+      _mm256_cmp_ps(e1, negETol, _CMP_LT_OQ)),
+      _mm256_cmp_ps(e2, negETol, _CMP_LT_OQ));
+    __m256 anyPos = _mm256_or_ps(_mm256_or_ps(
+      _mm256_cmp_ps(e0, eTol, _CMP_GT_OQ),
+      _mm256_cmp_ps(e1, eTol, _CMP_GT_OQ)),
+      _mm256_cmp_ps(e2, eTol, _CMP_GT_OQ));
+    __m256 reject = _mm256_and_ps(anyNeg, anyPos);
+
+    // Compare the scaled hit distance against the interval once the sign
+    // of the determinant is certain
+    __m256 det = _mm256_add_ps(_mm256_add_ps(e0, e1), e2);
+    __m256 sumE = _mm256_add_ps(_mm256_add_ps(_mm256_and_ps(e0, absMask),
+      _mm256_and_ps(e1, absMask)), _mm256_and_ps(e2, absMask));
+    __m256 sumZ = _mm256_add_ps(_mm256_add_ps(_mm256_and_ps(z[0], absMask),
+      _mm256_and_ps(z[1], absMask)), _mm256_and_ps(z[2], absMask));
+    __m256 tScaled = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e0, z[0]),
+      _mm256_mul_ps(e1, z[1])), _mm256_mul_ps(e2, z[2]));
+    __m256 tTol = _mm256_mul_ps(
+      _mm256_add_ps(eTol, _mm256_mul_ps(_mm256_set1_ps(tol), sumE)), sumZ);
+    __m256 detTol = _mm256_mul_ps(_mm256_set1_ps(3), eTol);
+    __m256 detAbs = _mm256_and_ps(det, absMask);
+    __m256 tAbs = _mm256_xor_ps(tScaled, _mm256_andnot_ps(absMask, det));
+    __m256 tOutside = _mm256_or_ps(
+      _mm256_cmp_ps(tAbs, _mm256_sub_ps(zero, tTol), _CMP_LT_OQ),
+      _mm256_cmp_ps(_mm256_sub_ps(tAbs, tTol),
+        _mm256_mul_ps(_mm256_set1_ps(tMax), _mm256_add_ps(detAbs, detTol)),
+        _CMP_GT_OQ));
+    reject = _mm256_or_ps(reject, _mm256_and_ps(
+      _mm256_cmp_ps(detAbs, detTol, _CMP_GT_OQ), tOutside));
+    return ~(uint32_t)_mm256_movemask_ps(reject) & 0xff;
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < WideBVHWidth; ++i) {
+      // Translate, permute and shear the vertices
+      float x[3], y[3], z[3], m = 0;
+      for (int v = 0; v < 3; ++v) {
+        float dx = block.p[v][kx][i] - o[0];
+        float dy = block.p[v][ky][i] - o[1];
+        float dz = block.p[v][kz][i] - o[2];
+        x[v] = dx + sx * dz;
+        y[v] = dy + sy * dz;
+        z[v] = sz * dz;
+        float adz = std::abs(dz);
+        m = std::max(m, std::max(std::abs(dx) + std::abs(sx) * adz,
+          std::abs(dy) + std::abs(sy) * adz));
+      }
+
+      // Cull triangles whose edge functions certainly differ in sign
+      float e0 = x[1] * y[2] - y[1] * x[2];
+      float e1 = x[2] * y[0] - y[2] * x[0];
+      float e2 = x[0] * y[1] - y[0] * x[1];
+      float eTol = 2 * tol * m * m;
+      if ((e0 < -eTol || e1 < -eTol || e2 < -eTol) &&
+        (e0 > eTol || e1 > eTol || e2 > eTol))
+        continue;
+
+      // Compare the scaled hit distance against the interval once the sign
+      // of the determinant is certain
+      float det = e0 + e1 + e2;
+      float tScaled = e0 * z[0] + e1 * z[1] + e2 * z[2];
+      float tTol = (eTol + tol * (std::abs(e0) + std::abs(e1) +
+        std::abs(e2))) * (std::abs(z[0]) + std::abs(z[1]) + std::abs(z[2]));
+      float detTol = 3 * eTol;
+      if (std::abs(det) > detTol) {
+        if (det < 0) {
+          tScaled = -tScaled;
+          det = -det;
+        }
+        if (tScaled < -tTol || tScaled - tTol > tMax * (det + detTol))
+          continue;
+      }
+      mask |= 1u << i;
+    }
+    return mask;
+#endif
+  }
+
+  static PBRT_CONSTEXPR int MaxPacketSize = 256;
+
+  // WideBVHAccel Build Helpers
+  static PBRT_CONSTEXPR int ParallelBuildThreshold = 64 * 1024;
+  static PBRT_CONSTEXPR int BuildChunkSize = 16 * 1024;
+
+  // Size of an arena that fits all nodes of a binary tree over
+  // _nPrimitives_ primitives in a single block, as in pbrt's HLBVH build;
+  // _MemoryArena::Alloc()_ rounds allocations up to _max_align_t_
+  static size_t BuildArenaSize(int nPrimitives) {
+    PBRT_CONSTEXPR size_t align = alignof(std::max_align_t);
+    PBRT_CONSTEXPR size_t nodeSize =
+      (sizeof(WideBVHBuildNode) + align - 1) / align * align;
+    return std::max<size_t>(2 * nPrimitives * nodeSize, 1024);
+  }
+
+  struct WideBVHSubtreeTask {
+    WideBVHBuildNode* node;
+    int start, end;
+  };
+
+  // Partitions _primitiveInfo[start, end)_ so that the primitives satisfying
+  // _pred_ come first; if _parallel_ is set, large ranges are counted and
+  // scattered in parallel. Returns the index of the first primitive that
+  // doesn't satisfy _pred_.
+  template <typename Predicate>
+  int PartitionPrimitiveInfo(std::vector<WideBVHPrimitiveInfo>& primitiveInfo,
+    int start, int end, bool parallel, Predicate pred) {
+    if (!parallel || end - start < ParallelBuildThreshold) {
+      WideBVHPrimitiveInfo* pmid = std::partition(
+        &primitiveInfo[start], &primitiveInfo[end - 1] + 1, pred);
+      return pmid - &primitiveInfo[0];
+    }
+    // Count the primitives that go to the left in each chunk
+    int nChunks = (end - start + BuildChunkSize - 1) / BuildChunkSize;
+    std::vector<int> chunkLeft(nChunks, 0);
+    NestableParallelFor([&](int64_t c) {
+      int c0 = start + c * BuildChunkSize;
+      int c1 = std::min(c0 + BuildChunkSize, end);
+      for (int i = c0; i < c1; ++i)
+        if (pred(primitiveInfo[i])) ++chunkLeft[c];
+    }, nChunks);
+
+    // Compute the output offsets of each chunk's primitives
+    std::vector<int> leftOffset(nChunks), rightOffset(nChunks);
+    int nLeft = 0;
+    for (int c = 0; c < nChunks; ++c) {
+      leftOffset[c] = nLeft;
+      nLeft += chunkLeft[c];
+    }
+    for (int c = 0; c < nChunks; ++c)
+      rightOffset[c] = nLeft + c * BuildChunkSize - leftOffset[c];
+
+    // Scatter the primitives to their partitioned positions
+    std::vector<WideBVHPrimitiveInfo> scratch(&primitiveInfo[start],
+      &primitiveInfo[end - 1] + 1);
+    NestableParallelFor([&](int64_t c) {
+      int c0 = c * BuildChunkSize;
+      int c1 = std::min(c0 + BuildChunkSize, end - start);
+      int left = start + leftOffset[c], right = start + rightOffset[c];
+      for (int i = c0; i < c1; ++i) {
+        if (pred(scratch[i]))
+          primitiveInfo[left++] = scratch[i];
+        else
+          primitiveInfo[right++] = scratch[i];
+      }
+    }, nChunks);
+    return start + nLeft;
+  }
+
+  struct WideBVHMortonPrimitive {
+    int primitiveIndex;
+    uint32_t mortonCode;
+  };
+
+  struct WideBVHTreelet {
+    int start, end;
+    uint32_t mortonCode;
+    WideBVHBuildNode* root;
+  };
+
+  inline uint32_t MortonLeftShift3(uint32_t x) {
+    CHECK_LT(x, (1 << 10));
+    x = (x | (x << 16)) & 0b00000011000000000000000011111111;
+    x = (x | (x << 8)) & 0b00000011000000001111000000001111;
+    x = (x | (x << 4)) & 0b00000011000011000011000011000011;
+    x = (x | (x << 2)) & 0b00001001001001001001001001001001;
+    return x;
+  }
+
+  inline uint32_t EncodeMorton(const Vector3f& v) {
+    auto quantize = [](Float f) {
+      return (uint32_t)Clamp(f, 0, (1 << 10) - 1);
+    };
+    return (MortonLeftShift3(quantize(v.z)) << 2) |
+      (MortonLeftShift3(quantize(v.y)) << 1) | MortonLeftShift3(quantize(v.x));
+  }
+
+  // Stable least-significant-digit radix sort on the 30-bit Morton codes.
+  // Each pass histograms and scatters chunks of the array in parallel.
+  static void RadixSortMorton(std::vector<WideBVHMortonPrimitive>* v) {
+    std::vector<WideBVHMortonPrimitive> tempVector(v->size());
+    PBRT_CONSTEXPR int bitsPerPass = 6;
+    PBRT_CONSTEXPR int nBits = 30;
+    static_assert((nBits % bitsPerPass) == 0,
+      "Radix sort bitsPerPass must evenly divide nBits");
+    PBRT_CONSTEXPR int nPasses = nBits / bitsPerPass;
+    PBRT_CONSTEXPR int nBuckets = 1 << bitsPerPass;
+    PBRT_CONSTEXPR int bitMask = nBuckets - 1;
+    int n = v->size();
+    int nChunks = std::max(1, (n + BuildChunkSize - 1) / BuildChunkSize);
+    std::vector<int> chunkOffsets(nChunks * nBuckets);
+    for (int pass = 0; pass < nPasses; ++pass) {
+      // Perform one pass of radix sort, sorting _bitsPerPass_ bits
+      int lowBit = pass * bitsPerPass;
+      std::vector<WideBVHMortonPrimitive>& in = (pass & 1) ? tempVector : *v;
+      std::vector<WideBVHMortonPrimitive>& out = (pass & 1) ? *v : tempVector;
+
+      // Count number of primitives in each bucket for each chunk
+      NestableParallelFor([&](int64_t c) {
+        int* counts = &chunkOffsets[c * nBuckets];
+        std::fill(counts, counts + nBuckets, 0);
+        int c1 = std::min<int>((c + 1) * BuildChunkSize, n);
+        for (int i = c * BuildChunkSize; i < c1; ++i)
+          ++counts[(in[i].mortonCode >> lowBit) & bitMask];
+      }, nChunks);
+
+      // Convert the counts to starting output offsets, ordered by bucket
+      // and then by chunk so that the sort is stable
+      int offset = 0;
+      for (int b = 0; b < nBuckets; ++b)
+        for (int c = 0; c < nChunks; ++c) {
+          int count = chunkOffsets[c * nBuckets + b];
+          chunkOffsets[c * nBuckets + b] = offset;
+          offset += count;
+        }
+
+      // Store sorted values in output array
+      NestableParallelFor([&](int64_t c) {
+        int* offsets = &chunkOffsets[c * nBuckets];
+        int c1 = std::min<int>((c + 1) * BuildChunkSize, n);
+        for (int i = c * BuildChunkSize; i < c1; ++i)
+          out[offsets[(in[i].mortonCode >> lowBit) & bitMask]++] = in[i];
+      }, nChunks);
+    }
+    // Copy final result from _tempVector_, if needed
+    if (nPasses & 1) std::swap(*v, tempVector);
+  }
+
+  // WideBVHAccel Method Definitions
+  PBRT_CONSTEXPR int WideBVHAccel::MaxTimeSegments;
+  PBRT_CONSTEXPR int WideBVHAccel::MaxShadowPacketSize;
+
+  // WideBVHAccel Cache Definitions
+
+  // Cache files hold a header, the flattened nodes and the permutation
+  // from input to node-ordered primitives. Node offsets are indices, so
+  // the node array is used in place wherever the file is mapped.
+  static PBRT_CONSTEXPR uint32_t CacheVersion = 3;
+  static PBRT_CONSTEXPR size_t CacheAlignment = 128;
+
+  struct WideBVHCacheHeader {
+    char magic[8];
+    uint32_t version, floatSize;
+    uint64_t key;
+    int32_t nPrimitives, nNodes;
+    uint32_t nodeSize;
+    int32_t nReferences;
+    Float bounds[2][3];
+  };
+  static_assert(sizeof(WideBVHCacheHeader) <= CacheAlignment,
+    "WideBVHCacheHeader should fit before the node array");
+
+  static const char CacheMagic[8] = { 'P', 'B', 'R', 'T', 'B', 'V', 'H', '8' };
+
+  inline uint64_t HashBytes(const void* data, size_t size, uint64_t hash) {
+    // 64-bit FNV-1a
+    const uint8_t* bytes = (const uint8_t*)data;
+    for (size_t i = 0; i < size; ++i) {
+      hash ^= bytes[i];
+      hash *= 0x100000001b3ull;
+    }
+    return hash;
+  }
+
+  static void* MapCacheFile(const std::string& filename, size_t* size) {
+#ifdef PBRT_HAVE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return nullptr;
+    struct stat s;
+    if (fstat(fd, &s) != 0 || s.st_size == 0) {
+      close(fd);
+      return nullptr;
+    }
+    *size = s.st_size;
+    void* ptr = mmap(nullptr, *size, PROT_READ, MAP_FILE | MAP_SHARED, fd, 0);
+    close(fd);
+    return ptr == MAP_FAILED ? nullptr : ptr;
+#else
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in) return nullptr;
+    *size = in.tellg();
+    if (*size == 0) return nullptr;
+    uint8_t* ptr = AllocAligned<uint8_t>(*size);
+    in.seekg(0);
+    if (!in.read((char*)ptr, *size)) {
+      FreeAligned(ptr);
+      return nullptr;
+    }
+    return ptr;
+#endif
+  }
+
+  static void UnmapCacheFile(void* ptr, size_t size) {
+#ifdef PBRT_HAVE_MMAP
+    munmap(ptr, size);
+#else
+    FreeAligned(ptr);
+#endif
+  }
+
+  uint64_t WideBVHAccel::cacheKey(
+    const std::vector<WideBVHPrimitiveInfo>& primitiveInfo) const {
+    // The tree depends only on the primitive bounds and the build
+    // parameters, so those are all the key needs to cover; bounds are
+    // hashed in parallel chunks that are combined in order
+    int nPrimitives = primitiveInfo.size();
+    int nChunks = (nPrimitives + BuildChunkSize - 1) / BuildChunkSize;
+    std::vector<uint64_t> chunkHash(nChunks);
+    NestableParallelFor([&](int64_t c) {
+      uint64_t hash = 0xcbf29ce484222325ull;
+      int end = std::min<int>((c + 1) * BuildChunkSize, nPrimitives);
+      for (int i = c * BuildChunkSize; i < end; ++i)
+        hash = HashBytes(&primitiveInfo[i].bounds, sizeof(Bounds3f), hash);
+      chunkHash[c] = hash;
+    }, nChunks);
+    int32_t params[] = { (int32_t)CacheVersion, (int32_t)sizeof(Float),
+      maxPrimsInNode, (int32_t)buildMethod, quantized, nPrimitives,
+      (int32_t)FloatToBits((float)splitBudget),
+      (int32_t)FloatToBits((float)segmentTime[0]),
+      (int32_t)FloatToBits((float)segmentTime[1]), treeletBytes };
+    uint64_t key = HashBytes(params, sizeof(params), 0xcbf29ce484222325ull);
+    return HashBytes(chunkHash.data(), nChunks * sizeof(uint64_t), key);
+  }
+
+  bool WideBVHAccel::loadCache(const std::string& filename, uint64_t key) {
+    size_t size = 0;
+    uint8_t* data = (uint8_t*)MapCacheFile(filename, &size);
+    if (!data) return false;
+
+    // Validate the header against this accelerator
+    int nPrimitives = primitives.size();
+    const WideBVHCacheHeader* header = (const WideBVHCacheHeader*)data;
+    size_t nodeSize = quantized ? sizeof(WideBVHQuantizedNode)
+      : sizeof(WideBVHNode);
+    bool valid = size >= CacheAlignment &&
+      memcmp(header->magic, CacheMagic, sizeof(CacheMagic)) == 0 &&
+      header->version == CacheVersion && header->floatSize == sizeof(Float) &&
+      header->key == key && header->nPrimitives == nPrimitives &&
+      header->nodeSize == nodeSize && header->nNodes > 0 &&
+      header->nReferences >= nPrimitives &&
+      size >= CacheAlignment + header->nNodes * nodeSize +
+      header->nReferences * sizeof(int32_t);
+    int nReferences = valid ? header->nReferences : 0;
+    const int32_t* permutation = valid ? (const int32_t*)(data +
+      CacheAlignment + header->nNodes * nodeSize) : nullptr;
+
+    // Every primitive must be referenced, and only spatial splits may
+    // reference one more than once
+    std::vector<uint8_t> referenced(valid ? nPrimitives : 0, 0);
+    for (int i = 0; valid && i < nReferences; ++i) {
+      valid = permutation[i] >= 0 && permutation[i] < nPrimitives;
+      if (valid) referenced[permutation[i]] = 1;
+    }
+    for (int i = 0; valid && i < nPrimitives; ++i) valid = referenced[i];
+
+    // Use the cached nodes in place once they're known to be safe to
+    // traverse
+    if (valid) {
+      totalWideNodes = header->nNodes;
+      if (quantized)
+        quantizedNodes = (WideBVHQuantizedNode*)(data + CacheAlignment);
+      else
+        nodes = (WideBVHNode*)(data + CacheAlignment);
+      valid = validateNodes(nReferences);
+    }
+    if (!valid) {
+      Warning("Ignoring stale or invalid BVH cache file \"%s\".",
+        filename.c_str());
+      totalWideNodes = 0;
+      nodes = nullptr;
+      quantizedNodes = nullptr;
+      UnmapCacheFile(data, size);
+      return false;
+    }
+
+    // Reorder the primitives
+    cacheData = data;
+    cacheDataSize = size;
+    bounds = Bounds3f(Point3f(header->bounds[0][0], header->bounds[0][1],
+      header->bounds[0][2]), Point3f(header->bounds[1][0],
+        header->bounds[1][1], header->bounds[1][2]));
+    std::vector<std::shared_ptr<Primitive>> orderedPrims(nReferences);
+    for (int i = 0; i < nReferences; ++i)
+      orderedPrims[i] = primitives[permutation[i]];
+    primitives.swap(orderedPrims);
+    inputIndex.assign(permutation, permutation + nReferences);
+    nInputPrimitives = nPrimitives;
+    return true;
+  }
+
+  // The traversal stacks hold _MaxTraversalDepth_ levels of children
+  static PBRT_CONSTEXPR int MaxTraversalDepth = 64;
+
+  bool WideBVHAccel::validateNodes(int nReferences) const {
+    // Children are stored after their parents, so each node's depth is
+    // known by the time it's checked. Every node except the root must be
+    // the child of exactly one earlier node, and leaves must refer to
+    // ranges of the _nReferences_ primitive references.
+    std::vector<int> depth(totalWideNodes, -1);
+    depth[0] = 0;
+    for (int n = 0; n < totalWideNodes; ++n) {
+      if (depth[n] < 0) return false;
+      WideBVHNode scratch;
+      const WideBVHNode& node = fetchNode(n, &scratch);
+      for (int i = 0; i < WideBVHWidth; ++i) {
+        int32_t offset = node.offset[i], count = node.nPrimitives[i];
+        if (count == 0) {
+          if (offset <= n || offset >= totalWideNodes || depth[offset] >= 0 ||
+            depth[n] + 1 >= MaxTraversalDepth)
+            return false;
+          depth[offset] = depth[n] + 1;
+        }
+        else if (count > 0) {
+          if (offset < 0 || offset > nReferences - count) return false;
+        }
+        else if (count != -1)
+          return false;
+      }
+    }
+    return true;
+  }
+
+  void WideBVHAccel::writeCache(const std::string& filename,
+    uint64_t key) const {
+    WideBVHCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CacheMagic, sizeof(CacheMagic));
+    header.version = CacheVersion;
+    header.floatSize = sizeof(Float);
+    header.key = key;
+    header.nPrimitives = nInputPrimitives;
+    header.nReferences = primitives.size();
+    header.nNodes = totalWideNodes;
+    header.nodeSize = quantized ? sizeof(WideBVHQuantizedNode)
+      : sizeof(WideBVHNode);
+    for (int a = 0; a < 3; ++a) {
+      header.bounds[0][a] = bounds.pMin[a];
+      header.bounds[1][a] = bounds.pMax[a];
+    }
+    char padding[CacheAlignment] = {};
+
+    // Write to a temporary file and rename it so that concurrent renders
+    // never see a partially written cache
+    std::string tempName = StringPrintf("%s.%p.%lld.tmp", filename.c_str(),
+      (const void*)this, (long long)std::chrono::steady_clock::now()
+        .time_since_epoch().count());
+    std::ofstream out(tempName, std::ios::binary);
+    out.write((const char*)&header, sizeof(header));
+    out.write(padding, CacheAlignment - sizeof(header));
+    if (quantized)
+      out.write((const char*)quantizedNodes,
+        totalWideNodes * sizeof(WideBVHQuantizedNode));
+    else
+      out.write((const char*)nodes, totalWideNodes * sizeof(WideBVHNode));
+    out.write((const char*)inputIndex.data(),
+      inputIndex.size() * sizeof(int32_t));
+    out.close();
+    if (!out || std::rename(tempName.c_str(), filename.c_str()) != 0) {
+      Warning("Unable to write BVH cache file \"%s\".", filename.c_str());
+      std::remove(tempName.c_str());
+    }
+  }
+
+  WideBVHAccel::WideBVHAccel(std::vector<std::shared_ptr<Primitive>> p,
+    int maxPrimsInNode, BuildMethod buildMethod,
+    bool quantized, const std::string& cacheDir,
+    bool refittable, Float splitBudget, int timeSegments, int treeletBytes,
+    bool triangleBlocks)
+    : maxPrimsInNode(quantized ? std::min(maxPrimsInNode, 254)
+      : maxPrimsInNode),
+    buildMethod(buildMethod),
+    quantized(quantized),
+    refittable(refittable),
+    splitBudget(splitBudget),
+    nTimeSegments(Clamp(timeSegments, 1, MaxTimeSegments)),
+    treeletBytes(treeletBytes),
+    useTriangleBlocks(triangleBlocks),
+    primitives(std::move(p)) {
+    ProfilePhase _(Prof::AccelConstruction);
+    if (nTimeSegments > 1 && buildTimeSegments(cacheDir)) return;
+    build(cacheDir);
+  }
+
+  WideBVHAccel::WideBVHAccel(const WideBVHAccel& parent, Float time0,
+    Float time1,
+    const std::unordered_map<const Primitive*, uint32_t>& parentIndex,
+    const std::string& cacheDir)
+    : maxPrimsInNode(parent.maxPrimsInNode),
+    buildMethod(parent.buildMethod),
+    quantized(parent.quantized),
+    refittable(false),
+    splitBudget(parent.splitBudget),
+    nTimeSegments(1),
+    treeletBytes(parent.treeletBytes),
+    useTriangleBlocks(parent.useTriangleBlocks),
+    primitives(parent.primitives) {
+    segmentTime[0] = time0;
+    segmentTime[1] = time1;
+    build(cacheDir);
+
+    // Replace the tree-ordered references with indices into the parent's
+    // primitives
+    sharedPrimitives = &parent.primitives;
+    primitiveIndices.resize(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+      primitiveIndices[i] = parentIndex.find(primitives[i].get())->second;
+    std::vector<std::shared_ptr<Primitive>>().swap(primitives);
+  }
+
+  bool WideBVHAccel::buildTimeSegments(const std::string& cacheDir) {
+    // Find the time range over which primitives move
+    timeRange[0] = Infinity;
+    timeRange[1] = -Infinity;
+    for (const std::shared_ptr<Primitive>& prim : primitives)
+      if (const AnimatedInstancePrimitive* animated =
+        dynamic_cast<const AnimatedInstancePrimitive*>(prim.get())) {
+        timeRange[0] = std::min(timeRange[0], animated->StartTime());
+        timeRange[1] = std::max(timeRange[1], animated->EndTime());
+      }
+    if (!(timeRange[0] < timeRange[1])) return false;
+
+    // Build a tree over each segment's motion bounds; rays outside the
+    // range see the transforms clamped to its ends, as do the end segments.
+    // The segments share this tree's primitives.
+    std::unordered_map<const Primitive*, uint32_t> primitiveIndex;
+    primitiveIndex.reserve(primitives.size());
+    for (size_t i = 0; i < primitives.size(); ++i)
+      primitiveIndex[primitives[i].get()] = i;
+    for (int i = 0; i < nTimeSegments; ++i) {
+      Float t0 = Lerp(Float(i) / nTimeSegments, timeRange[0], timeRange[1]);
+      Float t1 = Lerp(Float(i + 1) / nTimeSegments, timeRange[0],
+        timeRange[1]);
+      segments.emplace_back(
+        new WideBVHAccel(*this, t0, t1, primitiveIndex, cacheDir));
+      bounds = Union(bounds, segments.back()->WorldBound());
+      ++timeSegmentTrees;
+    }
+    return true;
+  }
+
+  inline int WideBVHAccel::timeSegmentIndex(Float time) const {
+    Float t = (time - timeRange[0]) / (timeRange[1] - timeRange[0]);
+    return (int)Clamp(t * nTimeSegments, 0, nTimeSegments - 1);
+  }
+
+  inline const WideBVHAccel& WideBVHAccel::timeSegment(Float time) const {
+    return *segments[timeSegmentIndex(time)];
+  }
+
+  Bounds3f WideBVHAccel::primitiveBound(const Primitive& prim) const {
+    // Bound animated instances over this tree's time segment only
+    if (segmentTime[0] < segmentTime[1])
+      if (const AnimatedInstancePrimitive* animated =
+        dynamic_cast<const AnimatedInstancePrimitive*>(&prim))
+        return animated->WorldBound(segmentTime[0], segmentTime[1]);
+    return prim.WorldBound();
+  }
+
+  void WideBVHAccel::build(const std::string& cacheDir) {
+    if (primitives.empty()) return;
+    std::chrono::steady_clock::time_point startTime =
+      std::chrono::steady_clock::now();
+    // Build binary BVH from _primitives_
+
+    // Initialize _primitiveInfo_ array for primitives
+    int nPrimitives = primitives.size();
+    nInputPrimitives = nPrimitives;
+    std::vector<WideBVHPrimitiveInfo> primitiveInfo(nPrimitives);
+    NestableParallelFor([&](int64_t i) {
+      primitiveInfo[i] = { (size_t)i, primitiveBound(*primitives[i]) };
+    }, nPrimitives, 4096);
+
+    // Use a cached tree for these primitives if one exists
+    uint64_t key = 0;
+    std::string cacheFile;
+    if (!cacheDir.empty()) {
+      key = cacheKey(primitiveInfo);
+      cacheFile = StringPrintf("%s/%016" PRIx64 ".bvh8", cacheDir.c_str(), key);
+      if (loadCache(cacheFile, key)) {
+        ++cacheHits;
+        treeBytes += sizeof(*this) + primitives.size() * sizeof(primitives[0]);
+        buildTriangleBlocks();
+        int64_t elapsedMs =
+          std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - startTime).count();
+        buildTimeMs += elapsedMs;
+        LOG(INFO) << StringPrintf("Wide BVH with %d wide nodes for %d "
+          "primitives loaded from \"%s\" in %d ms", totalWideNodes,
+          nPrimitives, cacheFile.c_str(), (int)elapsedMs);
+        return;
+      }
+      ++cacheMisses;
+    }
+    std::vector<std::shared_ptr<Primitive>> inputPrims;
+    if (!cacheFile.empty() || refittable) inputPrims = primitives;
+
+    // Build binary BVH with the requested method; work done in parallel
+    // tasks allocates build nodes from _taskArenas_
+    MemoryArena arena(1024 * 1024);
+    std::vector<std::unique_ptr<MemoryArena>> taskArenas;
+    int totalNodes = 0;
+    std::vector<std::shared_ptr<Primitive>> orderedPrims(nPrimitives);
+    WideBVHBuildNode* root;
+    if (buildMethod == BuildMethod::SAH)
+      root = sahBuild(arena, taskArenas, primitiveInfo, &totalNodes,
+        orderedPrims);
+    else if (buildMethod == BuildMethod::SBVH)
+      root = spatialBuild(arena, primitiveInfo, &totalNodes, orderedPrims);
+    else
+      root = linearBuild(arena, taskArenas, primitiveInfo, &totalNodes,
+        orderedPrims);
+    primitives.swap(orderedPrims);
+    primitiveInfo.resize(0);
+    bounds = root->bounds;
+
+    // Collapse binary BVH into _WideBVHWidth_-wide nodes
+    totalWideNodes = countWideNodes(root);
+    size_t nodeBytes = totalWideNodes * (quantized ? sizeof(WideBVHQuantizedNode)
+      : sizeof(WideBVHNode));
+    treeBytes += nodeBytes + sizeof(*this) +
+      primitives.size() * sizeof(primitives[0]);
+    if (!quantized) {
+      nodes = AllocAligned<WideBVHNode>(totalWideNodes);
+      int offset = 0;
+      flattenWideBVH(root, &offset);
+      CHECK_EQ(totalWideNodes, offset);
+      layoutTreelets();
+    }
+    else {
+      // Compressed nodes store leaf primitives contiguously per node, so
+      // the primitives are reordered while flattening
+      quantizedNodes = AllocAligned<WideBVHQuantizedNode>(totalWideNodes);
+      std::vector<std::shared_ptr<Primitive>> nodeOrderedPrims;
+      nodeOrderedPrims.reserve(primitives.size());
+      int nextNode = 1;
+      flattenQuantizedWideBVH(root, 0, &nextNode, nodeOrderedPrims);
+      CHECK_EQ(totalWideNodes, nextNode);
+      primitives.swap(nodeOrderedPrims);
+    }
+    // Degenerate splits may produce trees that the fixed-size traversal
+    // stacks can't hold; check the new tree as cached trees are checked
+    CHECK(validateNodes(primitives.size()))
+      << "Wide BVH is malformed or deeper than " << MaxTraversalDepth
+      << " levels";
+    int64_t elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - startTime).count();
+    buildTimeMs += elapsedMs;
+    LOG(INFO) << StringPrintf("Wide BVH created with %d binary nodes collapsed "
+      "into %d wide nodes for %d primitives (%.2f MB) "
+      "in %d ms using %d parallel tasks",
+      totalNodes, totalWideNodes, (int)primitives.size(),
+      float(nodeBytes) / (1024.f * 1024.f), (int)elapsedMs,
+      (int)taskArenas.size());
+
+    // Record the input position of each primitive for caching and refitting
+    if (!inputPrims.empty()) {
+      std::unordered_map<const Primitive*, int32_t> inputPosition;
+      for (int i = 0; i < nPrimitives; ++i)
+        inputPosition[inputPrims[i].get()] = i;
+      inputIndex.resize(primitives.size());
+      for (size_t i = 0; i < primitives.size(); ++i)
+        inputIndex[i] = inputPosition[primitives[i].get()];
+    }
+    if (!cacheFile.empty()) writeCache(cacheFile, key);
+    buildTriangleBlocks();
+  }
+
+  Float WideBVHAccel::sahCost() const {
+    // Sum node visit and primitive intersection costs weighted by the
+    // probability of a random ray through the root hitting each box
+    Float rootArea = bounds.SurfaceArea();
+    if (totalWideNodes == 0 || rootArea == 0) return 0;
+    Float cost = rootArea;
+    for (int n = 0; n < totalWideNodes; ++n) {
+      WideBVHNode scratch;
+      const WideBVHNode& node = fetchNode(n, &scratch);
+      for (int i = 0; i < WideBVHWidth; ++i) {
+        if (node.nPrimitives[i] < 0) continue;
+        Bounds3f b(Point3f(node.bMin[0][i], node.bMin[1][i], node.bMin[2][i]),
+          Point3f(node.bMax[0][i], node.bMax[1][i], node.bMax[2][i]));
+        cost += b.SurfaceArea() * std::max(node.nPrimitives[i], 1);
+      }
+    }
+    return cost / rootArea;
+  }
+
+  void WideBVHAccel::buildTriangleBlocks() {
+    FreeAligned(triangleBlocks);
+    triangleBlocks = nullptr;
+    triangleLanes.clear();
+    if (!useTriangleBlocks) return;
+#ifndef PBRT_FLOAT_AS_DOUBLE
+    // Gather the vertices of the triangles in tree order, if there are any
+    int nPrimitives = primitives.size();
+    std::vector<const TrianglePrimitive*> triangles(nPrimitives);
+    std::atomic<bool> anyTriangles(false);
+    NestableParallelFor([&](int64_t i) {
+      triangles[i] =
+        dynamic_cast<const TrianglePrimitive*>(primitives[i].get());
+      if (triangles[i]) anyTriangles = true;
+    }, nPrimitives, 4096);
+    if (!anyTriangles) return;
+    int nBlocks = (nPrimitives + WideBVHWidth - 1) / WideBVHWidth;
+    triangleBlocks = AllocAligned<WideBVHTriangleBlock>(nBlocks);
+    triangleLanes.resize(nBlocks);
+    NestableParallelFor([&](int64_t b) {
+      WideBVHTriangleBlock& block = triangleBlocks[b];
+      memset(&block, 0, sizeof(block));
+      uint8_t lanes = 0;
+      for (int i = 0; i < WideBVHWidth; ++i) {
+        int j = b * WideBVHWidth + i;
+        if (j >= nPrimitives || !triangles[j]) continue;
+        Point3f p[3];
+        triangles[j]->GetVertices(p);
+        for (int v = 0; v < 3; ++v)
+          for (int a = 0; a < 3; ++a) block.p[v][a][i] = p[v][a];
+        lanes |= 1 << i;
+      }
+      triangleLanes[b] = lanes;
+    }, nBlocks, 1024);
+    treeBytes += nBlocks * (sizeof(WideBVHTriangleBlock) + 1);
+#endif
+  }
+
+  // Calls _func_ with the index of each primitive of a leaf that the ray may
+  // hit, stopping early if it returns true. Triangles are first tested
+  // eight at a time with _IntersectTriangles()_; other primitives are
+  // always passed on.
+  template <typename Func>
+  inline void WideBVHAccel::forEachLeafCandidate(const RayQuery& query,
+    int offset, int nPrimitives, Func func) const {
+    int end = offset + nPrimitives;
+    if (!triangleBlocks) {
+      for (int i = offset; i < end; ++i)
+        if (func(i)) return;
+      return;
+    }
+    for (int start = offset; start < end;) {
+      int b = start / WideBVHWidth, base = b * WideBVHWidth;
+      uint32_t lanes = ((1u << std::min(end - base, WideBVHWidth)) - 1) &
+        ~((1u << (start - base)) - 1);
+      // _tMax_ is read per block since _func_ may shorten it
+      uint32_t triangleMask = triangleLanes[b] & lanes;
+      if (triangleMask)
+        lanes &= ~triangleMask |
+          IntersectTriangles(triangleBlocks[b], query, query.TMax());
+      while (lanes) {
+        int i = CountTrailingZeros(lanes);
+        lanes &= lanes - 1;
+        if (func(base + i)) return;
+      }
+      start = base + WideBVHWidth;
+    }
+  }
+
+  bool WideBVHAccel::Refit(std::vector<std::shared_ptr<Primitive>> p,
+    Float rebuildThreshold) {
+    // Refitting requires unchanged topology and uncompressed nodes
+    if (!refittable || quantized || p.size() != nInputPrimitives ||
+      totalWideNodes == 0)
+      return false;
+    ProfilePhase _(Prof::AccelConstruction);
+    std::chrono::steady_clock::time_point startTime =
+      std::chrono::steady_clock::now();
+    ++refits;
+    if (initialCost == 0) initialCost = sahCost();
+
+    // Replace the primitives, keeping the tree's order; primitives split
+    // by spatial splits appear more than once
+    int nPrimitives = primitives.size();
+    NestableParallelFor([&](int64_t i) {
+      primitives[i] = p[inputIndex[i]];
+    }, nPrimitives, 4096);
+
+    // Copy nodes loaded from the cache so they can be updated
+    if (cacheData) {
+      WideBVHNode* ownedNodes = AllocAligned<WideBVHNode>(totalWideNodes);
+      memcpy(ownedNodes, nodes, totalWideNodes * sizeof(WideBVHNode));
+      UnmapCacheFile(cacheData, cacheDataSize);
+      cacheData = nullptr;
+      nodes = ownedNodes;
+    }
+
+    // Group nodes by depth; children are always stored after their parent
+    std::vector<int> depth(totalWideNodes, 0);
+    int maxDepth = 0;
+    for (int n = 0; n < totalWideNodes; ++n)
+      for (int i = 0; i < WideBVHWidth; ++i)
+        if (nodes[n].nPrimitives[i] == 0) {
+          depth[nodes[n].offset[i]] = depth[n] + 1;
+          maxDepth = std::max(maxDepth, depth[n] + 1);
+        }
+    std::vector<std::vector<int>> levels(maxDepth + 1);
+    for (int n = 0; n < totalWideNodes; ++n) levels[depth[n]].push_back(n);
+
+    // Update child bounds bottom-up, one level at a time in parallel
+    for (int d = maxDepth; d >= 0; --d) {
+      const std::vector<int>& level = levels[d];
+      NestableParallelFor([&](int64_t j) {
+        WideBVHNode& node = nodes[level[j]];
+        for (int i = 0; i < WideBVHWidth; ++i) {
+          if (node.nPrimitives[i] < 0) continue;
+          Bounds3f b;
+          if (node.nPrimitives[i] > 0) {
+            for (int k = 0; k < node.nPrimitives[i]; ++k)
+              b = Union(b, primitives[node.offset[i] + k]->WorldBound());
+          }
+          else {
+            const WideBVHNode& child = nodes[node.offset[i]];
+            for (int k = 0; k < WideBVHWidth; ++k)
+              if (child.nPrimitives[k] >= 0)
+                b = Union(b, Bounds3f(Point3f(child.bMin[0][k],
+                  child.bMin[1][k], child.bMin[2][k]), Point3f(
+                    child.bMax[0][k], child.bMax[1][k], child.bMax[2][k])));
+          }
+          for (int a = 0; a < 3; ++a) {
+            node.bMin[a][i] = RoundBoundDown(b.pMin[a]);
+            node.bMax[a][i] = RoundBoundUp(b.pMax[a]);
+          }
+        }
+      }, level.size(), 16);
+    }
+    bounds = Bounds3f();
+    for (int i = 0; i < WideBVHWidth; ++i)
+      if (nodes[0].nPrimitives[i] >= 0)
+        bounds = Union(bounds, Bounds3f(Point3f(nodes[0].bMin[0][i],
+          nodes[0].bMin[1][i], nodes[0].bMin[2][i]), Point3f(
+            nodes[0].bMax[0][i], nodes[0].bMax[1][i], nodes[0].bMax[2][i])));
+
+    // Rebuild if the refitted tree has degraded too far
+    Float cost = sahCost();
+    int64_t elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - startTime).count();
+    LOG(INFO) << StringPrintf("Wide BVH refit in %d ms; SAH cost %f "
+      "(%f after build)", (int)elapsedMs, cost, initialCost);
+    if (cost > rebuildThreshold * initialCost) {
+      ++refitRebuilds;
+      // Restore input order so that _inputIndex_ stays relative to it
+      primitives.swap(p);
+      FreeAligned(nodes);
+      nodes = nullptr;
+      totalWideNodes = 0;
+      build("");
+      initialCost = sahCost();
+    }
+    else {
+      buildTriangleBlocks();
+      buildTimeMs += elapsedMs;
+    }
+    return true;
+  }
+
+  Bounds3f WideBVHAccel::WorldBound() const {
+    return totalWideNodes > 0 || !segments.empty() ? bounds : Bounds3f();
+  }
+
+  WideBVHBuildNode* WideBVHAccel::recursiveBuild(
+    MemoryArena& arena, std::vector<WideBVHPrimitiveInfo>& primitiveInfo,
+    int start, int end, int* totalNodes,
+    std::vector<std::shared_ptr<Primitive>>& orderedPrims,
+    std::vector<WideBVHSubtreeTask>* subtrees, int subtreeThreshold) {
+    CHECK_NE(start, end);
+    WideBVHBuildNode* node = arena.Alloc<WideBVHBuildNode>();
+    int nPrimitives = end - start;
+    // Subtrees are built by tasks that already run in parallel, so only the
+    // serially built top of the tree bins and partitions in parallel
+    bool parallel = subtrees && nPrimitives >= ParallelBuildThreshold;
+    int nChunks = (nPrimitives + BuildChunkSize - 1) / BuildChunkSize;
+
+    // Compute bounds of all primitives and of their centroids
+    Bounds3f bounds, centroidBounds;
+    if (!parallel) {
+      for (int i = start; i < end; ++i) {
+        bounds = Union(bounds, primitiveInfo[i].bounds);
+        centroidBounds = Union(centroidBounds, primitiveInfo[i].centroid);
+      }
+    }
+    else {
+      std::vector<Bounds3f> chunkBounds(nChunks), chunkCentroidBounds(nChunks);
+      NestableParallelFor([&](int64_t c) {
+        int c0 = start + c * BuildChunkSize;
+        int c1 = std::min(c0 + BuildChunkSize, end);
+        for (int i = c0; i < c1; ++i) {
+          chunkBounds[c] = Union(chunkBounds[c], primitiveInfo[i].bounds);
+          chunkCentroidBounds[c] =
+            Union(chunkCentroidBounds[c], primitiveInfo[i].centroid);
+        }
+      }, nChunks);
+      for (int c = 0; c < nChunks; ++c) {
+        bounds = Union(bounds, chunkBounds[c]);
+        centroidBounds = Union(centroidBounds, chunkCentroidBounds[c]);
+      }
+    }
+
+    // Defer the subtree to a parallel task if it is small enough
+    if (subtrees && nPrimitives <= subtreeThreshold) {
+      node->bounds = bounds;
+      subtrees->push_back({ node, start, end });
+      return node;
+    }
+    (*totalNodes)++;
+
+    auto createLeaf = [&]() {
+      // Leaves refer to their range of _primitiveInfo_, which no longer
+      // changes once the leaf has been created
+      for (int i = start; i < end; ++i) {
+        int primNum = primitiveInfo[i].primitiveNumber;
+        orderedPrims[i] = primitives[primNum];
+      }
+      node->InitLeaf(start, nPrimitives, bounds);
+      return node;
+    };
+    if (nPrimitives == 1) return createLeaf();
+
+    // Choose split dimension _dim_
+    int dim = centroidBounds.MaximumExtent();
+
+    // Partition primitives into two sets and build children
+    int mid = (start + end) / 2;
+    if (centroidBounds.pMax[dim] == centroidBounds.pMin[dim]) {
+      // Primitive centroids coincide; make a leaf unless it would be too
+      // large, in which case any split into halves is as good as another
+      if (nPrimitives <= maxPrimsInNode) return createLeaf();
+    }
+    else if (nPrimitives <= 2) {
+      // Partition primitives into equally-sized subsets
+      std::nth_element(&primitiveInfo[start], &primitiveInfo[mid],
+        &primitiveInfo[end - 1] + 1,
+        [dim](const WideBVHPrimitiveInfo& a,
+          const WideBVHPrimitiveInfo& b) {
+        return a.centroid[dim] < b.centroid[dim];
+      });
+    }
+    else {
+      // Partition primitives using approximate SAH
+      PBRT_CONSTEXPR int nBuckets = 12;
+      struct BucketInfo {
+        int count = 0;
+        Bounds3f bounds;
+      };
+      BucketInfo buckets[nBuckets];
+      auto bucketIndex = [&](const Point3f& centroid) {
+        int b = nBuckets * centroidBounds.Offset(centroid)[dim];
+        if (b == nBuckets) b = nBuckets - 1;
+        CHECK_GE(b, 0);
+        CHECK_LT(b, nBuckets);
+        return b;
+      };
+
+      // Initialize _BucketInfo_ for SAH partition buckets
+      if (!parallel) {
+        for (int i = start; i < end; ++i) {
+          int b = bucketIndex(primitiveInfo[i].centroid);
+          buckets[b].count++;
+          buckets[b].bounds =
+            Union(buckets[b].bounds, primitiveInfo[i].bounds);
+        }
+      }
+      else {
+        std::vector<BucketInfo> chunkBuckets(nChunks * nBuckets);
+        NestableParallelFor([&](int64_t c) {
+          BucketInfo* cb = &chunkBuckets[c * nBuckets];
+          int c0 = start + c * BuildChunkSize;
+          int c1 = std::min(c0 + BuildChunkSize, end);
+          for (int i = c0; i < c1; ++i) {
+            int b = bucketIndex(primitiveInfo[i].centroid);
+            cb[b].count++;
+            cb[b].bounds = Union(cb[b].bounds, primitiveInfo[i].bounds);
+          }
+        }, nChunks);
+        for (int c = 0; c < nChunks; ++c)
+          for (int b = 0; b < nBuckets; ++b) {
+            buckets[b].count += chunkBuckets[c * nBuckets + b].count;
+            buckets[b].bounds = Union(buckets[b].bounds,
+              chunkBuckets[c * nBuckets + b].bounds);
+          }
+      }
+
+      // Compute costs for splitting after each bucket
+      Float cost[nBuckets - 1];
+      for (int i = 0; i < nBuckets - 1; ++i) {
+        Bounds3f b0, b1;
+        int count0 = 0, count1 = 0;
+        for (int j = 0; j <= i; ++j) {
+          b0 = Union(b0, buckets[j].bounds);
+          count0 += buckets[j].count;
+        }
+        for (int j = i + 1; j < nBuckets; ++j) {
+          b1 = Union(b1, buckets[j].bounds);
+          count1 += buckets[j].count;
+        }
+        cost[i] = .125f + (count0 * b0.SurfaceArea() +
+          count1 * b1.SurfaceArea()) / bounds.SurfaceArea();
+      }
+
+      // Find bucket to split at that minimizes SAH metric
+      Float minCost = cost[0];
+      int minCostSplitBucket = 0;
+      for (int i = 1; i < nBuckets - 1; ++i) {
+        if (cost[i] < minCost) {
+          minCost = cost[i];
+          minCostSplitBucket = i;
+        }
+      }
+
+      // Either create leaf or split primitives at selected SAH bucket
+      Float leafCost = nPrimitives;
+      if (nPrimitives > maxPrimsInNode || minCost < leafCost) {
+        mid = PartitionPrimitiveInfo(primitiveInfo, start, end, parallel,
+          [&](const WideBVHPrimitiveInfo& pi) {
+          return bucketIndex(pi.centroid) <= minCostSplitBucket;
+        });
+        // Fall back to an equal split if all centroids landed on one side
+        if (mid == start || mid == end) mid = (start + end) / 2;
+      }
+      else
+        return createLeaf();
+    }
+    node->InitInterior(
+      recursiveBuild(arena, primitiveInfo, start, mid, totalNodes,
+        orderedPrims, subtrees, subtreeThreshold),
+      recursiveBuild(arena, primitiveInfo, mid, end, totalNodes,
+        orderedPrims, subtrees, subtreeThreshold));
+    return node;
+  }
+
+  WideBVHBuildNode* WideBVHAccel::sahBuild(
+    MemoryArena& arena, std::vector<std::unique_ptr<MemoryArena>>& taskArenas,
+    std::vector<WideBVHPrimitiveInfo>& primitiveInfo, int* totalNodes,
+    std::vector<std::shared_ptr<Primitive>>& orderedPrims) {
+    // Build the top of the tree serially, deferring subtrees that are
+    // small enough to be built independently
+    int nPrimitives = primitiveInfo.size();
+    std::vector<WideBVHSubtreeTask> subtrees;
+    int subtreeThreshold =
+      std::max(1024, nPrimitives / (8 * MaxThreadIndex()));
+    WideBVHBuildNode* root =
+      recursiveBuild(arena, primitiveInfo, 0, nPrimitives, totalNodes,
+        orderedPrims, &subtrees, subtreeThreshold);
+
+    // Build the deferred subtrees in parallel
+    size_t firstArena = taskArenas.size();
+    taskArenas.resize(firstArena + subtrees.size());
+    std::vector<int> subtreeNodes(subtrees.size(), 0);
+    NestableParallelFor([&](int64_t i) {
+      const WideBVHSubtreeTask& task = subtrees[i];
+      MemoryArena* subtreeArena =
+        new MemoryArena(BuildArenaSize(task.end - task.start));
+      taskArenas[firstArena + i].reset(subtreeArena);
+      *task.node = *recursiveBuild(*subtreeArena, primitiveInfo, task.start,
+        task.end, &subtreeNodes[i], orderedPrims,
+        nullptr, 0);
+    }, subtrees.size());
+    for (int n : subtreeNodes) *totalNodes += n;
+    return root;
+  }
+
+  // Spatial splits are only considered where the children of the best
+  // object split overlap by more than this fraction of the root's area
+  static PBRT_CONSTEXPR Float SpatialSplitAlpha = 1e-5f;
+  static PBRT_CONSTEXPR int MaxSpatialSplitDepth = 48;
+
+  WideBVHBuildNode* WideBVHAccel::spatialBuild(
+    MemoryArena& arena, std::vector<WideBVHPrimitiveInfo>& primitiveInfo,
+    int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrims) {
+    // Spatial splits duplicate primitive references, so leaves append to
+    // _orderedPrims_ instead of using their _primitiveInfo_ range
+    int splitBudgetRefs = splitBudget * primitiveInfo.size();
+    orderedPrims.clear();
+    orderedPrims.reserve(primitiveInfo.size() + splitBudgetRefs);
+    Bounds3f rootBounds;
+    for (const WideBVHPrimitiveInfo& pi : primitiveInfo)
+      rootBounds = Union(rootBounds, pi.bounds);
+    return spatialRecursiveBuild(arena, std::move(primitiveInfo), 0,
+      rootBounds.SurfaceArea(), &splitBudgetRefs, totalNodes, orderedPrims);
+  }
+
+  WideBVHBuildNode* WideBVHAccel::spatialRecursiveBuild(
+    MemoryArena& arena, std::vector<WideBVHPrimitiveInfo> refs, int depth,
+    Float rootArea, int* splitBudgetRefs, int* totalNodes,
+    std::vector<std::shared_ptr<Primitive>>& orderedPrims) {
+    CHECK(!refs.empty());
+    WideBVHBuildNode* node = arena.Alloc<WideBVHBuildNode>();
+    (*totalNodes)++;
+    int nRefs = refs.size();
+
+    // Compute bounds of all references and of their centroids
+    Bounds3f bounds, centroidBounds;
+    for (const WideBVHPrimitiveInfo& ref : refs) {
+      bounds = Union(bounds, ref.bounds);
+      centroidBounds = Union(centroidBounds, ref.centroid);
+    }
+    auto createLeaf = [&]() {
+      node->InitLeaf(orderedPrims.size(), nRefs, bounds);
+      for (const WideBVHPrimitiveInfo& ref : refs)
+        orderedPrims.push_back(primitives[ref.primitiveNumber]);
+      return node;
+    };
+    if (nRefs == 1) return createLeaf();
+    Float area = bounds.SurfaceArea();
+
+    // Find the best object split using binned SAH over centroids
+    PBRT_CONSTEXPR int nBuckets = 12;
+    int dim = centroidBounds.MaximumExtent();
+    bool canObjectSplit = centroidBounds.pMax[dim] > centroidBounds.pMin[dim];
+    Float objectCost = Infinity;
+    int objectSplitBucket = 0;
+    Float objectOverlapArea = 0;
+    auto bucketIndex = [&](const Point3f& centroid) {
+      int b = nBuckets * centroidBounds.Offset(centroid)[dim];
+      return Clamp(b, 0, nBuckets - 1);
+    };
+    if (canObjectSplit) {
+      int counts[nBuckets] = {};
+      Bounds3f bucketBounds[nBuckets];
+      for (const WideBVHPrimitiveInfo& ref : refs) {
+        int b = bucketIndex(ref.centroid);
+        counts[b]++;
+        bucketBounds[b] = Union(bucketBounds[b], ref.bounds);
+      }
+      for (int i = 0; i < nBuckets - 1; ++i) {
+        Bounds3f b0, b1;
+        int count0 = 0, count1 = 0;
+        for (int j = 0; j <= i; ++j) {
+          b0 = Union(b0, bucketBounds[j]);
+          count0 += counts[j];
+        }
+        for (int j = i + 1; j < nBuckets; ++j) {
+          b1 = Union(b1, bucketBounds[j]);
+          count1 += counts[j];
+        }
+        if (count0 == 0 || count1 == 0) continue;
+        Float cost = .125f + (count0 * b0.SurfaceArea() +
+          count1 * b1.SurfaceArea()) / area;
+        if (cost < objectCost) {
+          objectCost = cost;
+          objectSplitBucket = i;
+          objectOverlapArea = Overlaps(b0, b1) ?
+            pbrt::Intersect(b0, b1).SurfaceArea() : 0;
+        }
+      }
+    }
+
+    // Find the best spatial split if the object split's children overlap
+    PBRT_CONSTEXPR int nBins = 16;
+    Float spatialCost = Infinity;
+    int spatialDim = 0;
+    Float spatialPos = 0;
+    bool overlapping = objectCost == Infinity ||
+      objectOverlapArea > SpatialSplitAlpha * rootArea;
+    if (*splitBudgetRefs > 0 && depth < MaxSpatialSplitDepth && overlapping) {
+      for (int a = 0; a < 3; ++a) {
+        Float lo = bounds.pMin[a], extent = bounds.pMax[a] - bounds.pMin[a];
+        if (extent <= 0) continue;
+        Float binWidth = extent / nBins;
+        auto binPos = [&](int i) { return lo + binWidth * i; };
+        auto binIndex = [&](Float v) {
+          return Clamp((int)((v - lo) / binWidth), 0, nBins - 1);
+        };
+        // Clip each reference to the bins it spans, counting where it
+        // enters and exits
+        int entries[nBins] = {}, exits[nBins] = {};
+        Bounds3f binBounds[nBins];
+        for (const WideBVHPrimitiveInfo& ref : refs) {
+          int b0 = binIndex(ref.bounds.pMin[a]);
+          int b1 = binIndex(ref.bounds.pMax[a]);
+          entries[b0]++;
+          exits[b1]++;
+          for (int b = b0; b <= b1; ++b) {
+            Bounds3f clipped = ref.bounds;
+            clipped.pMin[a] = std::max(clipped.pMin[a], binPos(b));
+            clipped.pMax[a] = std::min(clipped.pMax[a], binPos(b + 1));
+            binBounds[b] = Union(binBounds[b], clipped);
+          }
+        }
+        for (int i = 0; i < nBins - 1; ++i) {
+          Bounds3f b0, b1;
+          int count0 = 0, count1 = 0;
+          for (int j = 0; j <= i; ++j) {
+            b0 = Union(b0, binBounds[j]);
+            count0 += entries[j];
+          }
+          for (int j = i + 1; j < nBins; ++j) {
+            b1 = Union(b1, binBounds[j]);
+            count1 += exits[j];
+          }
+          if (count0 == 0 || count1 == 0) continue;
+          Float cost = .125f + (count0 * b0.SurfaceArea() +
+            count1 * b1.SurfaceArea()) / area;
+          if (cost < spatialCost) {
+            spatialCost = cost;
+            spatialDim = a;
+            spatialPos = binPos(i + 1);
+          }
+        }
+      }
+    }
+
+    // Create a leaf if neither split is worthwhile
+    Float minCost = std::min(objectCost, spatialCost);
+    if (nRefs <= maxPrimsInNode && (Float)nRefs <= minCost) return createLeaf();
+
+    // Partition references into _left_ and _right_
+    std::vector<WideBVHPrimitiveInfo> left, right;
+    if (spatialCost < objectCost) {
+      for (const WideBVHPrimitiveInfo& ref : refs) {
+        if (ref.bounds.pMax[spatialDim] <= spatialPos)
+          left.push_back(ref);
+        else if (ref.bounds.pMin[spatialDim] >= spatialPos)
+          right.push_back(ref);
+        else if (*splitBudgetRefs > 0) {
+          // Split the reference's bounds at the plane
+          Bounds3f b0 = ref.bounds, b1 = ref.bounds;
+          b0.pMax[spatialDim] = b1.pMin[spatialDim] = spatialPos;
+          left.push_back(WideBVHPrimitiveInfo(ref.primitiveNumber, b0));
+          right.push_back(WideBVHPrimitiveInfo(ref.primitiveNumber, b1));
+          --*splitBudgetRefs;
+          ++splitReferences;
+        }
+        else if (ref.centroid[spatialDim] < spatialPos)
+          left.push_back(ref);
+        else
+          right.push_back(ref);
+      }
+      ++spatialSplits;
+    }
+    else if (objectCost < Infinity) {
+      for (const WideBVHPrimitiveInfo& ref : refs)
+        (bucketIndex(ref.centroid) <= objectSplitBucket ? left : right)
+        .push_back(ref);
+    }
+    if (left.empty() || right.empty()) {
+      // Split references into equally-sized halves
+      left.clear();
+      right.clear();
+      int mid = nRefs / 2;
+      std::nth_element(refs.begin(), refs.begin() + mid, refs.end(),
+        [dim](const WideBVHPrimitiveInfo& a, const WideBVHPrimitiveInfo& b) {
+        return a.centroid[dim] < b.centroid[dim];
+      });
+      left.assign(refs.begin(), refs.begin() + mid);
+      right.assign(refs.begin() + mid, refs.end());
+    }
+    refs.clear();
+    refs.shrink_to_fit();
+    WideBVHBuildNode* c0 = spatialRecursiveBuild(arena, std::move(left),
+      depth + 1, rootArea, splitBudgetRefs, totalNodes, orderedPrims);
+    WideBVHBuildNode* c1 = spatialRecursiveBuild(arena, std::move(right),
+      depth + 1, rootArea, splitBudgetRefs, totalNodes, orderedPrims);
+    node->InitInterior(c0, c1);
+    return node;
+  }
+
+  WideBVHBuildNode* WideBVHAccel::linearBuild(
+    MemoryArena& arena, std::vector<std::unique_ptr<MemoryArena>>& taskArenas,
+    const std::vector<WideBVHPrimitiveInfo>& primitiveInfo, int* totalNodes,
+    std::vector<std::shared_ptr<Primitive>>& orderedPrims) {
+    // Compute bounding box of all primitive centroids
+    Bounds3f bounds;
+    for (const WideBVHPrimitiveInfo& pi : primitiveInfo)
+      bounds = Union(bounds, pi.centroid);
+
+    // Compute Morton indices of primitives
+    std::vector<WideBVHMortonPrimitive> mortonPrims(primitiveInfo.size());
+    NestableParallelFor([&](int64_t i) {
+      PBRT_CONSTEXPR int mortonScale = 1 << 10;
+      mortonPrims[i].primitiveIndex = primitiveInfo[i].primitiveNumber;
+      Vector3f centroidOffset = bounds.Offset(primitiveInfo[i].centroid);
+      mortonPrims[i].mortonCode = EncodeMorton(centroidOffset * mortonScale);
+    }, primitiveInfo.size(), 512);
+
+    // Radix sort primitive Morton indices
+    RadixSortMorton(&mortonPrims);
+
+    // Create treelets for primitives that share the top 12 Morton bits
+    std::vector<WideBVHTreelet> treelets;
+    const uint32_t treeletMask = 0b00111111111111000000000000000000;
+    for (int start = 0, end = 1; end <= (int)mortonPrims.size(); ++end) {
+      if (end == (int)mortonPrims.size() ||
+        ((mortonPrims[start].mortonCode & treeletMask) !=
+          (mortonPrims[end].mortonCode & treeletMask))) {
+        treelets.push_back({ start, end,
+                             mortonPrims[start].mortonCode & treeletMask,
+                             nullptr });
+        start = end;
+      }
+    }
+
+    // Build the treelets in parallel
+    size_t firstArena = taskArenas.size();
+    taskArenas.resize(firstArena + treelets.size());
+    std::vector<int> treeletNodes(treelets.size(), 0);
+    NestableParallelFor([&](int64_t i) {
+      WideBVHTreelet& treelet = treelets[i];
+      MemoryArena* treeletArena =
+        new MemoryArena(BuildArenaSize(treelet.end - treelet.start));
+      taskArenas[firstArena + i].reset(treeletArena);
+      const int firstBitIndex = 29 - 12;
+      treelet.root = emitLBVH(*treeletArena, primitiveInfo, &mortonPrims[0],
+        treelet.start, treelet.end, &treeletNodes[i],
+        orderedPrims, firstBitIndex);
+    }, treelets.size());
+    for (int n : treeletNodes) *totalNodes += n;
+
+    // Combine the treelets into the upper levels of the tree
+    if (buildMethod == BuildMethod::HLBVH)
+      return buildUpperSAH(arena, treelets, 0, treelets.size(), totalNodes);
+    return buildUpperLBVH(arena, treelets, 0, treelets.size(), totalNodes);
+  }
+
+  WideBVHBuildNode* WideBVHAccel::emitLBVH(
+    MemoryArena& arena, const std::vector<WideBVHPrimitiveInfo>& primitiveInfo,
+    const WideBVHMortonPrimitive* mortonPrims, int start, int end,
+    int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrims,
+    int bitIndex) const {
+    int nPrimitives = end - start;
+    CHECK_GT(nPrimitives, 0);
+    if (nPrimitives <= maxPrimsInNode) {
+      // Create and return leaf node of LBVH treelet
+      (*totalNodes)++;
+      WideBVHBuildNode* node = arena.Alloc<WideBVHBuildNode>();
+      Bounds3f bounds;
+      for (int i = start; i < end; ++i) {
+        int primitiveIndex = mortonPrims[i].primitiveIndex;
+        orderedPrims[i] = primitives[primitiveIndex];
+        bounds = Union(bounds, primitiveInfo[primitiveIndex].bounds);
+      }
+      node->InitLeaf(start, nPrimitives, bounds);
+      return node;
+    }
+    int splitOffset;
+    if (bitIndex < 0) {
+      // All Morton codes are equal; split the range in half
+      splitOffset = (start + end) / 2;
+    }
+    else {
+      int mask = 1 << bitIndex;
+      // Advance to next subtree level if there's no LBVH split for this bit
+      if ((mortonPrims[start].mortonCode & mask) ==
+        (mortonPrims[end - 1].mortonCode & mask))
+        return emitLBVH(arena, primitiveInfo, mortonPrims, start, end,
+          totalNodes, orderedPrims, bitIndex - 1);
+
+      // Find LBVH split point for this dimension
+      int searchStart = start, searchEnd = end - 1;
+      while (searchStart + 1 != searchEnd) {
+        CHECK_NE(searchStart, searchEnd);
+        int mid = (searchStart + searchEnd) / 2;
+        if ((mortonPrims[searchStart].mortonCode & mask) ==
+          (mortonPrims[mid].mortonCode & mask))
+          searchStart = mid;
+        else {
+          CHECK_EQ(mortonPrims[mid].mortonCode & mask,
+            mortonPrims[searchEnd].mortonCode & mask);
+          searchEnd = mid;
+        }
+      }
+      splitOffset = searchEnd;
+    }
+
+    // Create and return interior LBVH node
+    (*totalNodes)++;
+    WideBVHBuildNode* node = arena.Alloc<WideBVHBuildNode>();
+    WideBVHBuildNode* lbvh[2] = {
+      emitLBVH(arena, primitiveInfo, mortonPrims, start, splitOffset,
+        totalNodes, orderedPrims, bitIndex - 1),
+      emitLBVH(arena, primitiveInfo, mortonPrims, splitOffset, end,
+        totalNodes, orderedPrims, bitIndex - 1) };
+    node->InitInterior(lbvh[0], lbvh[1]);
+    return node;
+  }
+
+  WideBVHBuildNode* WideBVHAccel::buildUpperLBVH(
+    MemoryArena& arena, std::vector<WideBVHTreelet>& treelets, int start,
+    int end, int* totalNodes) const {
+    if (end - start == 1) return treelets[start].root;
+    // Split the treelets at the highest Morton bit in which they differ
+    uint32_t diff = treelets[start].mortonCode ^ treelets[end - 1].mortonCode;
+    uint32_t mask = 1u << Log2Int(diff);
+    int split = start + 1;
+    while ((treelets[split].mortonCode & mask) == 0) ++split;
+    (*totalNodes)++;
+    WideBVHBuildNode* node = arena.Alloc<WideBVHBuildNode>();
+    node->InitInterior(
+      buildUpperLBVH(arena, treelets, start, split, totalNodes),
+      buildUpperLBVH(arena, treelets, split, end, totalNodes));
+    return node;
+  }
+
+  WideBVHBuildNode* WideBVHAccel::buildUpperSAH(
+    MemoryArena& arena, std::vector<WideBVHTreelet>& treelets, int start,
+    int end, int* totalNodes) const {
+    CHECK_LT(start, end);
+    int nNodes = end - start;
+    if (nNodes == 1) return treelets[start].root;
+    (*totalNodes)++;
+    WideBVHBuildNode* node = arena.Alloc<WideBVHBuildNode>();
+
+    // Compute bounds of the treelets and of their centroids
+    Bounds3f bounds, centroidBounds;
+    for (int i = start; i < end; ++i) {
+      const Bounds3f& b = treelets[i].root->bounds;
+      bounds = Union(bounds, b);
+      centroidBounds = Union(centroidBounds, (b.pMin + b.pMax) * 0.5f);
+    }
+    int dim = centroidBounds.MaximumExtent();
+
+    int mid = (start + end) / 2;
+    if (centroidBounds.pMax[dim] != centroidBounds.pMin[dim]) {
+      // Allocate _BucketInfo_ for SAH partition buckets
+      PBRT_CONSTEXPR int nBuckets = 12;
+      struct BucketInfo {
+        int count = 0;
+        Bounds3f bounds;
+      };
+      BucketInfo buckets[nBuckets];
+      auto bucketIndex = [&](const WideBVHTreelet& treelet) {
+        const Bounds3f& b = treelet.root->bounds;
+        Float centroid = (b.pMin[dim] + b.pMax[dim]) * 0.5f;
+        int index = nBuckets * ((centroid - centroidBounds.pMin[dim]) /
+          (centroidBounds.pMax[dim] - centroidBounds.pMin[dim]));
+        if (index == nBuckets) index = nBuckets - 1;
+        CHECK_GE(index, 0);
+        CHECK_LT(index, nBuckets);
+        return index;
+      };
+
+      // Initialize _BucketInfo_ for treelet roots
+      for (int i = start; i < end; ++i) {
+        int b = bucketIndex(treelets[i]);
+        buckets[b].count++;
+        buckets[b].bounds = Union(buckets[b].bounds, treelets[i].root->bounds);
+      }
+
+      // Compute costs for splitting after each bucket
+      Float cost[nBuckets - 1];
+      for (int i = 0; i < nBuckets - 1; ++i) {
+        Bounds3f b0, b1;
+        int count0 = 0, count1 = 0;
+        for (int j = 0; j <= i; ++j) {
+          b0 = Union(b0, buckets[j].bounds);
+          count0 += buckets[j].count;
+        }
+        for (int j = i + 1; j < nBuckets; ++j) {
+          b1 = Union(b1, buckets[j].bounds);
+          count1 += buckets[j].count;
+        }
+        cost[i] = .125f + (count0 * b0.SurfaceArea() +
+          count1 * b1.SurfaceArea()) / bounds.SurfaceArea();
+      }
+
+      // Find bucket to split at that minimizes SAH metric
+      Float minCost = cost[0];
+      int minCostSplitBucket = 0;
+      for (int i = 1; i < nBuckets - 1; ++i) {
+        if (cost[i] < minCost) {
+          minCost = cost[i];
+          minCostSplitBucket = i;
+        }
+      }
+
+      // Split treelets at selected SAH bucket
+      WideBVHTreelet* pmid = std::partition(
+        &treelets[start], &treelets[end - 1] + 1,
+        [&](const WideBVHTreelet& treelet) {
+        return bucketIndex(treelet) <= minCostSplitBucket;
+      });
+      mid = pmid - &treelets[0];
+      if (mid == start || mid == end) mid = (start + end) / 2;
+    }
+    node->InitInterior(
+      buildUpperSAH(arena, treelets, start, mid, totalNodes),
+      buildUpperSAH(arena, treelets, mid, end, totalNodes));
+    return node;
+  }
+
+  int WideBVHAccel::collapseChildren(
+    WideBVHBuildNode* node, WideBVHBuildNode* children[WideBVHWidth]) const {
+    // A leaf at the root becomes the single child of the root wide node
+    if (node->nPrimitives > 0) {
+      children[0] = node;
+      return 1;
+    }
+    // Open the interior child with the largest surface area until full
+    int nChildren = 0;
+    children[nChildren++] = node->children[0];
+    children[nChildren++] = node->children[1];
+    while (nChildren < WideBVHWidth) {
+      int best = -1;
+      Float bestArea = -1;
+      for (int i = 0; i < nChildren; ++i) {
+        if (children[i]->nPrimitives == 0 &&
+          children[i]->bounds.SurfaceArea() > bestArea) {
+          best = i;
+          bestArea = children[i]->bounds.SurfaceArea();
+        }
+      }
+      if (best == -1) break;
+      WideBVHBuildNode* open = children[best];
+      children[best] = open->children[0];
+      children[nChildren++] = open->children[1];
+    }
+    return nChildren;
+  }
+
+  int WideBVHAccel::countWideNodes(WideBVHBuildNode* node) const {
+    WideBVHBuildNode* children[WideBVHWidth];
+    int nChildren = collapseChildren(node, children);
+    int count = 1;
+    for (int i = 0; i < nChildren; ++i)
+      if (children[i]->nPrimitives == 0)
+        count += countWideNodes(children[i]);
+    return count;
+  }
+
+  int WideBVHAccel::flattenWideBVH(WideBVHBuildNode* node, int* offset) {
+    WideBVHNode* wideNode = &nodes[*offset];
+    int myOffset = (*offset)++;
+    WideBVHBuildNode* children[WideBVHWidth];
+    int nChildren = collapseChildren(node, children);
+    ++totalInteriorNodes;
+    ++interiorNodes;
+    totalChildren += nChildren;
+    for (int i = 0; i < WideBVHWidth; ++i) {
+      if (i >= nChildren) {
+        // Initialize empty child slot
+        for (int a = 0; a < 3; ++a) {
+          wideNode->bMin[a][i] = Infinity;
+          wideNode->bMax[a][i] = -Infinity;
+        }
+        wideNode->offset[i] = 0;
+        wideNode->nPrimitives[i] = -1;
+        continue;
+      }
+      const WideBVHBuildNode* child = children[i];
+      for (int a = 0; a < 3; ++a) {
+        wideNode->bMin[a][i] = RoundBoundDown(child->bounds.pMin[a]);
+        wideNode->bMax[a][i] = RoundBoundUp(child->bounds.pMax[a]);
+      }
+      if (child->nPrimitives > 0) {
+        wideNode->offset[i] = child->firstPrimOffset;
+        wideNode->nPrimitives[i] = child->nPrimitives;
+        ++totalLeafNodes;
+        totalPrimitives += child->nPrimitives;
+      }
+      else {
+        wideNode->nPrimitives[i] = 0;
+        wideNode->offset[i] = flattenWideBVH(children[i], offset);
+      }
+    }
+    return myOffset;
+  }
+
+  void WideBVHAccel::layoutTreelets() {
+    // Nodes are already cache-line aligned; group them into treelets that
+    // fill _treeletBytes_
+    static_assert(sizeof(WideBVHNode) % PBRT_L1_CACHE_LINE_SIZE == 0 ||
+      PBRT_L1_CACHE_LINE_SIZE % sizeof(WideBVHNode) == 0,
+      "WideBVHNode should tile L1 cache lines");
+    int treeletNodes = treeletBytes / (int)sizeof(WideBVHNode);
+    if (treeletNodes <= 1 || totalWideNodes <= treeletNodes) return;
+
+    // Grow each treelet from its root by repeatedly adding the frontier
+    // node with the largest surface area, i.e. the one a ray that reached
+    // the treelet is most likely to visit next. The remaining frontier
+    // nodes root later treelets, so children still follow their parents.
+    auto childArea = [&](const WideBVHNode& node, int i) {
+      Bounds3f b(Point3f(node.bMin[0][i], node.bMin[1][i], node.bMin[2][i]),
+        Point3f(node.bMax[0][i], node.bMax[1][i], node.bMax[2][i]));
+      return b.SurfaceArea();
+    };
+    std::vector<int> order, roots(1, 0);
+    order.reserve(totalWideNodes);
+    std::vector<std::pair<Float, int>> frontier;
+    for (size_t r = 0; r < roots.size(); ++r) {
+      frontier.assign(1, std::make_pair(Infinity, roots[r]));
+      for (int n = 0; n < treeletNodes && !frontier.empty(); ++n) {
+        std::pop_heap(frontier.begin(), frontier.end());
+        int nodeIndex = frontier.back().second;
+        frontier.pop_back();
+        order.push_back(nodeIndex);
+        const WideBVHNode& node = nodes[nodeIndex];
+        for (int i = 0; i < WideBVHWidth; ++i)
+          if (node.nPrimitives[i] == 0) {
+            frontier.push_back(std::make_pair(childArea(node, i),
+              node.offset[i]));
+            std::push_heap(frontier.begin(), frontier.end());
+          }
+      }
+      for (const auto& f : frontier) roots.push_back(f.second);
+    }
+    CHECK_EQ((int)order.size(), totalWideNodes);
+
+    // Move the nodes into treelet order and lay the primitives out in the
+    // order their leaves now appear, so nearby leaves share cache lines
+    std::vector<int> newIndex(totalWideNodes);
+    for (int n = 0; n < totalWideNodes; ++n) newIndex[order[n]] = n;
+    WideBVHNode* orderedNodes = AllocAligned<WideBVHNode>(totalWideNodes);
+    std::vector<std::shared_ptr<Primitive>> orderedPrims;
+    orderedPrims.reserve(primitives.size());
+    for (int n = 0; n < totalWideNodes; ++n) {
+      WideBVHNode& node = orderedNodes[n];
+      node = nodes[order[n]];
+      for (int i = 0; i < WideBVHWidth; ++i) {
+        if (node.nPrimitives[i] == 0)
+          node.offset[i] = newIndex[node.offset[i]];
+        else if (node.nPrimitives[i] > 0) {
+          int first = node.offset[i];
+          node.offset[i] = orderedPrims.size();
+          for (int k = 0; k < node.nPrimitives[i]; ++k)
+            orderedPrims.push_back(primitives[first + k]);
+        }
+      }
+    }
+    CHECK_EQ(orderedPrims.size(), primitives.size());
+    FreeAligned(nodes);
+    nodes = orderedNodes;
+    primitives.swap(orderedPrims);
+  }
+
+  void WideBVHAccel::flattenQuantizedWideBVH(
+    WideBVHBuildNode* node, int nodeIndex, int* nextNode,
+    std::vector<std::shared_ptr<Primitive>>& nodeOrderedPrims) {
+    WideBVHQuantizedNode* qNode = &quantizedNodes[nodeIndex];
+    WideBVHBuildNode* children[WideBVHWidth];
+    int nChildren = collapseChildren(node, children);
+    ++totalInteriorNodes;
+    ++interiorNodes;
+    totalChildren += nChildren;
+
+    // Reserve consecutive nodes for interior children and append the leaf
+    // children's primitives
+    Bounds3f nodeBounds;
+    int nInterior = 0;
+    qNode->primBase = nodeOrderedPrims.size();
+    for (int i = 0; i < nChildren; ++i) {
+      const WideBVHBuildNode* child = children[i];
+      nodeBounds = Union(nodeBounds, child->bounds);
+      if (child->nPrimitives == 0) {
+        ++nInterior;
+        qNode->meta[i] = 0;
+        continue;
+      }
+      CHECK_LT(child->nPrimitives, 255);
+      qNode->meta[i] = child->nPrimitives;
+      for (int j = 0; j < child->nPrimitives; ++j)
+        nodeOrderedPrims.push_back(primitives[child->firstPrimOffset + j]);
+      ++totalLeafNodes;
+      totalPrimitives += child->nPrimitives;
+    }
+    qNode->childBase = *nextNode;
+    *nextNode += nInterior;
+    qNode->pad = 0;
+
+    // Quantize child bounds conservatively relative to the node's bounds
+    for (int a = 0; a < 3; ++a) {
+      float origin = RoundBoundDown(nodeBounds.pMin[a]);
+      float top = RoundBoundUp(nodeBounds.pMax[a]);
+      // Find the smallest power of two for which 255 steps reach _top_
+      int exponent = -126;
+      double extent = (double)top - (double)origin;
+      if (extent > 0) {
+        int exp;
+        std::frexp(extent / 255, &exp);
+        exponent = std::max(-126, exp - 1);
+      }
+      while (Dequantize(origin, 255, QuantizationScale(exponent)) < top)
+        ++exponent;
+      CHECK_LE(exponent, 127);
+      float scale = QuantizationScale(exponent);
+      qNode->origin[a] = origin;
+      qNode->exponent[a] = exponent;
+
+      for (int i = 0; i < WideBVHWidth; ++i) {
+        if (i >= nChildren) {
+          qNode->qMin[a][i] = 255;
+          qNode->qMax[a][i] = 0;
+          continue;
+        }
+        float cMin = RoundBoundDown(children[i]->bounds.pMin[a]);
+        float cMax = RoundBoundUp(children[i]->bounds.pMax[a]);
+        int qMin = Clamp((int)std::floor((cMin - origin) / scale), 0, 255);
+        int qMax = Clamp((int)std::ceil((cMax - origin) / scale), 0, 255);
+        // Correct for rounding so that the dequantized box encloses the child
+        while (qMin > 0 && Dequantize(origin, qMin, scale) > cMin) --qMin;
+        while (qMax < 255 && Dequantize(origin, qMax, scale) < cMax) ++qMax;
+        DCHECK_LE(Dequantize(origin, qMin, scale), cMin);
+        DCHECK_GE(Dequantize(origin, qMax, scale), cMax);
+        qNode->qMin[a][i] = qMin;
+        qNode->qMax[a][i] = qMax;
+      }
+    }
+    for (int i = nChildren; i < WideBVHWidth; ++i) qNode->meta[i] = 255;
+
+    // Flatten the interior children into their reserved nodes
+    for (int i = 0, child = qNode->childBase; i < nChildren; ++i)
+      if (children[i]->nPrimitives == 0)
+        flattenQuantizedWideBVH(children[i], child++, nextNode,
+          nodeOrderedPrims);
+  }
+
+  inline const WideBVHNode& WideBVHAccel::fetchNode(int offset,
+    WideBVHNode* scratch) const {
+    if (!quantizedNodes) return nodes[offset];
+    DecompressNode(quantizedNodes[offset], scratch);
+    return *scratch;
+  }
+
+  WideBVHAccel::~WideBVHAccel() {
+    if (cacheData)
+      UnmapCacheFile(cacheData, cacheDataSize);
+    else {
+      FreeAligned(nodes);
+      FreeAligned(quantizedNodes);
+    }
+    FreeAligned(triangleBlocks);
+  }
+
+  bool WideBVHAccel::Intersect(const Ray& ray,
+    SurfaceInteraction* isect) const {
+    if (!segments.empty()) return timeSegment(ray.time).Intersect(ray, isect);
+    if (totalWideNodes == 0) return false;
+    ProfilePhase p(Prof::AccelIntersect);
+    bool hit = false;
+    RayQuery query(ray);
+    // Follow ray through wide BVH nodes to find primitive intersections
+    struct StackEntry {
+      int32_t offset, nPrimitives;
+      Float tNear;
+    };
+    StackEntry todo[MaxTraversalDepth * WideBVHWidth];
+    int toVisitOffset = 0;
+    todo[toVisitOffset++] = { 0, 0, 0 };
+    while (toVisitOffset > 0) {
+      StackEntry entry = todo[--toVisitOffset];
+      // Skip entries that lie beyond the closest intersection found so far
+      if (entry.tNear > ray.tMax) continue;
+      if (entry.nPrimitives > 0) {
+        // Intersect ray with primitives in leaf
+        forEachLeafCandidate(query, entry.offset, entry.nPrimitives,
+          [&](int i) {
+          if (primitive(i)->Intersect(ray, isect)) hit = true;
+          return false;
+        });
+        continue;
+      }
+      // Push intersected children so that the closest one is popped first
+      Float tNear[WideBVHWidth];
+      WideBVHNode scratch;
+      const WideBVHNode& node = fetchNode(entry.offset, &scratch);
+      uint32_t mask = IntersectChildren(node, query, tNear);
+      int first = toVisitOffset;
+      while (mask) {
+        int i = CountTrailingZeros(mask);
+        mask &= mask - 1;
+        StackEntry child = { node.offset[i], node.nPrimitives[i], tNear[i] };
+        int j = toVisitOffset++;
+        DCHECK_LE(toVisitOffset, 64 * WideBVHWidth);
+        while (j > first && todo[j - 1].tNear < child.tNear) {
+          todo[j] = todo[j - 1];
+          --j;
+        }
+        todo[j] = child;
+      }
+    }
+    return hit;
+  }
+
+  bool WideBVHAccel::IntersectP(const Ray& ray) const {
+    return IntersectP(ray, nullptr);
+  }
+
+  bool WideBVHAccel::IntersectP(const Ray& ray,
+    const Primitive** occluder) const {
+    if (!segments.empty())
+      return timeSegment(ray.time).IntersectP(ray, occluder);
+    if (totalWideNodes == 0) return false;
+    ProfilePhase p(Prof::AccelIntersectP);
+    RayQuery query(ray);
+    struct StackEntry {
+      int32_t offset, nPrimitives;
+    };
+    StackEntry todo[MaxTraversalDepth * WideBVHWidth];
+    int toVisitOffset = 0;
+    todo[toVisitOffset++] = { 0, 0 };
+    while (toVisitOffset > 0) {
+      StackEntry entry = todo[--toVisitOffset];
+      Float tNear[WideBVHWidth];
+      WideBVHNode scratch;
+      const WideBVHNode& node = fetchNode(entry.offset, &scratch);
+      uint32_t mask = IntersectChildren(node, query, tNear);
+      // Any hit terminates traversal, so test leaf children as soon as
+      // they are found and only push interior children, unsorted
+      while (mask) {
+        int i = CountTrailingZeros(mask);
+        mask &= mask - 1;
+        if (node.nPrimitives[i] > 0) {
+          const Primitive* hitPrim = nullptr;
+          forEachLeafCandidate(query, node.offset[i], node.nPrimitives[i],
+            [&](int j) {
+            if (!primitive(j)->IntersectP(ray)) return false;
+            hitPrim = primitive(j);
+            return true;
+          });
+          if (hitPrim) {
+            if (occluder) *occluder = hitPrim;
+            return true;
+          }
+        }
+        else {
+          todo[toVisitOffset++] = { node.offset[i], node.nPrimitives[i] };
+          DCHECK_LE(toVisitOffset, 64 * WideBVHWidth);
+        }
+      }
+    }
+    return false;
+  }
+
+  void WideBVHAccel::IntersectPacket(Ray* const* rays, int nRays,
+    SurfaceInteraction* isects,
+    bool* hits) const {
+    for (int i = 0; i < nRays; ++i) hits[i] = false;
+    if (totalWideNodes == 0 && segments.empty()) return;
+    ProfilePhase p(Prof::AccelIntersect);
+    // With time segments, packets are formed per segment and octant
+    int nGroups = 8 * std::max<int>(1, segments.size());
+    for (int start = 0; start < nRays; start += MaxPacketSize) {
+      int n = std::min(nRays - start, MaxPacketSize);
+      // Sort rays into packets by direction octant
+      int octant[MaxPacketSize], octantStart[8 * MaxTimeSegments + 1] = { 0 };
+      for (int i = 0; i < n; ++i) {
+        const Ray& ray = *rays[start + i];
+        Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+        if (std::isinf(invDir.x) || std::isinf(invDir.y) ||
+          std::isinf(invDir.z)) {
+          // Trace rays parallel to a slab individually
+          hits[start + i] = Intersect(ray, &isects[start + i]);
+          octant[i] = -1;
+          continue;
+        }
+        octant[i] = (invDir.x < 0) | ((invDir.y < 0) << 1) |
+          ((invDir.z < 0) << 2);
+        if (!segments.empty()) octant[i] += 8 * timeSegmentIndex(ray.time);
+        ++octantStart[octant[i] + 1];
+      }
+      for (int o = 0; o < nGroups; ++o) octantStart[o + 1] += octantStart[o];
+      int index[MaxPacketSize], next[8 * MaxTimeSegments];
+      for (int o = 0; o < nGroups; ++o) next[o] = octantStart[o];
+      for (int i = 0; i < n; ++i)
+        if (octant[i] >= 0) index[next[octant[i]]++] = i;
+
+      // Trace each octant's rays as a packet
+      for (int o = 0; o < nGroups; ++o) {
+        int count = octantStart[o + 1] - octantStart[o];
+        if (count == 0) continue;
+        const WideBVHAccel& accel =
+          segments.empty() ? *this : *segments[o / 8];
+        accel.intersectPacket(rays + start, index + octantStart[o], count,
+          isects + start, hits + start);
+      }
+    }
+  }
+
+  void WideBVHAccel::intersectPacket(Ray* const* rays, const int* index,
+    int nRays, SurfaceInteraction* isects,
+    bool* hits) const {
+    ++totalPackets;
+    totalPacketRays += nRays;
+    // Compute per-ray queries and the packet's interval bounds
+    Point3f o[MaxPacketSize];
+    Vector3f invDir[MaxPacketSize];
+    RayQuery query[MaxPacketSize];
+    Point3f oMin(Infinity, Infinity, Infinity), oMax(-Infinity, -Infinity,
+      -Infinity);
+    Vector3f invDirMin(Infinity, Infinity, Infinity),
+      invDirMax(-Infinity, -Infinity, -Infinity);
+    Float packetTMax = 0;
+    for (int k = 0; k < nRays; ++k) {
+      const Ray& ray = *rays[index[k]];
+      query[k] = RayQuery(ray);
+      o[k] = ray.o;
+      invDir[k] = query[k].invDir;
+      oMin = Min(oMin, o[k]);
+      oMax = Max(oMax, o[k]);
+      invDirMin = Min(invDirMin, invDir[k]);
+      invDirMax = Max(invDirMax, invDir[k]);
+      packetTMax = std::max(packetTMax, ray.tMax);
+    }
+    int dirIsNeg[3] = { invDir[0].x < 0, invDir[0].y < 0, invDir[0].z < 0 };
+
+    // Traverse the wide BVH with the packet, tracking the range of rays that
+    // are still active in each subtree
+    struct StackEntry {
+      int32_t offset, nPrimitives;
+      int first, last;
+      Float tNear;
+    };
+    StackEntry todo[MaxTraversalDepth * WideBVHWidth];
+    int toVisitOffset = 0;
+    todo[toVisitOffset++] = { 0, 0, 0, nRays - 1, 0 };
+    while (toVisitOffset > 0) {
+      StackEntry entry = todo[--toVisitOffset];
+      if (entry.tNear > packetTMax) continue;
+      if (entry.nPrimitives > 0) {
+        // Intersect the active rays with the primitives in the leaf
+        bool anyHit = false;
+        for (int k = entry.first; k <= entry.last; ++k) {
+          int r = index[k];
+          forEachLeafCandidate(query[k], entry.offset,
+            entry.nPrimitives, [&](int i) {
+            if (primitive(i)->Intersect(*rays[r], &isects[r]))
+              hits[r] = anyHit = true;
+            return false;
+          });
+        }
+        if (anyHit) {
+          packetTMax = 0;
+          for (int k = 0; k < nRays; ++k)
+            packetTMax = std::max(packetTMax, rays[index[k]]->tMax);
+        }
+        continue;
+      }
+      // Cull children with the packet's interval bounds, then narrow the
+      // active range to the first and last rays that hit each child
+      Float tNear[WideBVHWidth];
+      WideBVHNode scratch;
+      const WideBVHNode& node = fetchNode(entry.offset, &scratch);
+      uint32_t mask = IntersectChildrenInterval(
+        node, oMin, oMax, invDirMin, invDirMax, dirIsNeg, packetTMax, tNear);
+      int first = toVisitOffset;
+      while (mask) {
+        int i = CountTrailingZeros(mask);
+        mask &= mask - 1;
+        int f = entry.first;
+        while (f <= entry.last &&
+          !IntersectChild(node, i, o[f], invDir[f], dirIsNeg,
+            rays[index[f]]->tMax))
+          ++f;
+        if (f > entry.last) continue;
+        int l = entry.last;
+        while (l > f && !IntersectChild(node, i, o[l], invDir[l], dirIsNeg,
+          rays[index[l]]->tMax))
+          --l;
+        StackEntry child = { node.offset[i], node.nPrimitives[i], f, l,
+                             tNear[i] };
+        int j = toVisitOffset++;
+        DCHECK_LE(toVisitOffset, 64 * WideBVHWidth);
+        while (j > first && todo[j - 1].tNear < child.tNear) {
+          todo[j] = todo[j - 1];
+          --j;
+        }
+        todo[j] = child;
+      }
+    }
+  }
+
+  uint64_t WideBVHAccel::IntersectPPacket(const Ray* rays, int nRays,
+    const Primitive** occluders) const {
+    CHECK_LE(nRays, MaxShadowPacketSize);
+    uint64_t occluded = 0;
+    if (!segments.empty()) {
+      // Rays in a batch generally have different times
+      for (int i = 0; i < nRays; ++i)
+        if (timeSegment(rays[i].time).IntersectP(rays[i],
+          occluders ? &occluders[i] : nullptr))
+          occluded |= uint64_t(1) << i;
+      return occluded;
+    }
+    if (totalWideNodes == 0) return 0;
+    ProfilePhase p(Prof::AccelIntersectP);
+    // Sort rays into packets by direction octant
+    int octant[MaxShadowPacketSize], octantStart[9] = { 0 };
+    for (int i = 0; i < nRays; ++i) {
+      const Ray& ray = rays[i];
+      Vector3f invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z);
+      if (std::isinf(invDir.x) || std::isinf(invDir.y) ||
+        std::isinf(invDir.z)) {
+        // Trace rays parallel to a slab individually
+        if (IntersectP(ray, occluders ? &occluders[i] : nullptr))
+          occluded |= uint64_t(1) << i;
+        octant[i] = -1;
+        continue;
+      }
+      octant[i] = (invDir.x < 0) | ((invDir.y < 0) << 1) |
+        ((invDir.z < 0) << 2);
+      ++octantStart[octant[i] + 1];
+    }
+    for (int o = 0; o < 8; ++o) octantStart[o + 1] += octantStart[o];
+    int index[MaxShadowPacketSize], next[8];
+    for (int o = 0; o < 8; ++o) next[o] = octantStart[o];
+    for (int i = 0; i < nRays; ++i)
+      if (octant[i] >= 0) index[next[octant[i]]++] = i;
+
+    // Trace each octant's rays as a packet
+    for (int o = 0; o < 8; ++o) {
+      int count = octantStart[o + 1] - octantStart[o];
+      if (count > 0)
+        occluded |= intersectPPacket(rays, index + octantStart[o], count,
+          occluders);
+    }
+    return occluded;
+  }
+
+  uint64_t WideBVHAccel::intersectPPacket(const Ray* rays, const int* index,
+    int nRays, const Primitive** occluders) const {
+    ++totalShadowPackets;
+    totalShadowPacketRays += nRays;
+    // Compute per-ray queries and the packet's interval bounds; occluded
+    // rays are retired by setting their _tMax_ below zero
+    Point3f o[MaxShadowPacketSize];
+    Vector3f invDir[MaxShadowPacketSize];
+    RayQuery query[MaxShadowPacketSize];
+    Float tMax[MaxShadowPacketSize];
+    Point3f oMin(Infinity, Infinity, Infinity), oMax(-Infinity, -Infinity,
+      -Infinity);
+    Vector3f invDirMin(Infinity, Infinity, Infinity),
+      invDirMax(-Infinity, -Infinity, -Infinity);
+    Float packetTMax = 0;
+    for (int k = 0; k < nRays; ++k) {
+      const Ray& ray = rays[index[k]];
+      query[k] = RayQuery(ray);
+      o[k] = ray.o;
+      invDir[k] = query[k].invDir;
+      tMax[k] = ray.tMax;
+      oMin = Min(oMin, o[k]);
+      oMax = Max(oMax, o[k]);
+      invDirMin = Min(invDirMin, invDir[k]);
+      invDirMax = Max(invDirMax, invDir[k]);
+      packetTMax = std::max(packetTMax, ray.tMax);
+    }
+    int dirIsNeg[3] = { invDir[0].x < 0, invDir[0].y < 0, invDir[0].z < 0 };
+
+    // Traverse the wide BVH with the packet until every ray is occluded,
+    // testing leaf children as soon as they are found
+    struct StackEntry {
+      int32_t offset;
+      int first, last;
+    };
+    StackEntry todo[MaxTraversalDepth * WideBVHWidth];
+    int toVisitOffset = 0;
+    todo[toVisitOffset++] = { 0, 0, nRays - 1 };
+    uint64_t occluded = 0;
+    int nActive = nRays;
+    while (toVisitOffset > 0) {
+      StackEntry entry = todo[--toVisitOffset];
+      Float tNear[WideBVHWidth];
+      WideBVHNode scratch;
+      const WideBVHNode& node = fetchNode(entry.offset, &scratch);
+      uint32_t mask = IntersectChildrenInterval(
+        node, oMin, oMax, invDirMin, invDirMax, dirIsNeg, packetTMax, tNear);
+      while (mask) {
+        int i = CountTrailingZeros(mask);
+        mask &= mask - 1;
+        // Narrow the active range to the first and last rays that hit
+        int f = entry.first;
+        while (f <= entry.last &&
+          !IntersectChild(node, i, o[f], invDir[f], dirIsNeg, tMax[f]))
+          ++f;
+        if (f > entry.last) continue;
+        int l = entry.last;
+        while (l > f &&
+          !IntersectChild(node, i, o[l], invDir[l], dirIsNeg, tMax[l]))
+          --l;
+        if (node.nPrimitives[i] == 0) {
+          todo[toVisitOffset++] = { node.offset[i], f, l };
+          DCHECK_LE(toVisitOffset, 64 * WideBVHWidth);
+          continue;
+        }
+        for (int k = f; k <= l; ++k) {
+          if (tMax[k] < 0) continue;
+          int r = index[k];
+          const Primitive* hitPrim = nullptr;
+          forEachLeafCandidate(query[k], node.offset[i],
+            node.nPrimitives[i], [&](int j) {
+            if (!primitive(j)->IntersectP(rays[r])) return false;
+            hitPrim = primitive(j);
+            return true;
+          });
+          if (hitPrim) {
+            occluded |= uint64_t(1) << r;
+            if (occluders) occluders[r] = hitPrim;
+            tMax[k] = -1;
+            if (--nActive == 0) return occluded;
+          }
+        }
+      }
+    }
+    return occluded;
+  }
+
+  std::shared_ptr<WideBVHAccel> CreateWideBVHAccelerator(
+    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet& ps) {
+    // Previews default to the fast linear build
+    std::string buildMethodName = ps.FindOneString(
+      "buildmethod", PbrtOptions.quickRender ? "lbvh" : "sah");
+    WideBVHAccel::BuildMethod buildMethod;
+    if (buildMethodName == "sah")
+      buildMethod = WideBVHAccel::BuildMethod::SAH;
+    else if (buildMethodName == "lbvh")
+      buildMethod = WideBVHAccel::BuildMethod::LBVH;
+    else if (buildMethodName == "hlbvh")
+      buildMethod = WideBVHAccel::BuildMethod::HLBVH;
+    else if (buildMethodName == "sbvh")
+      buildMethod = WideBVHAccel::BuildMethod::SBVH;
+    else {
+      Warning("Wide BVH build method \"%s\" unknown.  Using \"sah\".",
+        buildMethodName.c_str());
+      buildMethod = WideBVHAccel::BuildMethod::SAH;
+    }
+    int maxPrimsInNode = ps.FindOneInt("maxnodeprims", 4);
+    bool quantized = ps.FindOneBool("quantize", false);
+    std::string cacheDir = ps.FindOneString("cachedir", PbrtOptions.bvhCacheDir);
+    bool refittable = ps.FindOneBool("refit", false);
+    if (refittable && quantized) {
+      Warning("Quantized wide BVHs can't be refit.  Ignoring \"refit\".");
+      refittable = false;
+    }
+    Float splitBudget = ps.FindOneFloat("splitbudget", .3f);
+    int timeSegments = ps.FindOneInt("timesegments", 1);
+    if (timeSegments < 1 || timeSegments > WideBVHAccel::MaxTimeSegments) {
+      Warning("Wide BVH \"timesegments\" must be between 1 and %d.",
+        WideBVHAccel::MaxTimeSegments);
+      timeSegments = Clamp(timeSegments, 1, WideBVHAccel::MaxTimeSegments);
+    }
+    // Nodes are grouped into treelets of this many bytes; zero keeps the
+    // depth-first layout
+    int treeletBytes = ps.FindOneInt("treeletbytes",
+      64 * PBRT_L1_CACHE_LINE_SIZE);
+    // Leaf triangles are only tested together if asked for, since their
+    // vertex blocks cost about 36 bytes per triangle
+    bool triangleBlocks = ps.FindOneBool("triangleblocks", false);
+    return std::make_shared<WideBVHAccel>(std::move(prims), maxPrimsInNode,
+      buildMethod, quantized, cacheDir, refittable,
+      std::max(splitBudget, (Float)0), timeSegments,
+      std::max(treeletBytes, 0), triangleBlocks);
+  }
+
+}  // namespace pbrt
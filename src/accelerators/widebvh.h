@@ -0,0 +1,217 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_ACCELERATORS_WIDEBVH_H
+#define PBRT_ACCELERATORS_WIDEBVH_H
+
+// accelerators/widebvh.h*
+#include "pbrt.h"
+#include "primitive.h"
+#include <unordered_map>
+
+namespace pbrt {
+
+  // WideBVHAccel Forward Declarations
+  struct WideBVHBuildNode;
+  struct WideBVHPrimitiveInfo;
+  struct WideBVHSubtreeTask;
+  struct WideBVHMortonPrimitive;
+  struct WideBVHTreelet;
+  struct WideBVHNode;
+  struct WideBVHQuantizedNode;
+  struct WideBVHTriangleBlock;
+
+  // WideBVHAccel Declarations
+  PBRT_CONSTEXPR int WideBVHWidth = 8;
+
+  // A triangle of a mesh, which additionally gives the wide BVH access to
+  // its world-space vertices so that the triangles of a leaf can be tested
+  // together before the exact per-shape intersection routines are called.
+  class TrianglePrimitive : public GeometricPrimitive {
+  public:
+    // TrianglePrimitive Public Methods
+    TrianglePrimitive(const std::shared_ptr<Shape>& shape,
+      const std::shared_ptr<Material>& material,
+      const std::shared_ptr<AreaLight>& areaLight,
+      const MediumInterface& mediumInterface,
+      std::shared_ptr<const std::vector<Point3f>> worldP, const int* v)
+      : GeometricPrimitive(shape, material, areaLight, mediumInterface),
+      worldP(std::move(worldP)) {
+      for (int i = 0; i < 3; ++i) this->v[i] = v[i];
+    }
+    void GetVertices(Point3f p[3]) const {
+      for (int i = 0; i < 3; ++i) p[i] = (*worldP)[v[i]];
+    }
+
+  private:
+    // TrianglePrimitive Private Data
+    std::shared_ptr<const std::vector<Point3f>> worldP;
+    int v[3];
+  };
+
+  class WideBVHAccel : public Aggregate {
+  public:
+    // WideBVHAccel Public Types
+    enum class BuildMethod { SAH, LBVH, HLBVH, SBVH };
+    static PBRT_CONSTEXPR int MaxTimeSegments = 8;
+    static PBRT_CONSTEXPR int MaxShadowPacketSize = 64;
+
+    // WideBVHAccel Public Methods
+    WideBVHAccel(std::vector<std::shared_ptr<Primitive>> p,
+      int maxPrimsInNode = 4, BuildMethod buildMethod = BuildMethod::SAH,
+      bool quantized = false, const std::string& cacheDir = "",
+      bool refittable = false, Float splitBudget = .3f,
+      int timeSegments = 1,
+      int treeletBytes = 64 * PBRT_L1_CACHE_LINE_SIZE,
+      bool triangleBlocks = false);
+    Bounds3f WorldBound() const;
+    ~WideBVHAccel();
+    bool Intersect(const Ray& ray, SurfaceInteraction* isect) const;
+    bool IntersectP(const Ray& ray) const;
+    bool IntersectP(const Ray& ray, const Primitive** occluder) const;
+    uint64_t IntersectPPacket(const Ray* rays, int nRays,
+      const Primitive** occluders = nullptr) const;
+    void IntersectPacket(Ray* const* rays, int nRays,
+      SurfaceInteraction* isects, bool* hits) const;
+    bool Refit(std::vector<std::shared_ptr<Primitive>> p,
+      Float rebuildThreshold);
+
+  private:
+    // WideBVHAccel Private Methods
+    WideBVHAccel(const WideBVHAccel& parent, Float time0, Float time1,
+      const std::unordered_map<const Primitive*, uint32_t>& parentIndex,
+      const std::string& cacheDir);
+    void build(const std::string& cacheDir);
+    bool buildTimeSegments(const std::string& cacheDir);
+    int timeSegmentIndex(Float time) const;
+    const Primitive* primitive(int i) const {
+      return sharedPrimitives ? (*sharedPrimitives)[primitiveIndices[i]].get()
+        : primitives[i].get();
+    }
+    const WideBVHAccel& timeSegment(Float time) const;
+    Bounds3f primitiveBound(const Primitive& prim) const;
+    WideBVHBuildNode* sahBuild(
+      MemoryArena& arena, std::vector<std::unique_ptr<MemoryArena>>& taskArenas,
+      std::vector<WideBVHPrimitiveInfo>& primitiveInfo, int* totalNodes,
+      std::vector<std::shared_ptr<Primitive>>& orderedPrims);
+    WideBVHBuildNode* recursiveBuild(
+      MemoryArena& arena, std::vector<WideBVHPrimitiveInfo>& primitiveInfo,
+      int start, int end, int* totalNodes,
+      std::vector<std::shared_ptr<Primitive>>& orderedPrims,
+      std::vector<WideBVHSubtreeTask>* subtrees, int subtreeThreshold);
+    WideBVHBuildNode* spatialBuild(
+      MemoryArena& arena, std::vector<WideBVHPrimitiveInfo>& primitiveInfo,
+      int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrims);
+    WideBVHBuildNode* spatialRecursiveBuild(
+      MemoryArena& arena, std::vector<WideBVHPrimitiveInfo> refs, int depth,
+      Float rootArea, int* splitBudgetRefs, int* totalNodes,
+      std::vector<std::shared_ptr<Primitive>>& orderedPrims);
+    WideBVHBuildNode* linearBuild(
+      MemoryArena& arena, std::vector<std::unique_ptr<MemoryArena>>& taskArenas,
+      const std::vector<WideBVHPrimitiveInfo>& primitiveInfo, int* totalNodes,
+      std::vector<std::shared_ptr<Primitive>>& orderedPrims);
+    WideBVHBuildNode* emitLBVH(
+      MemoryArena& arena, const std::vector<WideBVHPrimitiveInfo>& primitiveInfo,
+      const WideBVHMortonPrimitive* mortonPrims, int start, int end,
+      int* totalNodes, std::vector<std::shared_ptr<Primitive>>& orderedPrims,
+      int bitIndex) const;
+    WideBVHBuildNode* buildUpperLBVH(MemoryArena& arena,
+      std::vector<WideBVHTreelet>& treelets,
+      int start, int end, int* totalNodes) const;
+    WideBVHBuildNode* buildUpperSAH(MemoryArena& arena,
+      std::vector<WideBVHTreelet>& treelets,
+      int start, int end, int* totalNodes) const;
+    int collapseChildren(WideBVHBuildNode* node,
+      WideBVHBuildNode* children[WideBVHWidth]) const;
+    int countWideNodes(WideBVHBuildNode* node) const;
+    int flattenWideBVH(WideBVHBuildNode* node, int* offset);
+    void layoutTreelets();
+    void flattenQuantizedWideBVH(
+      WideBVHBuildNode* node, int nodeIndex, int* nextNode,
+      std::vector<std::shared_ptr<Primitive>>& nodeOrderedPrims);
+    const WideBVHNode& fetchNode(int offset, WideBVHNode* scratch) const;
+    uint64_t cacheKey(
+      const std::vector<WideBVHPrimitiveInfo>& primitiveInfo) const;
+    bool loadCache(const std::string& filename, uint64_t key);
+    bool validateNodes(int nReferences) const;
+    void writeCache(const std::string& filename, uint64_t key) const;
+    Float sahCost() const;
+    void buildTriangleBlocks();
+    template <typename Func>
+    void forEachLeafCandidate(const RayQuery& query, int offset,
+      int nPrimitives, Func func) const;
+    void intersectPacket(Ray* const* rays, const int* index, int nRays,
+      SurfaceInteraction* isects, bool* hits) const;
+    uint64_t intersectPPacket(const Ray* rays, const int* index, int nRays,
+      const Primitive** occluders) const;
+
+    // WideBVHAccel Private Data
+    const int maxPrimsInNode;
+    const BuildMethod buildMethod;
+    const bool quantized;
+    const bool refittable;
+    const Float splitBudget;
+    const int nTimeSegments;
+    const int treeletBytes;
+    const bool useTriangleBlocks;
+    std::vector<std::shared_ptr<Primitive>> primitives;
+    // Time segments index the primitives of the tree that built them
+    // rather than holding their own references
+    const std::vector<std::shared_ptr<Primitive>>* sharedPrimitives = nullptr;
+    std::vector<uint32_t> primitiveIndices;
+    Bounds3f bounds;
+    WideBVHNode* nodes = nullptr;
+    WideBVHQuantizedNode* quantizedNodes = nullptr;
+    int totalWideNodes = 0;
+    void* cacheData = nullptr;
+    size_t cacheDataSize = 0;
+    WideBVHTriangleBlock* triangleBlocks = nullptr;
+    std::vector<uint8_t> triangleLanes;
+    std::vector<int32_t> inputIndex;
+    size_t nInputPrimitives = 0;
+    Float initialCost = 0;
+    Float segmentTime[2] = { 0, 0 };
+    Float timeRange[2] = { 0, 0 };
+    std::vector<std::unique_ptr<WideBVHAccel>> segments;
+  };
+
+  std::shared_ptr<WideBVHAccel> CreateWideBVHAccelerator(
+    std::vector<std::shared_ptr<Primitive>> prims, const ParamSet& ps);
+
+}  // namespace pbrt
+
+#endif  // PBRT_ACCELERATORS_WIDEBVH_H
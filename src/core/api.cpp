@@ -32,6 +32,9 @@
 
  // core/api.cpp*
 #include "api.h"
+#include "binaryscene.h"
+#include "shapeinclude.h"
+#include "nestedparallel.h"
 #include "parallel.h"
 #include "paramset.h"
 #include "spectrum.h"
@@ -42,7 +45,9 @@
 
 // API Additional Headers
 #include "accelerators/bvh.h"
+#include "accelerators/instance.h"
 #include "accelerators/kdtreeaccel.h"
+#include "accelerators/widebvh.h"
 #include "cameras/environment.h"
 #include "cameras/orthographic.h"
 #include "cameras/perspective.h"
@@ -59,6 +64,7 @@
 #include "integrators/path.h"
 #include "integrators/sppm.h"
 #include "integrators/volpath.h"
+#include "integrators/wavefront.h"
 #include "integrators/whitted.h"
 #include "lights/diffuse.h"
 #include "lights/distant.h"
@@ -87,6 +93,7 @@
 #include "samplers/sobol.h"
 #include "samplers/stratified.h"
 #include "samplers/zerotwosequence.h"
+#include "shapes/compressedtriangle.h"
 #include "shapes/cone.h"
 #include "shapes/curve.h"
 #include "shapes/cylinder.h"
@@ -98,6 +105,7 @@
 #include "shapes/paraboloid.h"
 #include "shapes/sphere.h"
 #include "shapes/triangle.h"
+#include "shapes/mappedply.h"
 #include "shapes/plymesh.h"
 #include "textures/bilerp.h"
 #include "textures/checkerboard.h"
@@ -115,7 +123,10 @@
 #include "media/grid.h"
 #include "media/homogeneous.h"
 
+#include <atomic>
 #include <map>
+#include <mutex>
+#include <tuple>
 #include <stdio.h>
 
 namespace pbrt {
@@ -155,6 +166,13 @@ namespace pbrt {
     Transform t[MaxTransforms];
   };
 
+  // InstanceUse records an _ObjectInstance_ statement; the instances'
+  // aggregates are built and placed in the scene by _MakeScene()_.
+  struct InstanceUse {
+    std::string name;
+    Transform* instanceToWorld[MaxTransforms];
+  };
+
   struct RenderOptions {
     // RenderOptions Public Methods
     Integrator* MakeIntegrator() const;
@@ -171,6 +189,7 @@ namespace pbrt {
     ParamSet SamplerParams;
     std::string AcceleratorName = "bvh";
     ParamSet AcceleratorParams;
+    bool triangleBlocks = false;
     std::string IntegratorName = "path";
     ParamSet IntegratorParams;
     std::string CameraName = "perspective";
@@ -181,6 +200,7 @@ namespace pbrt {
     std::vector<std::shared_ptr<Primitive>> primitives;
     std::map<std::string, std::vector<std::shared_ptr<Primitive>>> instances;
     std::vector<std::shared_ptr<Primitive>>* currentInstance = nullptr;
+    std::vector<InstanceUse> instanceUses;
     bool haveScatteringMedia = false;
   };
 
@@ -209,7 +229,8 @@ namespace pbrt {
       std::shared_ptr<Material> mtl(CreateMatteMaterial(tp));
       currentMaterial = std::make_shared<MaterialInstance>("matte", mtl, ParamSet());
     }
-    std::shared_ptr<Material> GetMaterialForShape(const ParamSet& geomParams);
+    std::shared_ptr<Material> GetMaterialForShape(
+      const ParamSet& geomParams) const;
     MediumInterface CreateMediumInterface();
 
     // Graphics State
@@ -239,6 +260,50 @@ namespace pbrt {
     bool reverseOrientation = false;
   };
 
+  // ShapeState is the graphics state, with its media resolved, that shapes
+  // are created under. Consecutive shapes share one snapshot of it until the
+  // state next changes.
+  struct ShapeState {
+    ShapeState(const GraphicsState& graphicsState,
+      const MediumInterface& mediumInterface)
+      : graphicsState(graphicsState), mediumInterface(mediumInterface) {}
+    const GraphicsState graphicsState;
+    const MediumInterface mediumInterface;
+  };
+
+  // Includes whose files have the same contents and that were made under
+  // the same material, textures, orientation and media create identical
+  // geometry up to their transformation; they are given the same key and
+  // share a single instance definition. Uses whose transformation swaps
+  // handedness needn't be kept apart: _InstancePrimitive_ carries the
+  // normals of a hit through the inverse transpose of the use's
+  // transformation, which orients them as the shapes would have.
+  using IncludeKey = std::tuple<uint64_t, const MaterialInstance*,
+    const void*, const void*, bool, const Medium*, const Medium*>;
+
+  // PendingShape records a _Shape_ statement, or a shape-only _Include_,
+  // along with the state in effect where it appeared. The shapes of all
+  // pending statements are created in parallel just before the scene is
+  // built.
+  struct PendingShape {
+    // Shape name and parameters, or the parsed file for an _Include_
+    std::string name;
+    ParamSet params;
+    std::string includeFilename;
+    std::shared_ptr<const ShapeIncludeFile> include;
+    IncludeKey includeKey;
+
+    Transform* objToWorld[MaxTransforms];
+    std::shared_ptr<const ShapeState> state;
+    // Instance definition to add the shapes to, if any
+    std::vector<std::shared_ptr<Primitive>>* instance;
+    // Number of lights defined before the statement
+    size_t lightOffset;
+
+    std::vector<std::shared_ptr<Primitive>> prims;
+    std::vector<std::shared_ptr<AreaLight>> areaLights;
+  };
+
   STAT_MEMORY_COUNTER("Memory/TransformCache", transformCacheBytes);
   STAT_PERCENT("Scene/TransformCache hits", nTransformCacheHits, nTransformCacheLookups);
   STAT_INT_DISTRIBUTION("Scene/Probes per TransformCache lookup", transformCacheProbes);
@@ -256,53 +321,132 @@ namespace pbrt {
   // The hash table size is always a power of two, allowing for the use of a
   // bitwise AND to turn hash values into table offsets.  Quadratic probing
   // is used when there is a hash collision.
+  //
+  // Shapes and instances may be created from several threads at once, so
+  // the table is split into shards selected by the high bits of the hash.
+  // Lookups of transformations that are already present don't lock: each
+  // shard's table is only ever published once it is fully built, and its
+  // entries are set just once. Inserts lock their shard, allocate from the
+  // shard's arena and replace the table with a larger copy when it fills
+  // up; replaced tables stay around until _Clear()_ since other threads may
+  // still be probing them. Identity transformations aren't stored at all,
+  // and pure translations are hashed by their offset alone.
   class TransformCache {
   public:
-    TransformCache()
-      : hashTable(512), hashTableOccupancy(0) {}
+    TransformCache() {
+      for (Shard& shard : shards) shard.Reset();
+    }
 
     // TransformCache Public Methods
     Transform* Lookup(const Transform& t) {
       ++nTransformCacheLookups;
-
-      int offset = Hash(t) & (hashTable.size() - 1);
-      int step = 1;
-      while (true) {
-        // Keep looking until we find the Transform or determine that
-        // it's not present.
-        if (!hashTable[offset] || *hashTable[offset] == t)
-          break;
-        // Advance using quadratic probing.
-        offset = (offset + step * step) & (hashTable.size() - 1);
-        ++step;
-      }
-      ReportValue(transformCacheProbes, step);
-      Transform* tCached = hashTable[offset];
-      if (tCached)
+      if (t.IsIdentity()) {
         ++nTransformCacheHits;
-      else {
-        tCached = arena.Alloc<Transform>();
-        *tCached = t;
-        Insert(tCached);
+        return &identity;
+      }
+
+      // Look for _t_ without locking its shard
+      uint64_t hash = IsTranslation(t) ? HashTranslation(t) : Hash(t);
+      Shard& shard = shards[hash >> (64 - LogShards)];
+      int nProbes;
+      Transform* tCached =
+        Find(*shard.table.load(std::memory_order_acquire), hash, t, &nProbes);
+      if (!tCached) {
+        // Insert _t_, unless another thread has just done so
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        HashTable* table = shard.table.load(std::memory_order_relaxed);
+        tCached = Find(*table, hash, t, &nProbes);
+        if (!tCached) {
+          if (++shard.occupancy == table->size / 2) table = Grow(shard);
+          tCached = shard.arena.Alloc<Transform>();
+          *tCached = t;
+          Insert(*table, hash, tCached);
+          ReportValue(transformCacheProbes, nProbes);
+          return tCached;
+        }
       }
+      ReportValue(transformCacheProbes, nProbes);
+      ++nTransformCacheHits;
       return tCached;
     }
 
     void Clear() {
-      transformCacheBytes += arena.TotalAllocated() + hashTable.size() * sizeof(Transform*);
-      hashTable.clear();
-      hashTable.resize(512);
-      hashTableOccupancy = 0;
-      arena.Reset();
+      for (Shard& shard : shards) {
+        for (const std::unique_ptr<HashTable>& table : shard.tables)
+          transformCacheBytes += table->size * sizeof(Transform*);
+        transformCacheBytes += shard.arena.TotalAllocated();
+        shard.Reset();
+      }
     }
 
   private:
-    void Insert(Transform* tNew);
-    void Grow();
+    // TransformCache Private Declarations
+    struct HashTable {
+      HashTable(int size)
+        : size(size), entries(new std::atomic<Transform*>[size]) {
+        for (int i = 0; i < size; ++i) entries[i] = nullptr;
+      }
+      const int size;
+      std::unique_ptr<std::atomic<Transform*>[]> entries;
+    };
+    struct alignas(PBRT_L1_CACHE_LINE_SIZE) Shard {
+      void Reset() {
+        tables.clear();
+        tables.emplace_back(new HashTable(InitialTableSize));
+        table = tables.back().get();
+        occupancy = 0;
+        arena.Reset();
+      }
+      std::atomic<HashTable*> table;
+      std::mutex mutex;
+      int occupancy;
+      MemoryArena arena;
+      // The current table and those it replaced
+      std::vector<std::unique_ptr<HashTable>> tables;
+    };
+    static PBRT_CONSTEXPR int LogShards = 6;
+    static PBRT_CONSTEXPR int InitialTableSize = 64;
+
+    // TransformCache Private Methods
+    static int ProbeOffset(const HashTable& table, uint64_t hash, int n) {
+      // Triangular-number probing visits every entry of a power-of-two table
+      return (hash + n * (n + 1) / 2) & (table.size - 1);
+    }
+
+    static Transform* Find(const HashTable& table, uint64_t hash,
+      const Transform& t, int* nProbes) {
+      for (int n = 0;; ++n) {
+        Transform* tEntry = table.entries[ProbeOffset(table, hash, n)].load(
+          std::memory_order_acquire);
+        if (!tEntry || *tEntry == t) {
+          *nProbes = n + 1;
+          return tEntry;
+        }
+      }
+    }
 
-    static uint64_t Hash(const Transform& t) {
-      const char* ptr = (const char*)(&t.GetMatrix());
-      size_t size = sizeof(Matrix4x4);
+    static void Insert(HashTable& table, uint64_t hash, Transform* tNew) {
+      for (int n = 0;; ++n) {
+        std::atomic<Transform*>& entry =
+          table.entries[ProbeOffset(table, hash, n)];
+        if (!entry.load(std::memory_order_relaxed)) {
+          entry.store(tNew, std::memory_order_release);
+          return;
+        }
+      }
+    }
+
+    HashTable* Grow(Shard& shard);
+
+    static bool IsTranslation(const Transform& t) {
+      const Matrix4x4& m = t.GetMatrix();
+      for (int i = 0; i < 4; ++i)
+        for (int j = 0; j < 3; ++j)
+          if (m.m[i][j] != (i == j ? 1 : 0)) return false;
+      return m.m[3][3] == 1;
+    }
+
+    static uint64_t Hash(const char* ptr, size_t size) {
       uint64_t hash = 14695981039346656037ull;
       while (size > 0) {
         hash ^= *ptr;
@@ -310,52 +454,42 @@ namespace pbrt {
         ++ptr;
         --size;
       }
-      return hash;
+      // Mix the low bits into the high ones that select the shard
+      return hash ^ (hash << 37);
     }
 
-    // TransformCache Private Data
-    std::vector<Transform*> hashTable;
-    int hashTableOccupancy;
-    MemoryArena arena;
-  };
-
-  void TransformCache::Insert(Transform* tNew) {
-    if (++hashTableOccupancy == hashTable.size() / 2)
-      Grow();
-
-    int baseOffset = Hash(*tNew) & (hashTable.size() - 1);
-    for (int nProbes = 0;; ++nProbes) {
-      // Quadratic probing.
-      int offset = (baseOffset + nProbes / 2 + nProbes * nProbes / 2) & (hashTable.size() - 1);
-      if (hashTable[offset] == nullptr) {
-        hashTable[offset] = tNew;
-        return;
-      }
+    static uint64_t Hash(const Transform& t) {
+      return Hash((const char*)(&t.GetMatrix()), sizeof(Matrix4x4));
     }
-  }
 
-  void TransformCache::Grow() {
-    std::vector<Transform*> newTable(2 * hashTable.size());
-    LOG(INFO) << "Growing transform cache hash table to " << newTable.size();
-
-    // Insert current elements into newTable.
-    for (Transform* tEntry : hashTable) {
-      if (!tEntry) continue;
-
-      int baseOffset = Hash(*tEntry) & (hashTable.size() - 1);
-      for (int nProbes = 0;; ++nProbes) {
-        // Quadratic probing.
-        int offset = (baseOffset + nProbes / 2 + nProbes * nProbes / 2) & (hashTable.size() - 1);
-        if (newTable[offset] == nullptr) {
-          newTable[offset] = tEntry;
-          break;
-        }
-      }
+    static uint64_t HashTranslation(const Transform& t) {
+      const Matrix4x4& m = t.GetMatrix();
+      Float delta[3] = { m.m[0][3], m.m[1][3], m.m[2][3] };
+      return Hash((const char*)delta, sizeof(delta));
     }
 
-    std::swap(hashTable, newTable);
-  }
+    // TransformCache Private Data
+    Shard shards[1 << LogShards];
+    Transform identity;
+  };
 
+  TransformCache::HashTable* TransformCache::Grow(Shard& shard) {
+    HashTable* oldTable = shard.table.load(std::memory_order_relaxed);
+    std::unique_ptr<HashTable> newTable(new HashTable(2 * oldTable->size));
+    LOG(INFO) << "Growing transform cache hash table to " << newTable->size;
+
+    // Insert current elements into _newTable_ before publishing it
+    for (int i = 0; i < oldTable->size; ++i) {
+      Transform* tEntry = oldTable->entries[i].load(std::memory_order_relaxed);
+      if (tEntry)
+        Insert(*newTable,
+          IsTranslation(*tEntry) ? HashTranslation(*tEntry) : Hash(*tEntry),
+          tEntry);
+    }
+    shard.table.store(newTable.get(), std::memory_order_release);
+    shard.tables.push_back(std::move(newTable));
+    return shard.tables.back().get();
+  }
 
   // API Static Data
   enum class APIState { Uninitialized, OptionsBlock, WorldBlock };
@@ -369,17 +503,40 @@ namespace pbrt {
   static std::vector<TransformSet> pushedTransforms;
   static std::vector<uint32_t> pushedActiveTransformBits;
   static TransformCache transformCache;
+  // Aggregate kept across _WorldEnd_ so that the next frame of an animation
+  // with unchanged topology can refit it instead of building a new one
+  static std::shared_ptr<WideBVHAccel> refitAccelerator;
+  // When converting to a binary scene, API calls are recorded here instead
+  // of being executed
+  static std::unique_ptr<BinarySceneWriter> binaryScene;
+  static std::vector<PendingShape> pendingShapes;
+  // Files of consecutive _Include_ statements that may hold only shapes;
+  // they're parsed together before the next other statement takes effect
+  static std::vector<std::string> pendingIncludes;
+  // Parsed shape-only include files by name, or null for files that need
+  // the full parser
+  static std::map<std::string, std::shared_ptr<const ShapeIncludeFile>>
+    parsedIncludes;
+  // Snapshot of _graphicsState_ for the next pending shape; reset whenever
+  // the state changes
+  static std::shared_ptr<const ShapeState> shapeState;
   int catIndentCount = 0;
 
   // API Forward Declarations
+  static void FlushPendingIncludes();
   std::vector<std::shared_ptr<Shape>> MakeShapes(const std::string& name,
     const Transform* ObjectToWorld,
     const Transform* WorldToObject,
     bool reverseOrientation,
-    const ParamSet& paramSet);
+    const ParamSet& paramSet,
+    GraphicsState::FloatTextureMap* floatTextures);
 
   // API Macros
+
+  // Every API call first reads the pending _Include_ files, whose
+  // statements come before it
 #define VERIFY_INITIALIZED(func)                           \
+    FlushPendingIncludes();                                \
     if (!(PbrtOptions.cat || PbrtOptions.toPly) &&           \
         currentApiState == APIState::Uninitialized) {        \
         Error(                                             \
@@ -427,7 +584,8 @@ namespace pbrt {
     const Transform* object2world,
     const Transform* world2object,
     bool reverseOrientation,
-    const ParamSet& paramSet) {
+    const ParamSet& paramSet,
+    GraphicsState::FloatTextureMap* floatTextures) {
     std::vector<std::shared_ptr<Shape>> shapes;
     std::shared_ptr<Shape> s;
     if (name == "sphere")
@@ -476,16 +634,16 @@ namespace pbrt {
           const Point3f* P = paramSet.FindPoint3f("P", &npi);
           const Point2f* uvs = paramSet.FindPoint2f("uv", &nuvi);
           if (!uvs) uvs = paramSet.FindPoint2f("st", &nuvi);
-          std::vector<Point2f> tempUVs;
           if (!uvs) {
+            // Float pairs have the same layout as _Point2f_, so the values
+            // are written out in place rather than copied
+            static_assert(sizeof(Point2f) == 2 * sizeof(Float),
+              "Point2f must be laid out as two Floats");
             const Float* fuv = paramSet.FindFloat("uv", &nuvi);
             if (!fuv) fuv = paramSet.FindFloat("st", &nuvi);
             if (fuv) {
               nuvi /= 2;
-              tempUVs.reserve(nuvi);
-              for (int i = 0; i < nuvi; ++i)
-                tempUVs.push_back(Point2f(fuv[2 * i], fuv[2 * i + 1]));
-              uvs = &tempUVs[0];
+              uvs = reinterpret_cast<const Point2f*>(fuv);
             }
           }
           const Normal3f* N = paramSet.FindNormal3f("N", &nni);
@@ -513,14 +671,22 @@ namespace pbrt {
           printf("\n");
         }
       }
+      else if (PbrtOptions.meshCacheMB > 0)
+        shapes = CreateCompressedTriangleMeshShape(object2world,
+          world2object, reverseOrientation, paramSet, floatTextures);
       else
         shapes = CreateTriangleMeshShape(object2world, world2object,
-          reverseOrientation, paramSet,
-          &*graphicsState.floatTextures);
+          reverseOrientation, paramSet, floatTextures);
+    }
+    else if (name == "plymesh") {
+      // Map binary PLY files directly, falling back to the general reader
+      bool handled;
+      shapes = CreateMappedPLYMesh(object2world, world2object,
+        reverseOrientation, paramSet, floatTextures, &handled);
+      if (!handled)
+        shapes = CreatePLYMesh(object2world, world2object, reverseOrientation,
+          paramSet, floatTextures);
     }
-    else if (name == "plymesh")
-      shapes = CreatePLYMesh(object2world, world2object, reverseOrientation,
-        paramSet, &*graphicsState.floatTextures);
     else if (name == "heightfield")
       shapes = CreateHeightfield(object2world, world2object,
         reverseOrientation, paramSet);
@@ -765,6 +931,10 @@ namespace pbrt {
     const MediumInterface& mediumInterface,
     const ParamSet& paramSet,
     const std::shared_ptr<Shape>& shape) {
+    // Shapes are created in parallel, and the lookups in _paramSet_, which
+    // their area lights share, mark its parameters as used
+    static std::mutex areaLightMutex;
+    std::lock_guard<std::mutex> lock(areaLightMutex);
     std::shared_ptr<AreaLight> area;
     if (name == "area" || name == "diffuse")
       area = CreateDiffuseAreaLight(light2world, mediumInterface.outside,
@@ -782,6 +952,8 @@ namespace pbrt {
     std::shared_ptr<Primitive> accel;
     if (name == "bvh")
       accel = CreateBVHAccelerator(std::move(prims), paramSet);
+    else if (name == "bvh8")
+      accel = CreateWideBVHAccelerator(std::move(prims), paramSet);
     else if (name == "kdtree")
       accel = CreateKdTreeAccelerator(std::move(prims), paramSet);
     else
@@ -885,6 +1057,8 @@ namespace pbrt {
     renderOptions.reset(new RenderOptions);
     graphicsState = GraphicsState();
     catIndentCount = 0;
+    if (!PbrtOptions.toBinary.empty())
+      binaryScene.reset(new BinarySceneWriter(PbrtOptions.toBinary));
 
     // General \pbrt Initialization
     SampledSpectrum::Init();
@@ -900,11 +1074,15 @@ namespace pbrt {
     else if (currentApiState == APIState::WorldBlock)
       Error("pbrtCleanup() called while inside world block.");
     currentApiState = APIState::Uninitialized;
+    refitAccelerator.reset();
+    binaryScene.reset();
     ParallelCleanup();
     CleanupProfiler();
   }
 
   void pbrtIdentity() {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Identity, {});
     VERIFY_INITIALIZED("Identity");
     FOR_ACTIVE_TRANSFORMS(curTransform[i] = Transform();)
       if (PbrtOptions.cat || PbrtOptions.toPly)
@@ -912,6 +1090,8 @@ namespace pbrt {
   }
 
   void pbrtTranslate(Float dx, Float dy, Float dz) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Translate, {}, { dx, dy, dz });
     VERIFY_INITIALIZED("Translate");
     FOR_ACTIVE_TRANSFORMS(curTransform[i] = curTransform[i] *
       Translate(Vector3f(dx, dy, dz));)
@@ -921,6 +1101,8 @@ namespace pbrt {
   }
 
   void pbrtTransform(Float tr[16]) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Transform, {}, tr, 16);
     VERIFY_INITIALIZED("Transform");
     FOR_ACTIVE_TRANSFORMS(
       curTransform[i] = Transform(Matrix4x4(
@@ -934,6 +1116,8 @@ namespace pbrt {
   }
 
   void pbrtConcatTransform(Float tr[16]) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::ConcatTransform, {}, tr, 16);
     VERIFY_INITIALIZED("ConcatTransform");
     FOR_ACTIVE_TRANSFORMS(
       curTransform[i] =
@@ -949,6 +1133,9 @@ namespace pbrt {
   }
 
   void pbrtRotate(Float angle, Float dx, Float dy, Float dz) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Rotate, {},
+        { angle, dx, dy, dz });
     VERIFY_INITIALIZED("Rotate");
     FOR_ACTIVE_TRANSFORMS(curTransform[i] =
       curTransform[i] *
@@ -959,6 +1146,8 @@ namespace pbrt {
   }
 
   void pbrtScale(Float sx, Float sy, Float sz) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Scale, {}, { sx, sy, sz });
     VERIFY_INITIALIZED("Scale");
     FOR_ACTIVE_TRANSFORMS(curTransform[i] =
       curTransform[i] * Scale(sx, sy, sz);)
@@ -968,6 +1157,9 @@ namespace pbrt {
 
   void pbrtLookAt(Float ex, Float ey, Float ez, Float lx, Float ly, Float lz,
     Float ux, Float uy, Float uz) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::LookAt, {},
+        { ex, ey, ez, lx, ly, lz, ux, uy, uz });
     VERIFY_INITIALIZED("LookAt");
     Transform lookAt =
       LookAt(Point3f(ex, ey, ez), Point3f(lx, ly, lz), Vector3f(ux, uy, uz));
@@ -981,6 +1173,8 @@ namespace pbrt {
   }
 
   void pbrtCoordinateSystem(const std::string& name) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::CoordinateSystem, { name });
     VERIFY_INITIALIZED("CoordinateSystem");
     namedCoordinateSystems[name] = curTransform;
     if (PbrtOptions.cat || PbrtOptions.toPly)
@@ -989,6 +1183,8 @@ namespace pbrt {
   }
 
   void pbrtCoordSysTransform(const std::string& name) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::CoordSysTransform, { name });
     VERIFY_INITIALIZED("CoordSysTransform");
     if (namedCoordinateSystems.find(name) != namedCoordinateSystems.end())
       curTransform = namedCoordinateSystems[name];
@@ -1000,24 +1196,36 @@ namespace pbrt {
   }
 
   void pbrtActiveTransformAll() {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::ActiveTransformAll, {});
+    FlushPendingIncludes();
     activeTransformBits = AllTransformsBits;
     if (PbrtOptions.cat || PbrtOptions.toPly)
       printf("%*sActiveTransform All\n", catIndentCount, "");
   }
 
   void pbrtActiveTransformEndTime() {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::ActiveTransformEndTime, {});
+    FlushPendingIncludes();
     activeTransformBits = EndTransformBits;
     if (PbrtOptions.cat || PbrtOptions.toPly)
       printf("%*sActiveTransform EndTime\n", catIndentCount, "");
   }
 
   void pbrtActiveTransformStartTime() {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::ActiveTransformStartTime, {});
+    FlushPendingIncludes();
     activeTransformBits = StartTransformBits;
     if (PbrtOptions.cat || PbrtOptions.toPly)
       printf("%*sActiveTransform StartTime\n", catIndentCount, "");
   }
 
   void pbrtTransformTimes(Float start, Float end) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::TransformTimes, {},
+        { start, end });
     VERIFY_OPTIONS("TransformTimes");
     renderOptions->transformStartTime = start;
     renderOptions->transformEndTime = end;
@@ -1027,6 +1235,9 @@ namespace pbrt {
   }
 
   void pbrtPixelFilter(const std::string& name, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::PixelFilter, { name }, {},
+        &params);
     VERIFY_OPTIONS("PixelFilter");
     renderOptions->FilterName = name;
     renderOptions->FilterParams = params;
@@ -1038,6 +1249,8 @@ namespace pbrt {
   }
 
   void pbrtFilm(const std::string& type, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Film, { type }, {}, &params);
     VERIFY_OPTIONS("Film");
     renderOptions->FilmParams = params;
     renderOptions->FilmName = type;
@@ -1049,6 +1262,8 @@ namespace pbrt {
   }
 
   void pbrtSampler(const std::string& name, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Sampler, { name }, {}, &params);
     VERIFY_OPTIONS("Sampler");
     renderOptions->SamplerName = name;
     renderOptions->SamplerParams = params;
@@ -1060,9 +1275,14 @@ namespace pbrt {
   }
 
   void pbrtAccelerator(const std::string& name, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Accelerator, { name }, {},
+        &params);
     VERIFY_OPTIONS("Accelerator");
     renderOptions->AcceleratorName = name;
     renderOptions->AcceleratorParams = params;
+    renderOptions->triangleBlocks = name == "bvh8" &&
+      renderOptions->AcceleratorParams.FindOneBool("triangleblocks", false);
     if (PbrtOptions.cat || PbrtOptions.toPly) {
       printf("%*sAccelerator \"%s\" ", catIndentCount, "", name.c_str());
       params.Print(catIndentCount);
@@ -1071,6 +1291,9 @@ namespace pbrt {
   }
 
   void pbrtIntegrator(const std::string& name, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Integrator, { name }, {},
+        &params);
     VERIFY_OPTIONS("Integrator");
     renderOptions->IntegratorName = name;
     renderOptions->IntegratorParams = params;
@@ -1082,6 +1305,8 @@ namespace pbrt {
   }
 
   void pbrtCamera(const std::string& name, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Camera, { name }, {}, &params);
     VERIFY_OPTIONS("Camera");
     renderOptions->CameraName = name;
     renderOptions->CameraParams = params;
@@ -1095,7 +1320,11 @@ namespace pbrt {
   }
 
   void pbrtMakeNamedMedium(const std::string& name, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::MakeNamedMedium, { name }, {},
+        &params);
     VERIFY_INITIALIZED("MakeNamedMedium");
+    shapeState.reset();
     WARN_IF_ANIMATED_TRANSFORM("MakeNamedMedium");
     std::string type = params.FindOneString("type", "");
     if (type == "")
@@ -1114,7 +1343,11 @@ namespace pbrt {
 
   void pbrtMediumInterface(const std::string& insideName,
     const std::string& outsideName) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::MediumInterface,
+        { insideName, outsideName });
     VERIFY_INITIALIZED("MediumInterface");
+    shapeState.reset();
     graphicsState.currentInsideMedium = insideName;
     graphicsState.currentOutsideMedium = outsideName;
     renderOptions->haveScatteringMedia = true;
@@ -1124,6 +1357,8 @@ namespace pbrt {
   }
 
   void pbrtWorldBegin() {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::WorldBegin, {});
     VERIFY_OPTIONS("WorldBegin");
     currentApiState = APIState::WorldBlock;
     for (int i = 0; i < MaxTransforms; ++i) curTransform[i] = Transform();
@@ -1134,6 +1369,8 @@ namespace pbrt {
   }
 
   void pbrtAttributeBegin() {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::AttributeBegin, {});
     VERIFY_WORLD("AttributeBegin");
     pushedGraphicsStates.push_back(graphicsState);
     graphicsState.floatTexturesShared = graphicsState.spectrumTexturesShared =
@@ -1147,7 +1384,10 @@ namespace pbrt {
   }
 
   void pbrtAttributeEnd() {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::AttributeEnd, {});
     VERIFY_WORLD("AttributeEnd");
+    shapeState.reset();
     if (!pushedGraphicsStates.size()) {
       Error(
         "Unmatched pbrtAttributeEnd() encountered. "
@@ -1167,6 +1407,8 @@ namespace pbrt {
   }
 
   void pbrtTransformBegin() {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::TransformBegin, {});
     VERIFY_WORLD("TransformBegin");
     pushedTransforms.push_back(curTransform);
     pushedActiveTransformBits.push_back(activeTransformBits);
@@ -1177,6 +1419,8 @@ namespace pbrt {
   }
 
   void pbrtTransformEnd() {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::TransformEnd, {});
     VERIFY_WORLD("TransformEnd");
     if (!pushedTransforms.size()) {
       Error(
@@ -1196,7 +1440,11 @@ namespace pbrt {
 
   void pbrtTexture(const std::string& name, const std::string& type,
     const std::string& texname, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Texture,
+        { name, type, texname }, {}, &params);
     VERIFY_WORLD("Texture");
+    shapeState.reset();
     if (PbrtOptions.cat || PbrtOptions.toPly) {
       printf("%*sTexture \"%s\" \"%s\" \"%s\" ", catIndentCount, "",
         name.c_str(), type.c_str(), texname.c_str());
@@ -1248,7 +1496,11 @@ namespace pbrt {
   }
 
   void pbrtMaterial(const std::string& name, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Material, { name }, {},
+        &params);
     VERIFY_WORLD("Material");
+    shapeState.reset();
     ParamSet emptyParams;
     TextureParams mp(params, emptyParams, *graphicsState.floatTextures,
       *graphicsState.spectrumTextures);
@@ -1264,7 +1516,11 @@ namespace pbrt {
   }
 
   void pbrtMakeNamedMaterial(const std::string& name, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::MakeNamedMaterial, { name }, {},
+        &params);
     VERIFY_WORLD("MakeNamedMaterial");
+    shapeState.reset();
     // error checking, warning if replace, what to use for transform?
     ParamSet emptyParams;
     TextureParams mp(params, emptyParams, *graphicsState.floatTextures,
@@ -1296,7 +1552,10 @@ namespace pbrt {
   }
 
   void pbrtNamedMaterial(const std::string& name) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::NamedMaterial, { name });
     VERIFY_WORLD("NamedMaterial");
+    shapeState.reset();
     if (PbrtOptions.cat || PbrtOptions.toPly) {
       printf("%*sNamedMaterial \"%s\"\n", catIndentCount, "", name.c_str());
       return;
@@ -1311,6 +1570,9 @@ namespace pbrt {
   }
 
   void pbrtLightSource(const std::string& name, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::LightSource, { name }, {},
+        &params);
     VERIFY_WORLD("LightSource");
     WARN_IF_ANIMATED_TRANSFORM("LightSource");
     MediumInterface mi = graphicsState.CreateMediumInterface();
@@ -1327,7 +1589,11 @@ namespace pbrt {
   }
 
   void pbrtAreaLightSource(const std::string& name, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::AreaLightSource, { name }, {},
+        &params);
     VERIFY_WORLD("AreaLightSource");
+    shapeState.reset();
     graphicsState.areaLight = name;
     graphicsState.areaLightParams = params;
     if (PbrtOptions.cat || PbrtOptions.toPly) {
@@ -1337,98 +1603,353 @@ namespace pbrt {
     }
   }
 
-  void pbrtShape(const std::string& name, const ParamSet& params) {
-    VERIFY_WORLD("Shape");
-    std::vector<std::shared_ptr<Primitive>> prims;
-    std::vector<std::shared_ptr<AreaLight>> areaLights;
-    if (PbrtOptions.cat || (PbrtOptions.toPly && name != "trianglemesh")) {
-      printf("%*sShape \"%s\" ", catIndentCount, "", name.c_str());
-      params.Print(catIndentCount);
-      printf("\n");
-    }
-
-    if (!curTransform.IsAnimated()) {
+  // Creates the primitives and area lights for shape _name_ as declared
+  // under graphics state _gs_ with transformations _objToWorld_; called from
+  // worker threads for pending shapes.
+  static void MakeShapePrimitives(const std::string& name,
+    const ParamSet& params,
+    const TransformSet& objToWorld,
+    const GraphicsState& gs,
+    bool reverseOrientation,
+    const MediumInterface& mi,
+    std::vector<std::shared_ptr<Primitive>>* prims,
+    std::vector<std::shared_ptr<AreaLight>>* areaLights) {
+    if (!objToWorld.IsAnimated()) {
       // Initialize _prims_ and _areaLights_ for static shape
 
       // Create shapes for shape _name_
-      Transform* ObjToWorld = transformCache.Lookup(curTransform[0]);
-      Transform* WorldToObj = transformCache.Lookup(Inverse(curTransform[0]));
+      Transform* ObjToWorld = transformCache.Lookup(objToWorld[0]);
+      Transform* WorldToObj = transformCache.Lookup(Inverse(objToWorld[0]));
       std::vector<std::shared_ptr<Shape>> shapes =
-        MakeShapes(name, ObjToWorld, WorldToObj,
-          graphicsState.reverseOrientation, params);
+        MakeShapes(name, ObjToWorld, WorldToObj, reverseOrientation, params,
+          &*gs.floatTextures);
       if (shapes.empty()) return;
-      std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
+      std::shared_ptr<Material> mtl = gs.GetMaterialForShape(params);
       params.ReportUnused();
-      MediumInterface mi = graphicsState.CreateMediumInterface();
-      prims.reserve(shapes.size());
-      for (auto s : shapes) {
+
+      // Keep the world-space vertices of triangle meshes if the wide BVH
+      // was asked to test the triangles of a leaf together. Compressed
+      // meshes don't keep an uncompressed copy; their triangles are only
+      // tested by the shapes.
+      std::shared_ptr<std::vector<Point3f>> worldP;
+      const int* vi = nullptr;
+      if (name == "trianglemesh" && renderOptions->triangleBlocks &&
+        PbrtOptions.meshCacheMB == 0) {
+        int nP, nvi;
+        const Point3f* P = params.FindPoint3f("P", &nP);
+        vi = params.FindInt("indices", &nvi);
+        if (P && vi && nvi == 3 * (int)shapes.size()) {
+          worldP = std::make_shared<std::vector<Point3f>>(nP);
+          for (int i = 0; i < nP; ++i) (*worldP)[i] = (*ObjToWorld)(P[i]);
+        }
+      }
+      prims->reserve(prims->size() + shapes.size());
+      for (size_t i = 0; i < shapes.size(); ++i) {
+        const std::shared_ptr<Shape>& s = shapes[i];
         // Possibly create area light for shape
         std::shared_ptr<AreaLight> area;
-        if (graphicsState.areaLight != "") {
-          area = MakeAreaLight(graphicsState.areaLight, curTransform[0],
-            mi, graphicsState.areaLightParams, s);
-          if (area) areaLights.push_back(area);
+        if (gs.areaLight != "") {
+          area = MakeAreaLight(gs.areaLight, objToWorld[0], mi,
+            gs.areaLightParams, s);
+          if (area) areaLights->push_back(area);
         }
-        prims.push_back(
-          std::make_shared<GeometricPrimitive>(s, mtl, area, mi));
+        if (worldP)
+          prims->push_back(std::make_shared<TrianglePrimitive>(
+            s, mtl, area, mi, worldP, &vi[3 * i]));
+        else
+          prims->push_back(
+            std::make_shared<GeometricPrimitive>(s, mtl, area, mi));
       }
     }
     else {
       // Initialize _prims_ and _areaLights_ for animated shape
 
       // Create initial shape or shapes for animated shape
-      if (graphicsState.areaLight != "")
+      if (gs.areaLight != "")
         Warning(
           "Ignoring currently set area light when creating "
           "animated shape");
       Transform* identity = transformCache.Lookup(Transform());
-      std::vector<std::shared_ptr<Shape>> shapes = MakeShapes(
-        name, identity, identity, graphicsState.reverseOrientation, params);
+      std::vector<std::shared_ptr<Shape>> shapes =
+        MakeShapes(name, identity, identity, reverseOrientation, params,
+          &*gs.floatTextures);
       if (shapes.empty()) return;
 
       // Create _GeometricPrimitive_(s) for animated shape
-      std::shared_ptr<Material> mtl = graphicsState.GetMaterialForShape(params);
+      std::shared_ptr<Material> mtl = gs.GetMaterialForShape(params);
       params.ReportUnused();
-      MediumInterface mi = graphicsState.CreateMediumInterface();
-      prims.reserve(shapes.size());
+      std::vector<std::shared_ptr<Primitive>> animatedPrims;
+      animatedPrims.reserve(shapes.size());
       for (auto s : shapes)
-        prims.push_back(
+        animatedPrims.push_back(
           std::make_shared<GeometricPrimitive>(s, mtl, nullptr, mi));
 
-      // Create single _TransformedPrimitive_ for _prims_
+      // Create single _AnimatedInstancePrimitive_ for _animatedPrims_
 
       // Get _animatedObjectToWorld_ transform for shape
       static_assert(MaxTransforms == 2,
         "TransformCache assumes only two transforms");
       Transform* ObjToWorld[2] = {
-          transformCache.Lookup(curTransform[0]),
-          transformCache.Lookup(curTransform[1])
+          transformCache.Lookup(objToWorld[0]),
+          transformCache.Lookup(objToWorld[1])
       };
-      AnimatedTransform animatedObjectToWorld(
-        ObjToWorld[0], renderOptions->transformStartTime, ObjToWorld[1],
-        renderOptions->transformEndTime);
-      if (prims.size() > 1) {
-        std::shared_ptr<Primitive> bvh = std::make_shared<BVHAccel>(prims);
-        prims.clear();
-        prims.push_back(bvh);
+      std::shared_ptr<Primitive> prim = animatedPrims[0];
+      if (animatedPrims.size() > 1)
+        prim = std::make_shared<BVHAccel>(animatedPrims);
+      prims->push_back(std::make_shared<AnimatedInstancePrimitive>(
+        prim, ObjToWorld[0], renderOptions->transformStartTime,
+        ObjToWorld[1], renderOptions->transformEndTime));
+    }
+  }
+
+  // Returns the graphics state for the next pending shape, taking a new
+  // snapshot if it has changed since the last one
+  static std::shared_ptr<const ShapeState> CurrentShapeState() {
+    if (!shapeState) {
+      shapeState = std::make_shared<ShapeState>(
+        graphicsState, graphicsState.CreateMediumInterface());
+      // The snapshot shares the texture and material maps, so they must now
+      // be copied before they are modified
+      graphicsState.floatTexturesShared =
+        graphicsState.spectrumTexturesShared =
+        graphicsState.namedMaterialsShared = true;
+    }
+    return shapeState;
+  }
+
+  // Queues a pending shape for the current transformation and state
+  static PendingShape& AddPendingShape() {
+    static_assert(MaxTransforms == 2,
+      "TransformCache assumes only two transforms");
+    pendingShapes.push_back(PendingShape());
+    PendingShape& pending = pendingShapes.back();
+    pending.objToWorld[0] = transformCache.Lookup(curTransform[0]);
+    pending.objToWorld[1] = transformCache.Lookup(curTransform[1]);
+    pending.state = CurrentShapeState();
+    pending.instance = renderOptions->currentInstance;
+    pending.lightOffset = renderOptions->lights.size();
+    return pending;
+  }
+
+  STAT_COUNTER("Scene/Shapes created in parallel", nDeferredShapes);
+
+  void pbrtShape(const std::string& name, const ParamSet& params) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::Shape, { name }, {}, &params);
+    VERIFY_WORLD("Shape");
+    if (PbrtOptions.cat || PbrtOptions.toPly) {
+      if (PbrtOptions.cat || name != "trianglemesh") {
+        printf("%*sShape \"%s\" ", catIndentCount, "", name.c_str());
+        params.Print(catIndentCount);
+        printf("\n");
       }
-      prims[0] = std::make_shared<TransformedPrimitive>(
-        prims[0], animatedObjectToWorld);
+      // Meshes are written out in order as they are converted
+      std::vector<std::shared_ptr<Primitive>> prims;
+      std::vector<std::shared_ptr<AreaLight>> areaLights;
+      MakeShapePrimitives(name, params, curTransform, graphicsState,
+        graphicsState.reverseOrientation,
+        graphicsState.CreateMediumInterface(), &prims,
+        &areaLights);
+      return;
     }
-    // Add _prims_ and _areaLights_ to scene or current instance
-    if (renderOptions->currentInstance) {
-      if (areaLights.size())
-        Warning("Area lights not supported with object instancing");
-      renderOptions->currentInstance->insert(
-        renderOptions->currentInstance->end(), prims.begin(), prims.end());
+
+    // Record the shape; it's created by _InstantiatePendingShapes()_
+    PendingShape& pending = AddPendingShape();
+    pending.name = name;
+    pending.params = params;
+    ++nDeferredShapes;
+  }
+
+  STAT_COUNTER("Scene/Includes parsed in parallel", nDeferredIncludes);
+
+  bool pbrtInclude(const std::string& filename) {
+    // Only includes in the world block outside of instance definitions are
+    // deferred; the parser reads all others inline
+    if (PbrtOptions.cat || PbrtOptions.toPly || binaryScene ||
+      currentApiState != APIState::WorldBlock ||
+      renderOptions->currentInstance ||
+      activeTransformBits != AllTransformsBits)
+      return false;
+    pendingIncludes.push_back(filename);
+    return true;
+  }
+
+  // Parses the pending include files in parallel and then, in order, either
+  // records the shapes of each one as a pending shape and applies its
+  // top-level transformation and orientation to the current state, or
+  // reads it with the full parser if it holds anything other than shapes.
+  static void FlushPendingIncludes() {
+    if (pendingIncludes.empty()) return;
+    // Statements read by the full parser may queue more includes
+    std::vector<std::string> includes;
+    includes.swap(pendingIncludes);
+
+    // Parse the files that haven't been seen before
+    std::vector<std::string> toParse;
+    for (const std::string& filename : includes)
+      if (parsedIncludes.insert(std::make_pair(filename, nullptr)).second)
+        toParse.push_back(filename);
+    std::vector<std::shared_ptr<ShapeIncludeFile>> files(toParse.size());
+    NestableParallelFor([&](int64_t i) {
+      std::shared_ptr<ShapeIncludeFile> file =
+        std::make_shared<ShapeIncludeFile>();
+      if (ParseShapeInclude(toParse[i], file.get())) files[i] = file;
+    }, toParse.size());
+    for (size_t i = 0; i < toParse.size(); ++i)
+      parsedIncludes[toParse[i]] = std::move(files[i]);
+
+    for (const std::string& filename : includes) {
+      std::shared_ptr<const ShapeIncludeFile> file = parsedIncludes[filename];
+      if (!file) {
+        pbrtParseFile(filename);
+        FlushPendingIncludes();
+        continue;
+      }
+      if (!file->shapes.empty()) {
+        PendingShape& pending = AddPendingShape();
+        pending.includeFilename = filename;
+        pending.include = file;
+        const ShapeState& state = *pending.state;
+        pending.includeKey = IncludeKey(file->contentHash,
+          state.graphicsState.currentMaterial.get(),
+          state.graphicsState.floatTextures.get(),
+          state.graphicsState.spectrumTextures.get(),
+          state.graphicsState.reverseOrientation,
+          state.mediumInterface.inside,
+          state.mediumInterface.outside);
+        ++nDeferredIncludes;
+      }
+
+      // The file's top-level statements carry over to the includer
+      if (!file->trailingTransform.IsIdentity())
+        for (int i = 0; i < MaxTransforms; ++i)
+          curTransform[i] = curTransform[i] * file->trailingTransform;
+      if (file->trailingReverseOrientation) {
+        shapeState.reset();
+        graphicsState.reverseOrientation = !graphicsState.reverseOrientation;
+      }
     }
-    else {
+  }
+
+  STAT_COUNTER("Scene/Includes replaced by instances", nInstancedIncludes);
+
+  // Creates the shapes of all pending _Shape_ and _Include_ statements in
+  // parallel and adds them to the scene or their instance definitions in
+  // the order in which they were declared. Repeated includes are parsed
+  // once into an instance definition, and each of them becomes a use of it.
+  static void InstantiatePendingShapes() {
+    if (pendingShapes.empty()) return;
+    // Find the include that defines the instance shared by each group of
+    // repeated includes; includes with area lights are never instanced
+    std::map<IncludeKey, int> firstIncludes;
+    std::vector<int> definition(pendingShapes.size(), -1);
+    std::vector<int> nUses(pendingShapes.size(), 0);
+    for (size_t i = 0; i < pendingShapes.size(); ++i) {
+      const PendingShape& pending = pendingShapes[i];
+      if (!pending.include ||
+        !pending.state->graphicsState.areaLight.empty())
+        continue;
+      definition[i] =
+        firstIncludes.insert(std::make_pair(pending.includeKey, (int)i))
+        .first->second;
+      ++nUses[definition[i]];
+    }
+    for (size_t i = 0; i < pendingShapes.size(); ++i)
+      if (definition[i] != -1 && nUses[definition[i]] == 1)
+        definition[i] = -1;
+
+    // Includes of the same file share its parsed _ParamSet_s, whose lookups
+    // record which parameters were used and so aren't thread-safe; each
+    // file's includes are created in order by a single task
+    std::vector<std::vector<int>> tasks;
+    std::map<const ShapeIncludeFile*, int> fileTask;
+    for (size_t i = 0; i < pendingShapes.size(); ++i) {
+      const ShapeIncludeFile* file = pendingShapes[i].include.get();
+      if (!file) {
+        tasks.push_back({ (int)i });
+        continue;
+      }
+      auto iter = fileTask.insert(std::make_pair(file, (int)tasks.size()));
+      if (iter.second) tasks.emplace_back();
+      tasks[iter.first->second].push_back(i);
+    }
+
+    auto makePending = [&](int i) {
+      PendingShape& pending = pendingShapes[i];
+      const GraphicsState& gs = pending.state->graphicsState;
+      const MediumInterface& mi = pending.state->mediumInterface;
+      TransformSet objToWorld;
+      for (int j = 0; j < MaxTransforms; ++j)
+        objToWorld[j] = *pending.objToWorld[j];
+      if (!pending.include) {
+        MakeShapePrimitives(pending.name, pending.params, objToWorld, gs,
+          gs.reverseOrientation, mi, &pending.prims,
+          &pending.areaLights);
+        return;
+      }
+
+      // Create the shapes of a shape-only include file
+      if (definition[i] != -1 && definition[i] != i) return;
+      // Instance definitions are created in the space of the _Include_
+      bool defined = definition[i] == i;
+      for (const IncludedShape& shape : pending.include->shapes) {
+        TransformSet shapeToWorld;
+        for (int j = 0; j < MaxTransforms; ++j)
+          shapeToWorld[j] = defined ? shape.objectToInclude
+          : objToWorld[j] * shape.objectToInclude;
+        MakeShapePrimitives(shape.name, shape.params, shapeToWorld, gs,
+          gs.reverseOrientation != shape.reverseOrientation, mi,
+          &pending.prims, &pending.areaLights);
+      }
+    };
+    NestableParallelFor([&](int64_t t) {
+      for (int i : tasks[t]) makePending(i);
+    }, tasks.size());
+
+    // Turn repeated includes into uses of their shared instance
+    for (size_t i = 0; i < pendingShapes.size(); ++i) {
+      if (definition[i] == -1) continue;
+      PendingShape& pending = pendingShapes[i];
+      std::string name = StringPrintf("Include \"%s\" #%d",
+        pendingShapes[definition[i]].includeFilename.c_str(), definition[i]);
+      if (definition[i] == (int)i)
+        renderOptions->instances[name] = std::move(pending.prims);
+      pending.prims.clear();
+      if (renderOptions->instances[name].empty()) continue;
+      InstanceUse use;
+      use.name = name;
+      use.instanceToWorld[0] = pending.objToWorld[0];
+      use.instanceToWorld[1] = pending.objToWorld[1];
+      renderOptions->instanceUses.push_back(use);
+      ++nInstancedIncludes;
+    }
+
+    // Add _prims_ and _areaLights_ to scene or their instances, keeping
+    // area lights in order with the other lights
+    std::vector<std::shared_ptr<Light>> lights;
+    size_t lightOffset = 0;
+    for (PendingShape& pending : pendingShapes) {
+      if (pending.instance) {
+        if (pending.areaLights.size())
+          Warning("Area lights not supported with object instancing");
+        pending.instance->insert(pending.instance->end(),
+          pending.prims.begin(), pending.prims.end());
+        continue;
+      }
       renderOptions->primitives.insert(renderOptions->primitives.end(),
-        prims.begin(), prims.end());
-      if (areaLights.size())
-        renderOptions->lights.insert(renderOptions->lights.end(),
-          areaLights.begin(), areaLights.end());
-    }
+        pending.prims.begin(), pending.prims.end());
+      lights.insert(lights.end(),
+        renderOptions->lights.begin() + lightOffset,
+        renderOptions->lights.begin() + pending.lightOffset);
+      lights.insert(lights.end(), pending.areaLights.begin(),
+        pending.areaLights.end());
+      lightOffset = pending.lightOffset;
+    }
+    lights.insert(lights.end(), renderOptions->lights.begin() + lightOffset,
+      renderOptions->lights.end());
+    renderOptions->lights = std::move(lights);
+    pendingShapes.clear();
+    parsedIncludes.clear();
   }
 
   // Attempt to determine if the ParamSet for a shape may provide a value for
@@ -1489,7 +2010,7 @@ namespace pbrt {
   }
 
   std::shared_ptr<Material> GraphicsState::GetMaterialForShape(
-    const ParamSet& shapeParams) {
+    const ParamSet& shapeParams) const {
     CHECK(currentMaterial);
     if (shapeMaySetMaterialParameters(shapeParams)) {
       // Only create a unique material for the shape if the shape's
@@ -1497,6 +2018,10 @@ namespace pbrt {
       // the material parameters.
       TextureParams mp(shapeParams, currentMaterial->params, *floatTextures,
         *spectrumTextures);
+      // Shapes are created in parallel, and some materials keep caches of
+      // the files they load
+      static std::mutex materialMutex;
+      std::lock_guard<std::mutex> lock(materialMutex);
       return MakeMaterial(currentMaterial->name, mp);
     }
     else
@@ -1525,13 +2050,18 @@ namespace pbrt {
   }
 
   void pbrtReverseOrientation() {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::ReverseOrientation, {});
     VERIFY_WORLD("ReverseOrientation");
+    shapeState.reset();
     graphicsState.reverseOrientation = !graphicsState.reverseOrientation;
     if (PbrtOptions.cat || PbrtOptions.toPly)
       printf("%*sReverseOrientation\n", catIndentCount, "");
   }
 
   void pbrtObjectBegin(const std::string& name) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::ObjectBegin, { name });
     VERIFY_WORLD("ObjectBegin");
     pbrtAttributeBegin();
     if (renderOptions->currentInstance)
@@ -1545,6 +2075,8 @@ namespace pbrt {
   STAT_COUNTER("Scene/Object instances created", nObjectInstancesCreated);
 
   void pbrtObjectEnd() {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::ObjectEnd, {});
     VERIFY_WORLD("ObjectEnd");
     if (!renderOptions->currentInstance)
       Error("ObjectEnd called outside of instance definition");
@@ -1558,6 +2090,8 @@ namespace pbrt {
   STAT_COUNTER("Scene/Object instances used", nObjectInstancesUsed);
 
   void pbrtObjectInstance(const std::string& name) {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::ObjectInstance, { name });
     VERIFY_WORLD("ObjectInstance");
     if (PbrtOptions.cat || PbrtOptions.toPly) {
       printf("%*sObjectInstance \"%s\"\n", catIndentCount, "", name.c_str());
@@ -1573,35 +2107,20 @@ namespace pbrt {
       Error("Unable to find instance named \"%s\"", name.c_str());
       return;
     }
-    std::vector<std::shared_ptr<Primitive>>& in =
-      renderOptions->instances[name];
-    if (in.empty()) return;
     ++nObjectInstancesUsed;
-    if (in.size() > 1) {
-      // Create aggregate for instance _Primitive_s
-      std::shared_ptr<Primitive> accel(
-        MakeAccelerator(renderOptions->AcceleratorName, std::move(in),
-          renderOptions->AcceleratorParams));
-      if (!accel) accel = std::make_shared<BVHAccel>(in);
-      in.clear();
-      in.push_back(accel);
-    }
     static_assert(MaxTransforms == 2,
       "TransformCache assumes only two transforms");
-    // Create _animatedInstanceToWorld_ transform for instance
-    Transform* InstanceToWorld[2] = {
-        transformCache.Lookup(curTransform[0]),
-        transformCache.Lookup(curTransform[1])
-    };
-    AnimatedTransform animatedInstanceToWorld(
-      InstanceToWorld[0], renderOptions->transformStartTime,
-      InstanceToWorld[1], renderOptions->transformEndTime);
-    std::shared_ptr<Primitive> prim(
-      std::make_shared<TransformedPrimitive>(in[0], animatedInstanceToWorld));
-    renderOptions->primitives.push_back(prim);
+    // Record instance use; its aggregate is built in _MakeScene()_
+    InstanceUse use;
+    use.name = name;
+    use.instanceToWorld[0] = transformCache.Lookup(curTransform[0]);
+    use.instanceToWorld[1] = transformCache.Lookup(curTransform[1]);
+    renderOptions->instanceUses.push_back(use);
   }
 
   void pbrtWorldEnd() {
+    if (binaryScene)
+      return binaryScene->Record(BinarySceneOp::WorldEnd, {});
     VERIFY_WORLD("WorldEnd");
     // Ensure there are no pushed graphics states
     while (pushedGraphicsStates.size()) {
@@ -1619,6 +2138,9 @@ namespace pbrt {
       printf("%*sWorldEnd\n", catIndentCount, "");
     }
     else {
+      // Create the pending shapes first, so that the integrator sees their
+      // area lights
+      InstantiatePendingShapes();
       std::unique_ptr<Integrator> integrator(renderOptions->MakeIntegrator());
       std::unique_ptr<Scene> scene(renderOptions->MakeScene());
 
@@ -1639,11 +2161,15 @@ namespace pbrt {
 
     // Clean up after rendering. Do this before reporting stats so that
     // destructors can run and update stats as needed.
+    pendingShapes.clear();
+    parsedIncludes.clear();
+    shapeState.reset();
     graphicsState = GraphicsState();
     transformCache.Clear();
     currentApiState = APIState::OptionsBlock;
     ImageTexture<Float, Float>::ClearCache();
     ImageTexture<RGBSpectrum, Spectrum>::ClearCache();
+    ClearMeshCache();
     renderOptions.reset(new RenderOptions);
 
     if (!PbrtOptions.cat && !PbrtOptions.toPly) {
@@ -1663,10 +2189,66 @@ namespace pbrt {
       namedCoordinateSystems.end());
   }
 
+  STAT_COUNTER("Scene/Static object instances", nStaticInstances);
+
   Scene* RenderOptions::MakeScene() {
-    std::shared_ptr<Primitive> accelerator =
-      MakeAccelerator(AcceleratorName, std::move(primitives), AcceleratorParams);
-    if (!accelerator) accelerator = std::make_shared<BVHAccel>(primitives);
+    InstantiatePendingShapes();
+
+    // Build aggregates for the used object instances in parallel
+    std::map<std::string, std::vector<std::shared_ptr<Primitive>>*> used;
+    for (const InstanceUse& use : instanceUses)
+      used[use.name] = &instances[use.name];
+    std::vector<std::vector<std::shared_ptr<Primitive>>*> instancesToBuild;
+    for (const auto& u : used)
+      if (u.second->size() > 1) instancesToBuild.push_back(u.second);
+    NestableParallelFor([&](int64_t i) {
+      // Create aggregate for instance _Primitive_s
+      std::vector<std::shared_ptr<Primitive>>& in = *instancesToBuild[i];
+      ParamSet accelParams = AcceleratorParams;
+      std::shared_ptr<Primitive> accel(
+        MakeAccelerator(AcceleratorName, in, accelParams));
+      if (!accel) accel = std::make_shared<BVHAccel>(in);
+      in.clear();
+      in.push_back(accel);
+    }, instancesToBuild.size());
+
+    // Add instances to the top-level primitives
+    for (const InstanceUse& use : instanceUses) {
+      if (instances[use.name].empty()) continue;
+      std::shared_ptr<Primitive>& in = instances[use.name][0];
+      if (use.instanceToWorld[0] == use.instanceToWorld[1]) {
+        // Use precomputed inverse for static instance transformation
+        primitives.push_back(
+          std::make_shared<InstancePrimitive>(in, use.instanceToWorld[0]));
+        ++nStaticInstances;
+      }
+      else {
+        // Animated instances also bound their motion over parts of the
+        // shutter interval for motion-aware aggregates
+        primitives.push_back(std::make_shared<AnimatedInstancePrimitive>(
+          in, use.instanceToWorld[0], transformStartTime,
+          use.instanceToWorld[1], transformEndTime));
+      }
+    }
+    instanceUses.clear();
+
+    std::shared_ptr<Primitive> accelerator;
+    bool refit = AcceleratorName == "bvh8" &&
+      AcceleratorParams.FindOneBool("refit", false);
+    Float rebuildThreshold =
+      AcceleratorParams.FindOneFloat("rebuildthreshold", 1.5f);
+    if (refit && refitAccelerator) {
+      // Refit the previous frame's aggregate to the new primitives
+      if (refitAccelerator->Refit(primitives, rebuildThreshold))
+        accelerator = refitAccelerator;
+    }
+    if (!accelerator) {
+      accelerator = MakeAccelerator(AcceleratorName, std::move(primitives),
+        AcceleratorParams);
+      if (!accelerator) accelerator = std::make_shared<BVHAccel>(primitives);
+    }
+    refitAccelerator =
+      refit ? std::dynamic_pointer_cast<WideBVHAccel>(accelerator) : nullptr;
     Scene* scene = new Scene(accelerator, lights);
     // Erase primitives and lights from _RenderOptions_
     primitives.clear();
@@ -1698,6 +2280,9 @@ namespace pbrt {
       integrator = CreatePathIntegrator(IntegratorParams, sampler, camera);
     else if (IntegratorName == "volpath")
       integrator = CreateVolPathIntegrator(IntegratorParams, sampler, camera);
+    else if (IntegratorName == "wavefront")
+      integrator =
+      CreateWavefrontPathIntegrator(IntegratorParams, sampler, camera);
     else if (IntegratorName == "bdpt") {
       integrator = CreateBDPTIntegrator(IntegratorParams, sampler, camera);
     }
@@ -1723,6 +2308,19 @@ namespace pbrt {
         "\"mlt\".", IntegratorName.c_str());
     }
 
+    // Enable camera-ray packet tracing if requested; integrators that
+    // don't shade the intersections found for them would trace each camera
+    // ray twice
+    int packetSize = IntegratorParams.FindOneInt("packetsize", 0);
+    if (packetSize != 0) {
+      SamplerIntegrator* si = dynamic_cast<SamplerIntegrator*>(integrator);
+      if (si && si->ShadesFoundIntersections())
+        si->SetPacketSize(packetSize);
+      else
+        Warning("\"packetsize\" is ignored by the \"%s\" integrator.",
+          IntegratorName.c_str());
+    }
+
     IntegratorParams.ReportUnused();
     // Warn if no light sources are defined
     if (lights.empty())
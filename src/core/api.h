@@ -88,6 +88,15 @@ namespace pbrt {
   void pbrtObjectInstance(const std::string& name);
   void pbrtWorldEnd();
 
+  // To be called by the parser for _Include_ statements with the file's
+  // resolved path. Returns true if the file was queued to be parsed in
+  // parallel with the other includes before the next statement; otherwise
+  // the parser must read it inline. Queued files that turn out to hold
+  // anything other than shapes are read with _pbrtParseFile()_ at that
+  // point. The scene parser isn't part of this tree, so nothing calls this
+  // yet; until its _Include_ handling does, includes are read inline.
+  bool pbrtInclude(const std::string& filename);
+
   void pbrtParseFile(std::string filename);
   void pbrtParseString(std::string str);
 
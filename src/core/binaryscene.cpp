@@ -0,0 +1,723 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// core/binaryscene.cpp*
+#include "binaryscene.h"
+#include "api.h"
+#include "paramset.h"
+#include "spectrum.h"
+#include <cstring>
+#include <fstream>
+#include <set>
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace pbrt {
+
+  // BinaryScene Local Definitions
+  static const char BinarySceneMagic[8] = { 'P', 'B', 'R', 'T', 'S', 'C',
+                                            'N', 'B' };
+  static PBRT_CONSTEXPR uint32_t BinarySceneVersion = 2;
+  static PBRT_CONSTEXPR uint32_t BinarySceneByteOrder = 0x01020304;
+
+  struct BinarySceneHeader {
+    char magic[8];
+    uint32_t version, byteOrder, floatSize, spectrumSamples;
+  };
+
+  // Spectra are stored as their _Spectrum::nSamples_ coefficients
+  enum class BinaryParamType : uint32_t {
+    Int, Bool, Float, Point2, Vector2, Point3, Vector3, Normal, Spectrum,
+    String, Texture
+  };
+
+  // Names of the parameters that may hold large arrays, which are found by
+  // name rather than from the text form of their _ParamSet_
+  static const char* BinaryArrayParams[] = {
+    "P", "N", "S", "uv", "st", "indices", "faceIndices", "Pw", "Pz",
+    "uknots", "vknots", "width", "density", "Le", "temperature"
+  };
+
+  // Maps the type names used in parameter declarations to their types
+  static bool LookupParamType(const std::string& name, BinaryParamType* type) {
+    static const struct {
+      const char* name;
+      BinaryParamType type;
+    } types[] = {
+      { "integer", BinaryParamType::Int }, { "bool", BinaryParamType::Bool },
+      { "float", BinaryParamType::Float },
+      { "point2", BinaryParamType::Point2 },
+      { "vector2", BinaryParamType::Vector2 },
+      { "point", BinaryParamType::Point3 },
+      { "point3", BinaryParamType::Point3 },
+      { "vector", BinaryParamType::Vector3 },
+      { "vector3", BinaryParamType::Vector3 },
+      { "normal", BinaryParamType::Normal },
+      { "normal3", BinaryParamType::Normal },
+      { "rgb", BinaryParamType::Spectrum },
+      { "color", BinaryParamType::Spectrum },
+      { "xyz", BinaryParamType::Spectrum },
+      { "spectrum", BinaryParamType::Spectrum },
+      { "blackbody", BinaryParamType::Spectrum },
+      { "string", BinaryParamType::String },
+      { "texture", BinaryParamType::Texture } };
+    for (const auto& t : types)
+      if (name == t.name) {
+        *type = t.type;
+        return true;
+      }
+    return false;
+  }
+
+  static bool EraseParam(ParamSet* params, BinaryParamType type,
+    const std::string& name) {
+    switch (type) {
+    case BinaryParamType::Int:
+      return params->EraseInt(name);
+    case BinaryParamType::Bool:
+      return params->EraseBool(name);
+    case BinaryParamType::Float:
+      return params->EraseFloat(name);
+    case BinaryParamType::Point2:
+      return params->ErasePoint2f(name);
+    case BinaryParamType::Vector2:
+      return params->EraseVector2f(name);
+    case BinaryParamType::Point3:
+      return params->ErasePoint3f(name);
+    case BinaryParamType::Vector3:
+      return params->EraseVector3f(name);
+    case BinaryParamType::Normal:
+      return params->EraseNormal3f(name);
+    case BinaryParamType::Spectrum:
+      return params->EraseSpectrum(name);
+    case BinaryParamType::String:
+      return params->EraseString(name);
+    case BinaryParamType::Texture:
+      return params->EraseTexture(name);
+    }
+    return false;
+  }
+
+  // Adds the _n_ spectra with coefficients _c_ to _params_. _ParamSet_ only
+  // takes spectra in the forms they can be declared in: RGB spectra are
+  // added as RGB, which they store as is, and sampled spectra as values at
+  // the centers of their wavelength bins. Those values are solved for so
+  // that averaging their piecewise-linear interpolant over each bin, as
+  // _SampledSpectrum::FromSampled()_ does, gives back the coefficients.
+  static void AddSpectra(ParamSet* params, const std::string& name,
+    const Float* c, int n) {
+    PBRT_CONSTEXPR int nc = Spectrum::nSamples;
+    if (nc == 3) {
+      std::unique_ptr<Float[]> rgb(new Float[3 * n]);
+      std::copy(c, c + 3 * n, rgb.get());
+      params->AddRGBSpectrum(name, std::move(rgb), 3 * n);
+      return;
+    }
+    std::unique_ptr<Float[]> samples(new Float[2 * nc * n]);
+    for (int s = 0; s < n; ++s) {
+      // Solve the tridiagonal system $(x_{i-1} + 6x_i + x_{i+1})/8 = c_i$,
+      // whose end rows are $(7x_0 + x_1)/8$ and $(x_{n-2} + 7x_{n-1})/8$
+      const Float* cs = c + nc * s;
+      Float upper[nc], x[nc];
+      for (int i = 0; i < nc; ++i) {
+        Float diag = (i == 0 || i == nc - 1) ? 7 : 6;
+        if (i > 0) diag -= upper[i - 1];
+        upper[i] = 1 / diag;
+        x[i] = (8 * cs[i] - (i > 0 ? x[i - 1] : 0)) / diag;
+      }
+      for (int i = nc - 2; i >= 0; --i) x[i] -= upper[i] * x[i + 1];
+      Float* out = samples.get() + 2 * nc * s;
+      for (int i = 0; i < nc; ++i) {
+        out[2 * i] = Lerp((i + Float(0.5)) / nc, sampledLambdaStart,
+          sampledLambdaEnd);
+        out[2 * i + 1] = x[i];
+      }
+    }
+    params->AddSampledSpectrum(name, std::move(samples), 2 * nc * n);
+  }
+
+  // BinarySceneWriter Method Definitions
+  BinarySceneWriter::BinarySceneWriter(const std::string& filename)
+    : filename(filename), file(fopen(filename.c_str(), "wb")) {
+    if (!file) {
+      Error("%s: unable to open binary scene file for writing",
+        filename.c_str());
+      return;
+    }
+    BinarySceneHeader header;
+    memcpy(header.magic, BinarySceneMagic, sizeof(header.magic));
+    header.version = BinarySceneVersion;
+    header.byteOrder = BinarySceneByteOrder;
+    header.floatSize = sizeof(Float);
+    header.spectrumSamples = Spectrum::nSamples;
+    write(&header, sizeof(header));
+  }
+
+  BinarySceneWriter::~BinarySceneWriter() {
+    if (!file) return;
+    uint32_t end = (uint32_t)BinarySceneOp::End;
+    write(&end, sizeof(end));
+    if (fclose(file) != 0)
+      Error("%s: error writing binary scene file", filename.c_str());
+  }
+
+  void BinarySceneWriter::write(const void* data, size_t size) {
+    if (file && size > 0 && fwrite(data, size, 1, file) != 1) {
+      Error("%s: error writing binary scene file", filename.c_str());
+      fclose(file);
+      file = nullptr;
+    }
+  }
+
+  void BinarySceneWriter::writeString(const std::string& s) {
+    uint32_t length = s.size();
+    write(&length, sizeof(length));
+    write(s.data(), length);
+  }
+
+  void BinarySceneWriter::Record(BinarySceneOp op,
+    std::initializer_list<std::string> strings,
+    std::initializer_list<Float> floats,
+    const ParamSet* params) {
+    uint32_t header[2] = { (uint32_t)op, (uint32_t)strings.size() };
+    write(header, sizeof(header));
+    for (const std::string& s : strings) writeString(s);
+    uint32_t nFloats = floats.size();
+    write(&nFloats, sizeof(nFloats));
+    write(floats.begin(), nFloats * sizeof(Float));
+    uint32_t hasParams = params != nullptr;
+    write(&hasParams, sizeof(hasParams));
+    if (params) writeParams(*params);
+  }
+
+  void BinarySceneWriter::Record(BinarySceneOp op,
+    std::initializer_list<std::string> strings,
+    const Float* floats, int nFloats) {
+    uint32_t header[2] = { (uint32_t)op, (uint32_t)strings.size() };
+    write(header, sizeof(header));
+    for (const std::string& s : strings) writeString(s);
+    uint32_t n = nFloats;
+    write(&n, sizeof(n));
+    write(floats, n * sizeof(Float));
+    uint32_t hasParams = 0;
+    write(&hasParams, sizeof(hasParams));
+  }
+
+  void BinarySceneWriter::writeParams(const ParamSet& params) {
+    // _ParamSet_ doesn't expose its items, so find their names and types
+    // and then read each parameter's exact values back through the typed
+    // lookup methods. Parameters that may be large arrays are found by
+    // erasing them from a copy of _params_; the remaining ones are found
+    // from the declarations in the copy's text form, which are the quoted
+    // "type name" strings outside of value lists.
+    std::vector<std::pair<BinaryParamType, std::string>> decls;
+    std::set<std::pair<BinaryParamType, std::string>> seen;
+    ParamSet rest = params;
+    for (const char* name : BinaryArrayParams)
+      for (uint32_t t = 0; t <= (uint32_t)BinaryParamType::Texture; ++t)
+        if (EraseParam(&rest, (BinaryParamType)t, name)) {
+          auto decl = std::make_pair((BinaryParamType)t, std::string(name));
+          if (seen.insert(decl).second) decls.push_back(decl);
+        }
+    std::string text = rest.ToString();
+    int depth = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+      if (text[i] == '[')
+        ++depth;
+      else if (text[i] == ']')
+        --depth;
+      else if (text[i] == '"') {
+        size_t end = text.find('"', i + 1);
+        if (end == std::string::npos) break;
+        std::string quoted = text.substr(i + 1, end - i - 1);
+        i = end;
+        size_t space = quoted.find(' ');
+        BinaryParamType type;
+        if (depth == 0 && space != std::string::npos &&
+          LookupParamType(quoted.substr(0, space), &type)) {
+          auto decl = std::make_pair(type, quoted.substr(space + 1));
+          if (seen.insert(decl).second) decls.push_back(decl);
+        }
+      }
+    }
+
+    uint32_t nParams = 0;
+    std::vector<uint8_t> data;
+    auto append = [&](const void* p, size_t size) {
+      data.insert(data.end(), (const uint8_t*)p, (const uint8_t*)p + size);
+    };
+    auto appendItem = [&](BinaryParamType type, const std::string& name,
+      const void* values, int n, size_t size) {
+      uint32_t item[3] = { (uint32_t)type, (uint32_t)name.size(),
+                           (uint32_t)n };
+      append(item, sizeof(item));
+      append(name.data(), name.size());
+      append(values, n * size);
+      ++nParams;
+    };
+    for (const auto& decl : decls) {
+      const std::string& name = decl.second;
+      int n = 0;
+      switch (decl.first) {
+      case BinaryParamType::Int:
+        if (const int* v = params.FindInt(name, &n))
+          appendItem(decl.first, name, v, n, sizeof(int));
+        break;
+      case BinaryParamType::Bool:
+        if (const bool* v = params.FindBool(name, &n)) {
+          std::vector<uint8_t> b(v, v + n);
+          appendItem(decl.first, name, b.data(), n, 1);
+        }
+        break;
+      case BinaryParamType::Float:
+        if (const Float* v = params.FindFloat(name, &n))
+          appendItem(decl.first, name, v, n, sizeof(Float));
+        break;
+      case BinaryParamType::Point2:
+        if (const Point2f* v = params.FindPoint2f(name, &n))
+          appendItem(decl.first, name, v, n, sizeof(Point2f));
+        break;
+      case BinaryParamType::Vector2:
+        if (const Vector2f* v = params.FindVector2f(name, &n))
+          appendItem(decl.first, name, v, n, sizeof(Vector2f));
+        break;
+      case BinaryParamType::Point3:
+        if (const Point3f* v = params.FindPoint3f(name, &n))
+          appendItem(decl.first, name, v, n, sizeof(Point3f));
+        break;
+      case BinaryParamType::Vector3:
+        if (const Vector3f* v = params.FindVector3f(name, &n))
+          appendItem(decl.first, name, v, n, sizeof(Vector3f));
+        break;
+      case BinaryParamType::Normal:
+        if (const Normal3f* v = params.FindNormal3f(name, &n))
+          appendItem(decl.first, name, v, n, sizeof(Normal3f));
+        break;
+      case BinaryParamType::Spectrum:
+        if (const Spectrum* v = params.FindSpectrum(name, &n)) {
+          PBRT_CONSTEXPR int nc = Spectrum::nSamples;
+          std::vector<Float> c(nc * n);
+          for (int i = 0; i < n; ++i)
+            for (int j = 0; j < nc; ++j) c[nc * i + j] = v[i][j];
+          appendItem(decl.first, name, c.data(), nc * n, sizeof(Float));
+        }
+        break;
+      case BinaryParamType::String:
+        if (const std::string* v = params.FindString(name, &n)) {
+          std::vector<uint8_t> packed;
+          for (int i = 0; i < n; ++i) {
+            uint32_t length = v[i].size();
+            packed.insert(packed.end(), (const uint8_t*)&length,
+              (const uint8_t*)&length + sizeof(length));
+            packed.insert(packed.end(), v[i].begin(), v[i].end());
+          }
+          appendItem(decl.first, name, packed.data(), packed.size(), 1);
+        }
+        break;
+      case BinaryParamType::Texture: {
+        std::string texName = params.FindTexture(name);
+        if (!texName.empty())
+          appendItem(decl.first, name, texName.data(), texName.size(), 1);
+        break;
+      }
+      }
+    }
+    write(&nParams, sizeof(nParams));
+    write(data.data(), data.size());
+  }
+
+  // BinarySceneReader Definitions
+
+  // Reads records from a mapped binary scene; all reads are bounds-checked
+  // and go through _memcpy()_ since values are not aligned in the file
+  class BinarySceneReader {
+  public:
+    BinarySceneReader(const uint8_t* data, size_t size)
+      : ptr(data), end(data + size) {}
+    bool Read(void* dest, size_t size) {
+      if ((size_t)(end - ptr) < size) return false;
+      memcpy(dest, ptr, size);
+      ptr += size;
+      return true;
+    }
+    bool ReadU32(uint32_t* v) { return Read(v, sizeof(*v)); }
+    bool ReadString(std::string* s, uint32_t length) {
+      if ((size_t)(end - ptr) < length) return false;
+      s->assign((const char*)ptr, length);
+      ptr += length;
+      return true;
+    }
+    bool ReadString(std::string* s) {
+      uint32_t length;
+      return ReadU32(&length) && ReadString(s, length);
+    }
+    template <typename T>
+    bool ReadArray(uint32_t n, std::unique_ptr<T[]>* values) {
+      if ((size_t)(end - ptr) / sizeof(T) < n) return false;
+      values->reset(new T[n]);
+      return Read(values->get(), n * sizeof(T));
+    }
+    bool ReadParams(ParamSet* params);
+
+  private:
+    const uint8_t* ptr;
+    const uint8_t* end;
+  };
+
+  bool BinarySceneReader::ReadParams(ParamSet* params) {
+    uint32_t nParams;
+    if (!ReadU32(&nParams)) return false;
+    for (uint32_t p = 0; p < nParams; ++p) {
+      uint32_t item[3];
+      std::string name;
+      if (!Read(item, sizeof(item)) || !ReadString(&name, item[1]))
+        return false;
+      uint32_t n = item[2];
+      bool ok = true;
+      switch ((BinaryParamType)item[0]) {
+      case BinaryParamType::Int: {
+        std::unique_ptr<int[]> v;
+        if ((ok = ReadArray(n, &v))) params->AddInt(name, std::move(v), n);
+        break;
+      }
+      case BinaryParamType::Bool: {
+        std::unique_ptr<uint8_t[]> b;
+        if ((ok = ReadArray(n, &b))) {
+          std::unique_ptr<bool[]> v(new bool[n]);
+          for (uint32_t i = 0; i < n; ++i) v[i] = b[i] != 0;
+          params->AddBool(name, std::move(v), n);
+        }
+        break;
+      }
+      case BinaryParamType::Float: {
+        std::unique_ptr<Float[]> v;
+        if ((ok = ReadArray(n, &v))) params->AddFloat(name, std::move(v), n);
+        break;
+      }
+      case BinaryParamType::Point2: {
+        std::unique_ptr<Point2f[]> v;
+        if ((ok = ReadArray(n, &v)))
+          params->AddPoint2f(name, std::move(v), n);
+        break;
+      }
+      case BinaryParamType::Vector2: {
+        std::unique_ptr<Vector2f[]> v;
+        if ((ok = ReadArray(n, &v)))
+          params->AddVector2f(name, std::move(v), n);
+        break;
+      }
+      case BinaryParamType::Point3: {
+        std::unique_ptr<Point3f[]> v;
+        if ((ok = ReadArray(n, &v)))
+          params->AddPoint3f(name, std::move(v), n);
+        break;
+      }
+      case BinaryParamType::Vector3: {
+        std::unique_ptr<Vector3f[]> v;
+        if ((ok = ReadArray(n, &v)))
+          params->AddVector3f(name, std::move(v), n);
+        break;
+      }
+      case BinaryParamType::Normal: {
+        std::unique_ptr<Normal3f[]> v;
+        if ((ok = ReadArray(n, &v)))
+          params->AddNormal3f(name, std::move(v), n);
+        break;
+      }
+      case BinaryParamType::Spectrum: {
+        std::unique_ptr<Float[]> v;
+        if ((ok = n % Spectrum::nSamples == 0 && ReadArray(n, &v)))
+          AddSpectra(params, name, v.get(), n / Spectrum::nSamples);
+        break;
+      }
+      case BinaryParamType::String: {
+        // _n_ is the size of the packed strings in bytes
+        BinarySceneReader strings(ptr, n);
+        std::vector<std::string> values;
+        std::string s;
+        while (strings.ptr < strings.end && (ok = strings.ReadString(&s)))
+          values.push_back(s);
+        if ((ok = ok && (size_t)(end - ptr) >= n)) {
+          ptr += n;
+          std::unique_ptr<std::string[]> v(new std::string[values.size()]);
+          std::copy(values.begin(), values.end(), v.get());
+          params->AddString(name, std::move(v), values.size());
+        }
+        break;
+      }
+      case BinaryParamType::Texture: {
+        std::string texName;
+        if ((ok = ReadString(&texName, n))) params->AddTexture(name, texName);
+        break;
+      }
+      default:
+        ok = false;
+      }
+      if (!ok) return false;
+    }
+    return true;
+  }
+
+  // BinaryScene Function Definitions
+  bool IsBinarySceneFile(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary);
+    char magic[sizeof(BinarySceneMagic)];
+    return in.read(magic, sizeof(magic)) &&
+      memcmp(magic, BinarySceneMagic, sizeof(magic)) == 0;
+  }
+
+  bool ParseBinaryScene(const std::string& filename) {
+    // Map the file, or read it into memory where mapping isn't available
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+#ifdef PBRT_HAVE_MMAP
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat s;
+    void* ptr = MAP_FAILED;
+    if (fstat(fd, &s) == 0 && s.st_size > 0) {
+      size = s.st_size;
+      ptr = mmap(nullptr, size, PROT_READ, MAP_FILE | MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (ptr == MAP_FAILED) return false;
+    data = (const uint8_t*)ptr;
+#else
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in) return false;
+    std::vector<uint8_t> buffer(in.tellg());
+    in.seekg(0);
+    if (!in.read((char*)buffer.data(), buffer.size())) return false;
+    data = buffer.data();
+    size = buffer.size();
+#endif
+
+    BinarySceneReader reader(data, size);
+    BinarySceneHeader header;
+    bool ok = reader.Read(&header, sizeof(header));
+    if (ok && (memcmp(header.magic, BinarySceneMagic, 8) != 0 ||
+      header.version != BinarySceneVersion ||
+      header.byteOrder != BinarySceneByteOrder ||
+      header.floatSize != sizeof(Float) ||
+      header.spectrumSamples != Spectrum::nSamples)) {
+      Error("%s: binary scene was written by an incompatible build of pbrt",
+        filename.c_str());
+      ok = false;
+    }
+
+    // Replay the recorded API calls
+    std::vector<std::string> strings;
+    std::unique_ptr<Float[]> floats;
+    while (ok) {
+      uint32_t op, nStrings, nFloats, hasParams;
+      if (!reader.ReadU32(&op)) {
+        ok = false;
+        break;
+      }
+      if ((BinarySceneOp)op == BinarySceneOp::End) break;
+      ok = reader.ReadU32(&nStrings);
+      strings.resize(ok ? nStrings : 0);
+      for (uint32_t i = 0; ok && i < nStrings; ++i)
+        ok = reader.ReadString(&strings[i]);
+      ok = ok && reader.ReadU32(&nFloats) &&
+        reader.ReadArray(nFloats, &floats) && reader.ReadU32(&hasParams);
+      ParamSet params;
+      ok = ok && (!hasParams || reader.ReadParams(&params));
+      if (!ok) break;
+
+      // Check the argument counts before dispatching the call
+      static const struct {
+        BinarySceneOp op;
+        uint32_t nStrings, nFloats;
+      } signatures[] = {
+        { BinarySceneOp::Translate, 0, 3 }, { BinarySceneOp::Rotate, 0, 4 },
+        { BinarySceneOp::Scale, 0, 3 }, { BinarySceneOp::LookAt, 0, 9 },
+        { BinarySceneOp::ConcatTransform, 0, 16 },
+        { BinarySceneOp::Transform, 0, 16 },
+        { BinarySceneOp::CoordinateSystem, 1, 0 },
+        { BinarySceneOp::CoordSysTransform, 1, 0 },
+        { BinarySceneOp::TransformTimes, 0, 2 },
+        { BinarySceneOp::PixelFilter, 1, 0 }, { BinarySceneOp::Film, 1, 0 },
+        { BinarySceneOp::Sampler, 1, 0 },
+        { BinarySceneOp::Accelerator, 1, 0 },
+        { BinarySceneOp::Integrator, 1, 0 }, { BinarySceneOp::Camera, 1, 0 },
+        { BinarySceneOp::MakeNamedMedium, 1, 0 },
+        { BinarySceneOp::MediumInterface, 2, 0 },
+        { BinarySceneOp::Texture, 3, 0 }, { BinarySceneOp::Material, 1, 0 },
+        { BinarySceneOp::MakeNamedMaterial, 1, 0 },
+        { BinarySceneOp::NamedMaterial, 1, 0 },
+        { BinarySceneOp::LightSource, 1, 0 },
+        { BinarySceneOp::AreaLightSource, 1, 0 },
+        { BinarySceneOp::Shape, 1, 0 }, { BinarySceneOp::ObjectBegin, 1, 0 },
+        { BinarySceneOp::ObjectInstance, 1, 0 } };
+      uint32_t wantStrings = 0, wantFloats = 0;
+      for (const auto& sig : signatures)
+        if ((uint32_t)sig.op == op) {
+          wantStrings = sig.nStrings;
+          wantFloats = sig.nFloats;
+        }
+      if (nStrings != wantStrings || nFloats != wantFloats) {
+        ok = false;
+        break;
+      }
+      const Float* f = floats.get();
+      switch ((BinarySceneOp)op) {
+      case BinarySceneOp::Identity:
+        pbrtIdentity();
+        break;
+      case BinarySceneOp::Translate:
+        pbrtTranslate(f[0], f[1], f[2]);
+        break;
+      case BinarySceneOp::Rotate:
+        pbrtRotate(f[0], f[1], f[2], f[3]);
+        break;
+      case BinarySceneOp::Scale:
+        pbrtScale(f[0], f[1], f[2]);
+        break;
+      case BinarySceneOp::LookAt:
+        pbrtLookAt(f[0], f[1], f[2], f[3], f[4], f[5], f[6], f[7], f[8]);
+        break;
+      case BinarySceneOp::ConcatTransform:
+        pbrtConcatTransform(floats.get());
+        break;
+      case BinarySceneOp::Transform:
+        pbrtTransform(floats.get());
+        break;
+      case BinarySceneOp::CoordinateSystem:
+        pbrtCoordinateSystem(strings[0]);
+        break;
+      case BinarySceneOp::CoordSysTransform:
+        pbrtCoordSysTransform(strings[0]);
+        break;
+      case BinarySceneOp::ActiveTransformAll:
+        pbrtActiveTransformAll();
+        break;
+      case BinarySceneOp::ActiveTransformEndTime:
+        pbrtActiveTransformEndTime();
+        break;
+      case BinarySceneOp::ActiveTransformStartTime:
+        pbrtActiveTransformStartTime();
+        break;
+      case BinarySceneOp::TransformTimes:
+        pbrtTransformTimes(f[0], f[1]);
+        break;
+      case BinarySceneOp::PixelFilter:
+        pbrtPixelFilter(strings[0], params);
+        break;
+      case BinarySceneOp::Film:
+        pbrtFilm(strings[0], params);
+        break;
+      case BinarySceneOp::Sampler:
+        pbrtSampler(strings[0], params);
+        break;
+      case BinarySceneOp::Accelerator:
+        pbrtAccelerator(strings[0], params);
+        break;
+      case BinarySceneOp::Integrator:
+        pbrtIntegrator(strings[0], params);
+        break;
+      case BinarySceneOp::Camera:
+        pbrtCamera(strings[0], params);
+        break;
+      case BinarySceneOp::MakeNamedMedium:
+        pbrtMakeNamedMedium(strings[0], params);
+        break;
+      case BinarySceneOp::MediumInterface:
+        pbrtMediumInterface(strings[0], strings[1]);
+        break;
+      case BinarySceneOp::WorldBegin:
+        pbrtWorldBegin();
+        break;
+      case BinarySceneOp::AttributeBegin:
+        pbrtAttributeBegin();
+        break;
+      case BinarySceneOp::AttributeEnd:
+        pbrtAttributeEnd();
+        break;
+      case BinarySceneOp::TransformBegin:
+        pbrtTransformBegin();
+        break;
+      case BinarySceneOp::TransformEnd:
+        pbrtTransformEnd();
+        break;
+      case BinarySceneOp::Texture:
+        pbrtTexture(strings[0], strings[1], strings[2], params);
+        break;
+      case BinarySceneOp::Material:
+        pbrtMaterial(strings[0], params);
+        break;
+      case BinarySceneOp::MakeNamedMaterial:
+        pbrtMakeNamedMaterial(strings[0], params);
+        break;
+      case BinarySceneOp::NamedMaterial:
+        pbrtNamedMaterial(strings[0]);
+        break;
+      case BinarySceneOp::LightSource:
+        pbrtLightSource(strings[0], params);
+        break;
+      case BinarySceneOp::AreaLightSource:
+        pbrtAreaLightSource(strings[0], params);
+        break;
+      case BinarySceneOp::Shape:
+        pbrtShape(strings[0], params);
+        break;
+      case BinarySceneOp::ReverseOrientation:
+        pbrtReverseOrientation();
+        break;
+      case BinarySceneOp::ObjectBegin:
+        pbrtObjectBegin(strings[0]);
+        break;
+      case BinarySceneOp::ObjectEnd:
+        pbrtObjectEnd();
+        break;
+      case BinarySceneOp::ObjectInstance:
+        pbrtObjectInstance(strings[0]);
+        break;
+      case BinarySceneOp::WorldEnd:
+        pbrtWorldEnd();
+        break;
+      default:
+        ok = false;
+      }
+    }
+    if (!ok) Error("%s: binary scene file is corrupt", filename.c_str());
+#ifdef PBRT_HAVE_MMAP
+    munmap((void*)data, size);
+#endif
+    return ok;
+  }
+
+}  // namespace pbrt
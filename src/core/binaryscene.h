@@ -0,0 +1,92 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_BINARYSCENE_H
+#define PBRT_CORE_BINARYSCENE_H
+
+// core/binaryscene.h*
+#include "pbrt.h"
+#include <cstdio>
+
+namespace pbrt {
+
+  // BinaryScene Declarations
+
+  // One opcode per _pbrt*()_ API call
+  enum class BinarySceneOp : uint32_t {
+    End, Identity, Translate, Rotate, Scale, LookAt, ConcatTransform,
+    Transform, CoordinateSystem, CoordSysTransform, ActiveTransformAll,
+    ActiveTransformEndTime, ActiveTransformStartTime, TransformTimes,
+    PixelFilter, Film, Sampler, Accelerator, Integrator, Camera,
+    MakeNamedMedium, MediumInterface, WorldBegin, AttributeBegin,
+    AttributeEnd, TransformBegin, TransformEnd, Texture, Material,
+    MakeNamedMaterial, NamedMaterial, LightSource, AreaLightSource, Shape,
+    ReverseOrientation, ObjectBegin, ObjectEnd, ObjectInstance, WorldEnd
+  };
+
+  // Records the stream of API calls of a scene to a binary file. Each call
+  // is stored as its opcode followed by its string and floating-point
+  // arguments and its parameter list, whose values are written as raw
+  // arrays so that loading needs no tokenizing or number parsing.
+  class BinarySceneWriter {
+  public:
+    // BinarySceneWriter Public Methods
+    BinarySceneWriter(const std::string& filename);
+    ~BinarySceneWriter();
+    void Record(BinarySceneOp op, std::initializer_list<std::string> strings,
+      std::initializer_list<Float> floats = {},
+      const ParamSet* params = nullptr);
+    void Record(BinarySceneOp op, std::initializer_list<std::string> strings,
+      const Float* floats, int nFloats);
+
+  private:
+    // BinarySceneWriter Private Methods
+    void write(const void* data, size_t size);
+    void writeString(const std::string& s);
+    void writeParams(const ParamSet& params);
+
+    // BinarySceneWriter Private Data
+    const std::string filename;
+    FILE* file;
+  };
+
+  bool IsBinarySceneFile(const std::string& filename);
+  bool ParseBinaryScene(const std::string& filename);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_BINARYSCENE_H
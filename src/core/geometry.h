@@ -925,6 +925,26 @@ namespace pbrt {
     Vector3f rxDirection, ryDirection;
   };
 
+  // Per-ray constants shared by every bounding box and triangle test of a
+  // traversal: the reciprocal direction and its signs for the slab test,
+  // and the axis permutation and shear of the watertight ray-triangle test.
+  // The ray's _tMax_ is read through _ray_ since it shrinks as hits are found.
+  class RayQuery {
+  public:
+    // RayQuery Public Methods
+    RayQuery() = default;
+    explicit RayQuery(const Ray& ray);
+    const Point3f& Origin() const { return ray->o; }
+    Float TMax() const { return ray->tMax; }
+
+    // RayQuery Public Data
+    const Ray* ray;
+    Vector3f invDir;
+    int dirIsNeg[3];
+    int kx, ky, kz;
+    Float Sx, Sy, Sz;
+  };
+
   // Geometry Inline Functions
   template <typename T>
   inline Vector3<T>::Vector3(const Point3<T>& p)
@@ -1437,6 +1457,23 @@ namespace pbrt {
     return (tMin < ray.tMax) && (tMax > 0);
   }
 
+  inline RayQuery::RayQuery(const Ray& ray)
+    : ray(&ray), invDir(1 / ray.d.x, 1 / ray.d.y, 1 / ray.d.z) {
+    dirIsNeg[0] = invDir.x < 0;
+    dirIsNeg[1] = invDir.y < 0;
+    dirIsNeg[2] = invDir.z < 0;
+    // Permute the dominant direction axis to $z$ and compute the shear,
+    // reusing the reciprocal instead of dividing again
+    kz = MaxDimension(Abs(ray.d));
+    kx = kz + 1;
+    if (kx == 3) kx = 0;
+    ky = kx + 1;
+    if (ky == 3) ky = 0;
+    Sz = invDir[kz];
+    Sx = -ray.d[kx] * Sz;
+    Sy = -ray.d[ky] * Sz;
+  }
+
   inline Point3f OffsetRayOrigin(const Point3f& p, const Vector3f& pError,
     const Normal3f& n, const Vector3f& w) {
     Float d = Dot(Abs(n), pError);
@@ -1,5 +1,25 @@
 #include "integrator.h"
 
+// Replaces invalid radiance values for an image sample with black
+Spectrum CheckRadiance(const Spectrum& L) {
+  if (L.HasNaNs()) {
+    Error("Not-a-number radiance value returned "
+      "for image sample.  Setting to black.");
+    return Spectrum(0.f);
+  }
+  else if (L.y() < -1e-5) {
+    Error("Negative luminance value, %f, returned "
+      "for image sample.  Setting to black.", L.y());
+    return Spectrum(0.f);
+  }
+  else if (std::isinf(L.y())) {
+    Error("Infinite luminance value returned "
+      "for image sample.  Setting to black.");
+    return Spectrum(0.f);
+  }
+  return L;
+}
+
 void SamplerIntegrator::Render(const Scene& scene) {
   Preprocess(scene, *sampler);
 
@@ -16,10 +36,6 @@ void SamplerIntegrator::Render(const Scene& scene) {
       // Allocate MemoryArena for tile
       MemoryArena arena;
 
-      // Get sampler instance for tile
-      int seed = tile.y * nTiles.x + tile.x;
-      std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
-
       // Compute sample bounds for tile
       int x0 = sampleBounds.pMin.x + tile.x * tileSize;
       int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
@@ -31,45 +47,46 @@ void SamplerIntegrator::Render(const Scene& scene) {
       std::unique_ptr<FilmTile> filmTile = 
         camera->film->GetFilmTile(tileBounds);
 
-      // Loop over pixels in tile to render them
-      for (Point2i pixel : tileBounds) {
-        tileSampler->StartPixel(pixel);
-        do {
-          // Initialize CameraSample for current sample
-          CameraSample cameraSample = tileSampler->GetCameraSample(pixel);
-          
-          // Generate camera ray for current sample
-          RayDifferential ray;
-          Float rayWeight = camera->GenerateRayDifferential(cameraSample, &ray);
-          ray.ScaleDifferentials(1 / std::sqrt(tileSampler->samplesPerPixel));
-
-          // Evaluate radiance along camera ray
-          Spectrum L(0.f);
-          if (rayWeight > 0)
-            L = Li(ray, scene, *tileSampler, arena);
-          if (L.HasNaNs()) {
-            Error("Not-a-number radiance value returned "
-              "for image sample.  Setting to black.");
-            L = Spectrum(0.f);
-          }
-          else if (L.y() < -1e-5) {
-            Error("Negative luminance value, %f, returned "
-              "for image sample.  Setting to black.", L.y());
-            L = Spectrum(0.f);
-          }
-          else if (std::isinf(L.y())) {
-            Error("Infinite luminance value returned "
-              "for image sample.  Setting to black.");
-            L = Spectrum(0.f);
+      // Get sampler instance for tile
+      int seed = tile.y * nTiles.x + tile.x;
+      std::unique_ptr<Sampler> tileSampler = sampler->Clone(seed);
+
+      if (packetSize > 0) {
+        // Trace camera rays in coherent packets
+        for (int py = y0; py < y1; py += packetSize)
+          for (int px = x0; px < x1; px += packetSize) {
+            Bounds2i packetBounds(Point2i(px, py),
+              Point2i(std::min(px + packetSize, x1), std::min(py + packetSize, y1)));
+            RenderPacket(scene, packetBounds, *tileSampler, *filmTile, arena);
           }
+      }
+      else {
+        // Loop over pixels in tile to render them
+        for (Point2i pixel : tileBounds) {
+          tileSampler->StartPixel(pixel);
+          do {
+            // Initialize CameraSample for current sample
+            CameraSample cameraSample = tileSampler->GetCameraSample(pixel);
+
+            // Generate camera ray for current sample
+            RayDifferential ray;
+            Float rayWeight = camera->GenerateRayDifferential(cameraSample, &ray);
+            ray.ScaleDifferentials(1 / std::sqrt(tileSampler->samplesPerPixel));
 
-          // Add camera's ray contribution to image
-          filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
+            // Evaluate radiance along camera ray
+            Spectrum L(0.f);
+            if (rayWeight > 0)
+              L = Li(ray, scene, *tileSampler, arena);
+            L = CheckRadiance(L);
 
-          // Free MemoryArena memory from computing image sample value
-          arena.Reset();
+            // Add camera's ray contribution to image
+            filmTile->AddSample(cameraSample.pFilm, L, rayWeight);
 
-        } while (tileSampler->StartNextSample());
+            // Free MemoryArena memory from computing image sample value
+            arena.Reset();
+
+          } while (tileSampler->StartNextSample());
+        }
       }
 
     }, nTiles);
@@ -77,6 +94,92 @@ void SamplerIntegrator::Render(const Scene& scene) {
   camera->film->WriteImage();
 }
 
+void SamplerIntegrator::RenderPacket(const Scene& scene,
+  const Bounds2i& packetBounds, Sampler& tileSampler, FilmTile& filmTile,
+  MemoryArena& arena) const
+{
+  // The packet's pixels share the tile's sampler. Their camera rays are
+  // generated pixel by pixel for a batch of sample numbers and traced
+  // together; each pixel is then started again at the batch's first
+  // sample to shade its rays, so that the sampler's remaining dimensions
+  // are consumed in order. Global samplers give the same camera samples
+  // again; pixel samplers draw fresh, equally distributed ones, of which
+  // only the dimensions after the camera sample are used.
+  const int MaxPacketRays = 4096;
+  int nPixels = packetBounds.Area();
+  int64_t spp = tileSampler.samplesPerPixel;
+  int64_t batchSamples =
+    std::min<int64_t>(spp, std::max(1, MaxPacketRays / nPixels));
+  int maxRays = nPixels * batchSamples;
+  std::vector<CameraSample> cameraSamples(maxRays);
+  std::vector<RayDifferential> rays(maxRays);
+  std::vector<Float> rayWeights(maxRays), rayTMax(maxRays);
+  std::vector<Ray*> packet;
+  std::unique_ptr<SurfaceInteraction[]> isects(new SurfaceInteraction[maxRays]);
+  std::unique_ptr<bool[]> hits(new bool[maxRays]);
+  for (int64_t s0 = 0; s0 < spp; s0 += batchSamples) {
+    int64_t nSamples = std::min(batchSamples, spp - s0);
+
+    // Generate camera rays for the batch's samples of every pixel
+    packet.clear();
+    int r = 0;
+    for (Point2i pixel : packetBounds) {
+      tileSampler.StartPixel(pixel);
+      tileSampler.SetSampleNumber(s0);
+      for (int64_t s = 0; s < nSamples; ++s, ++r) {
+        cameraSamples[r] = tileSampler.GetCameraSample(pixel);
+        rayWeights[r] =
+          camera->GenerateRayDifferential(cameraSamples[r], &rays[r]);
+        rays[r].ScaleDifferentials(1 / std::sqrt(spp));
+        rayTMax[r] = rays[r].tMax;
+        if (rayWeights[r] > 0) packet.push_back(&rays[r]);
+        tileSampler.StartNextSample();
+      }
+    }
+
+    // Find the closest intersections of the packet's rays
+    scene.IntersectPacket(packet.data(), packet.size(), isects.get(), hits.get());
+
+    // Shade the intersections and add their contributions to the image
+    r = 0;
+    int k = 0;
+    for (Point2i pixel : packetBounds) {
+      tileSampler.StartPixel(pixel);
+      tileSampler.SetSampleNumber(s0);
+      for (int64_t s = 0; s < nSamples; ++s, ++r) {
+        // Consume the camera sample's dimensions
+        tileSampler.GetCameraSample(pixel);
+        Spectrum L(0.f);
+        if (rayWeights[r] > 0) {
+          rays[r].tMax = rayTMax[r];
+          L = LiFromIntersection(rays[r], hits[k], isects[k], scene,
+            tileSampler, arena);
+          ++k;
+        }
+        filmTile.AddSample(cameraSamples[r].pFilm, CheckRadiance(L),
+          rayWeights[r]);
+        arena.Reset();
+        tileSampler.StartNextSample();
+      }
+    }
+  }
+}
+
+Spectrum SamplerIntegrator::LiFromIntersection(const RayDifferential& ray,
+  bool foundIntersection, SurfaceInteraction& isect, const Scene& scene,
+  Sampler& sampler, MemoryArena& arena, int depth) const
+{
+  return Li(ray, scene, sampler, arena, depth);
+}
+
+void SamplerIntegrator::SetPacketSize(int size) {
+  if (size != 0 && size != 8 && size != 16) {
+    Warning("Camera ray packet size %d must be 8 or 16. Using 8.", size);
+    size = 8;
+  }
+  packetSize = size;
+}
+
 Spectrum SamplerIntegrator::SpecularReflect(const RayDifferential& ray,
   const SurfaceInteraction& isect, const Scene& scene,
   Sampler& sampler, MemoryArena& arena, int depth) const 
@@ -18,6 +18,15 @@ public:
   void Render(const Scene& scene);
   virtual Spectrum Li(const RayDifferential& ray, const Scene& scene,
     Sampler& sampler, MemoryArena& arena, int depth = 0) const = 0;
+  // Radiance along a ray whose closest intersection has already been found;
+  // the default ignores _isect_ and traces the ray again
+  virtual Spectrum LiFromIntersection(const RayDifferential& ray,
+    bool foundIntersection, SurfaceInteraction& isect, const Scene& scene,
+    Sampler& sampler, MemoryArena& arena, int depth = 0) const;
+  // Returns true if _LiFromIntersection()_ uses the intersection it's given,
+  // so that tracing camera rays in packets doesn't trace them twice
+  virtual bool ShadesFoundIntersections() const { return false; }
+  void SetPacketSize(int size);
   Spectrum SpecularReflect(const RayDifferential& ray,
     const SurfaceInteraction& isect, const Scene& scene, Sampler& sampler,
     MemoryArena& arena, int depth) const;
@@ -30,6 +39,13 @@ protected:
   std::shared_ptr<const Camera> camera;
 
 private:
+  // Private methods
+  void RenderPacket(const Scene& scene, const Bounds2i& packetBounds,
+    Sampler& tileSampler, FilmTile& filmTile, MemoryArena& arena) const;
+
   // Private Data
   std::shared_ptr<Sampler> sampler;
+  int packetSize = 0;
 };
+
+Spectrum CheckRadiance(const Spectrum& L);
@@ -0,0 +1,59 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// core/nestedparallel.cpp*
+#include "nestedparallel.h"
+#include "parallel.h"
+
+namespace pbrt {
+
+  // NestedParallel Local Definitions
+  static PBRT_THREAD_LOCAL bool inParallelLoop = false;
+
+  // NestedParallel Function Definitions
+  void NestableParallelFor(const std::function<void(int64_t)>& func,
+    int64_t count, int chunkSize) {
+    // A loop with fewer chunks than threads can't keep them busy, so its
+    // iterations run in turn and any loops they start are parallel instead
+    int64_t nChunks = (count + chunkSize - 1) / chunkSize;
+    if (inParallelLoop || nChunks < MaxThreadIndex()) {
+      for (int64_t i = 0; i < count; ++i) func(i);
+      return;
+    }
+    ParallelFor([&](int64_t i) {
+      inParallelLoop = true;
+      func(i);
+      inParallelLoop = false;
+    }, count, chunkSize);
+  }
+
+}  // namespace pbrt
@@ -0,0 +1,63 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_NESTEDPARALLEL_H
+#define PBRT_CORE_NESTEDPARALLEL_H
+
+// core/nestedparallel.h*
+#include "pbrt.h"
+#include <functional>
+
+namespace pbrt {
+
+  // NestedParallel Declarations
+
+  // Runs _func_ for $[0, count)$ with _ParallelFor()_, or serially when
+  // called from an iteration of another _NestableParallelFor()_ loop on any
+  // thread, including the one that started it, since _ParallelFor()_
+  // calls can't be nested. Loops with fewer chunks than there are threads
+  // also run serially, so that the loops started by their iterations (say,
+  // decoding the one large mesh of a scene) get the threads instead. Loops
+  // whose iterations may start parallel loops of their own (scene loading,
+  // acceleration structure builds) go through this function at every
+  // level.
+  void NestableParallelFor(const std::function<void(int64_t)>& func,
+    int64_t count, int chunkSize = 1);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_NESTEDPARALLEL_H
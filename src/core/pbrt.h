@@ -108,6 +108,7 @@ namespace pbrt {
   class Normal3;
   class Ray;
   class RayDifferential;
+  class RayQuery;
   template <typename T>
   class Bounds2;
   template <typename T>
@@ -179,7 +180,10 @@ namespace pbrt {
     bool quickRender = false;
     bool quiet = false;
     bool cat = false, toPly = false;
+    std::string toBinary;
     std::string imageFile;
+    std::string bvhCacheDir;
+    int meshCacheMB = 0;
     // x0, x1, y0, y1
     Float cropWindow[2][2];
   };
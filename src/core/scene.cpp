@@ -1,5 +1,12 @@
 // Scene
 
+#include "accelerators/widebvh.h"
+#include "stats.h"
+
+STAT_PERCENT("Intersections/Occluder cache hits", nOccluderCacheHits, nOccluderCacheTests);
+
+const int Scene::MaxShadowRayBatch;
+
 // Public method implementations
 
 bool Scene::Intersect(const Ray& ray, SurfaceInteraction* isect) const {
@@ -10,6 +17,75 @@ bool Scene::IntersectP(const Ray& ray) const {
   return aggregate->IntersectP(ray);
 }
 
+bool Scene::IntersectP(const Ray& ray, int lightIndex) const {
+  // Neighboring shadow rays are often blocked by the same primitive, so
+  // test the last occluder toward this light first
+  const Primitive*& lastOccluder = lastOccluders[ThreadIndex][lightIndex];
+  if (lastOccluder) {
+    ++nOccluderCacheTests;
+    if (lastOccluder->IntersectP(ray)) {
+      ++nOccluderCacheHits;
+      return true;
+    }
+  }
+  if (const WideBVHAccel* wide = dynamic_cast<const WideBVHAccel*>(aggregate.get()))
+    return wide->IntersectP(ray, &lastOccluder);
+  return aggregate->IntersectP(ray);
+}
+
+bool Scene::Unoccluded(const VisibilityTester& visibility, int lightIndex) const {
+  return !IntersectP(visibility.P0().SpawnRayTo(visibility.P1()), lightIndex);
+}
+
+uint64_t Scene::Unoccluded(const Ray* rays, const int* lightIndices, int nRays) const {
+  CHECK_LE(nRays, MaxShadowRayBatch);
+  // Test each ray's last occluder, then trace the remaining rays as a batch
+  std::vector<const Primitive*>& threadOccluders = lastOccluders[ThreadIndex];
+  Ray remaining[MaxShadowRayBatch];
+  int remainingIndex[MaxShadowRayBatch];
+  int nRemaining = 0;
+  for (int i = 0; i < nRays; ++i) {
+    const Primitive* lastOccluder = threadOccluders[lightIndices[i]];
+    if (lastOccluder) {
+      ++nOccluderCacheTests;
+      if (lastOccluder->IntersectP(rays[i])) {
+        ++nOccluderCacheHits;
+        continue;
+      }
+    }
+    remaining[nRemaining] = rays[i];
+    remainingIndex[nRemaining++] = i;
+  }
+  const Primitive* occluders[MaxShadowRayBatch] = {};
+  uint64_t occluded = 0;
+  if (const WideBVHAccel* wide = dynamic_cast<const WideBVHAccel*>(aggregate.get()))
+    occluded = wide->IntersectPPacket(remaining, nRemaining, occluders);
+  else
+    for (int j = 0; j < nRemaining; ++j)
+      if (aggregate->IntersectP(remaining[j])) occluded |= uint64_t(1) << j;
+
+  // Record new occluders and collect the unoccluded rays
+  uint64_t unoccluded = 0;
+  for (int j = 0; j < nRemaining; ++j) {
+    int i = remainingIndex[j];
+    if (!(occluded & (uint64_t(1) << j)))
+      unoccluded |= uint64_t(1) << i;
+    else if (occluders[j])
+      threadOccluders[lightIndices[i]] = occluders[j];
+  }
+  return unoccluded;
+}
+
+void Scene::IntersectPacket(Ray* const* rays, int nRays, SurfaceInteraction* isects, bool* hits) const {
+  // Trace coherent packets through aggregates that support them
+  if (const WideBVHAccel* wide = dynamic_cast<const WideBVHAccel*>(aggregate.get())) {
+    wide->IntersectPacket(rays, nRays, isects, hits);
+    return;
+  }
+  for (int i = 0; i < nRays; ++i)
+    hits[i] = aggregate->Intersect(*rays[i], &isects[i]);
+}
+
 bool Scene::IntersectTr(Ray ray, Sampler& sampler, SurfaceInteraction* isect, Spectrum* transmittance) const {
   return false;
 }
\ No newline at end of file
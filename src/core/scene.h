@@ -5,7 +5,8 @@
 class Scene {
 public:
   // Constructor
-  Scene(std::shared_ptr<Primitive> aggregate, const std::vector<std::shared_ptr<Light>>& lights) : lights(lights), aggregate(aggregate) {
+  Scene(std::shared_ptr<Primitive> aggregate, const std::vector<std::shared_ptr<Light>>& lights) : lights(lights), aggregate(aggregate),
+    lastOccluders(MaxThreadIndex(), std::vector<const Primitive*>(lights.size(), nullptr)) {
     worldBound = aggregate->WorldBound();
     for (const auto& light : lights)
       light->Preprocess(*this);
@@ -15,12 +16,19 @@ public:
   const Bounds3f& WorldBound() const { return worldBound; }
   bool Intersect(const Ray& ray, SurfaceInteraction* isect) const;
   bool IntersectP(const Ray& ray) const;
+  bool IntersectP(const Ray& ray, int lightIndex) const;
+  bool Unoccluded(const VisibilityTester& visibility, int lightIndex) const;
+  uint64_t Unoccluded(const Ray* rays, const int* lightIndices, int nRays) const;
+  void IntersectPacket(Ray* const* rays, int nRays, SurfaceInteraction* isects, bool* hits) const;
   bool IntersectTr(Ray ray, Sampler& sampler, SurfaceInteraction* isect, Spectrum* transmittance) const;
 
   // Public Data
+  static const int MaxShadowRayBatch = 64;
   std::vector<std::shared_ptr<Light>> lights;
 
 private:
   std::shared_ptr<Primitive> aggregate;
   Bounds3f worldBound;
+  // Primitive that last blocked a shadow ray, per thread and light
+  mutable std::vector<std::vector<const Primitive*>> lastOccluders;
 };
\ No newline at end of file
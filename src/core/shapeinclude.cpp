@@ -0,0 +1,522 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// core/shapeinclude.cpp*
+#include "shapeinclude.h"
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace pbrt {
+
+  // ShapeInclude Local Definitions
+  struct IncludeToken {
+    bool Is(const char* s) const {
+      return length == strlen(s) && strncmp(start, s, length) == 0;
+    }
+    bool IsString() const { return length > 0 && start[0] == '"'; }
+    std::string String() const;
+
+    const char* start = nullptr;
+    size_t length = 0;
+  };
+
+  std::string IncludeToken::String() const {
+    // Remove the quotes and resolve escape sequences
+    std::string s;
+    const char* end = start + length - (length > 1 && start[length - 1] == '"');
+    for (const char* p = start + 1; p < end; ++p) {
+      if (*p == '\\' && p + 1 < end) {
+        switch (*++p) {
+        case 'n': s += '\n'; break;
+        case 't': s += '\t'; break;
+        default: s += *p;
+        }
+      }
+      else
+        s += *p;
+    }
+    return s;
+  }
+
+  static bool IsDelimiter(char c) {
+    return isspace((unsigned char)c) || c == '"' || c == '[' || c == ']' ||
+      c == '#';
+  }
+
+  // Parses the decimal number in [_p_, _end_), returning the end of the
+  // number, or _nullptr_ if there isn't one. If the digits form an integer
+  // no larger than $2^{53}$ and the power of ten is at most 22 in magnitude,
+  // both are exactly representable as doubles and a single division or
+  // multiplication rounds correctly, so such numbers are converted without
+  // calling strtod(); this covers nearly all values written by exporters.
+  // (The digit count only guards the accumulation against overflow.)
+  static const char* ParseNumber(const char* p, const char* end, double* v) {
+    static const double powers[] = {
+      1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+    const char* start = p;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+    uint64_t mantissa = 0;
+    int nDigits = 0, nSignificant = 0, exponent = 0;
+    for (; p < end && isdigit((unsigned char)*p); ++p, ++nDigits) {
+      mantissa = 10 * mantissa + (*p - '0');
+      if (mantissa > 0) ++nSignificant;
+    }
+    if (p < end && *p == '.')
+      for (++p; p < end && isdigit((unsigned char)*p); ++p, ++nDigits) {
+        mantissa = 10 * mantissa + (*p - '0');
+        if (mantissa > 0) ++nSignificant;
+        --exponent;
+      }
+    if (nDigits == 0) return nullptr;
+    if (p < end && (*p == 'e' || *p == 'E')) {
+      ++p;
+      bool negativeExponent = false;
+      if (p < end && (*p == '-' || *p == '+')) negativeExponent = *p++ == '-';
+      if (p == end || !isdigit((unsigned char)*p)) return nullptr;
+      int e = 0;
+      for (; p < end && isdigit((unsigned char)*p); ++p)
+        e = std::min(10 * e + (*p - '0'), 100000);
+      exponent += negativeExponent ? -e : e;
+    }
+
+    if (nSignificant <= 19 && mantissa <= (1ull << 53) && exponent >= -22 &&
+      exponent <= 22) {
+      double d = (double)mantissa;
+      d = exponent < 0 ? d / powers[-exponent] : d * powers[exponent];
+      *v = negative ? -d : d;
+    }
+    else {
+      // The file's text is null-terminated, so strtod() can't run past it
+      char* numEnd;
+      *v = strtod(start, &numEnd);
+      if (numEnd != p) return nullptr;
+    }
+    return p;
+  }
+
+  static bool ParseFloat(const IncludeToken& token, Float* v) {
+    double d;
+    const char* end = token.start + token.length;
+    if (ParseNumber(token.start, end, &d) != end) return false;
+    *v = (Float)d;
+    return true;
+  }
+
+  class IncludeTokenizer {
+  public:
+    IncludeTokenizer(const std::string& text)
+      : ptr(text.data()), end(text.data() + text.size()) {}
+    bool Next(IncludeToken* token);
+    bool Peek(IncludeToken* token) {
+      const char* saved = ptr;
+      bool found = Next(token);
+      ptr = saved;
+      return found;
+    }
+    int CountValues() const;
+    bool ReadFloats(Float* v, int n);
+    bool ReadInts(int* v, int n);
+
+  private:
+    void skipSpace();
+
+    const char* ptr;
+    const char* end;
+  };
+
+  void IncludeTokenizer::skipSpace() {
+    // Skip whitespace and comments
+    while (ptr < end) {
+      if (*ptr == '#')
+        while (ptr < end && *ptr != '\n' && *ptr != '\r') ++ptr;
+      else if (isspace((unsigned char)*ptr))
+        ++ptr;
+      else
+        break;
+    }
+  }
+
+  bool IncludeTokenizer::Next(IncludeToken* token) {
+    skipSpace();
+    if (ptr == end) return false;
+
+    token->start = ptr;
+    if (*ptr == '"') {
+      for (++ptr; ptr < end && *ptr != '"'; ++ptr)
+        if (*ptr == '\\' && ptr + 1 < end) ++ptr;
+      if (ptr < end) ++ptr;
+    }
+    else if (*ptr == '[' || *ptr == ']')
+      ++ptr;
+    else
+      while (ptr < end && !IsDelimiter(*ptr)) ++ptr;
+    token->length = ptr - token->start;
+    return true;
+  }
+
+  // Returns the number of values before the bracket that closes the
+  // current list, so that their storage can be allocated up front
+  int IncludeTokenizer::CountValues() const {
+    IncludeTokenizer scan(*this);
+    IncludeToken token;
+    int n = 0;
+    while (scan.Next(&token) && !token.Is("]")) ++n;
+    return n;
+  }
+
+  // Parses the next _n_ values as numbers, straight from the text
+  bool IncludeTokenizer::ReadFloats(Float* v, int n) {
+    for (int i = 0; i < n; ++i) {
+      skipSpace();
+      double d;
+      const char* numEnd = ParseNumber(ptr, end, &d);
+      if (!numEnd || (numEnd < end && !IsDelimiter(*numEnd))) return false;
+      v[i] = (Float)d;
+      ptr = numEnd;
+    }
+    return true;
+  }
+
+  bool IncludeTokenizer::ReadInts(int* v, int n) {
+    for (int i = 0; i < n; ++i) {
+      skipSpace();
+      const char* p = ptr;
+      bool negative = false;
+      if (p < end && (*p == '-' || *p == '+')) negative = *p++ == '-';
+      int64_t value = 0;
+      const char* digits = p;
+      for (; p < end && isdigit((unsigned char)*p) && value <= INT_MAX; ++p)
+        value = 10 * value + (*p - '0');
+      if (p == digits || value > INT_MAX || (p < end && !IsDelimiter(*p)))
+        return false;
+      v[i] = (int)(negative ? -value : value);
+      ptr = p;
+    }
+    return true;
+  }
+
+  static bool ReadIncludeFile(const std::string& filename, std::string* text) {
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in) return false;
+    text->resize(in.tellg());
+    in.seekg(0);
+    return (bool)in.read(&(*text)[0], text->size());
+  }
+
+  // Returns the number of _Float_s in each value of a parameter of the given
+  // type, or zero if its values aren't numbers
+  static int NumericTupleSize(const std::string& type) {
+    if (type == "integer" || type == "float" || type == "rgb" ||
+      type == "color" || type == "xyz" || type == "blackbody" ||
+      type == "spectrum")
+      return 1;
+    if (type == "point2" || type == "vector2") return 2;
+    if (type == "point3" || type == "point" || type == "vector3" ||
+      type == "vector" || type == "normal3" || type == "normal")
+      return 3;
+    return 0;
+  }
+
+  // Parses the _n_ numeric values of a parameter directly into the array
+  // that the _ParamSet_ takes ownership of
+  static bool AddNumericParam(const std::string& filename,
+    IncludeTokenizer& tokenizer,
+    const std::string& type, const std::string& name,
+    int n, ParamSet* params) {
+    if (type == "integer") {
+      std::unique_ptr<int[]> v(new int[n]);
+      if (!tokenizer.ReadInts(v.get(), n)) return false;
+      params->AddInt(name, std::move(v), n);
+      return true;
+    }
+
+    // Tuples are read as consecutive _Float_s into their final storage
+    static_assert(sizeof(Point2f) == 2 * sizeof(Float) &&
+      sizeof(Point3f) == 3 * sizeof(Float) &&
+      sizeof(Normal3f) == 3 * sizeof(Float),
+      "Tuples must be laid out as consecutive Floats");
+    int size = NumericTupleSize(type), nt = n / size;
+    auto read = [&](Float* v) {
+      if (!tokenizer.ReadFloats(v, nt * size)) return false;
+      if (n % size == 0) return true;
+      Error("%s: excess values given with parameter \"%s %s\"; ignoring them",
+        filename.c_str(), type.c_str(), name.c_str());
+      Float excess[3];
+      return tokenizer.ReadFloats(excess, n % size);
+    };
+    if (size == 1) {
+      std::unique_ptr<Float[]> v(new Float[n]);
+      if (!read(v.get())) return false;
+      if (type == "float")
+        params->AddFloat(name, std::move(v), n);
+      else if (type == "xyz")
+        params->AddXYZSpectrum(name, std::move(v), n);
+      else if (type == "blackbody")
+        params->AddBlackbodySpectrum(name, std::move(v), n);
+      else if (type == "spectrum")
+        params->AddSampledSpectrum(name, std::move(v), n);
+      else
+        params->AddRGBSpectrum(name, std::move(v), n);
+    }
+    else if (type == "point2") {
+      std::unique_ptr<Point2f[]> v(new Point2f[nt]);
+      if (!read(&v[0].x)) return false;
+      params->AddPoint2f(name, std::move(v), nt);
+    }
+    else if (type == "vector2") {
+      std::unique_ptr<Vector2f[]> v(new Vector2f[nt]);
+      if (!read(&v[0].x)) return false;
+      params->AddVector2f(name, std::move(v), nt);
+    }
+    else if (type == "point3" || type == "point") {
+      std::unique_ptr<Point3f[]> v(new Point3f[nt]);
+      if (!read(&v[0].x)) return false;
+      params->AddPoint3f(name, std::move(v), nt);
+    }
+    else if (type == "vector3" || type == "vector") {
+      std::unique_ptr<Vector3f[]> v(new Vector3f[nt]);
+      if (!read(&v[0].x)) return false;
+      params->AddVector3f(name, std::move(v), nt);
+    }
+    else {
+      std::unique_ptr<Normal3f[]> v(new Normal3f[nt]);
+      if (!read(&v[0].x)) return false;
+      params->AddNormal3f(name, std::move(v), nt);
+    }
+    return true;
+  }
+
+  // Adds a parameter whose values are strings to _params_, reporting an
+  // error and skipping it if they are malformed
+  static void AddIncludeParam(const std::string& filename,
+    const std::string& type, const std::string& name,
+    const std::vector<IncludeToken>& values,
+    ParamSet* params) {
+    int n = values.size();
+    bool strings = n > 0 && std::all_of(values.begin(), values.end(),
+      [](const IncludeToken& v) { return v.IsString(); });
+    if (type == "spectrum" && strings) {
+      std::vector<std::string> files;
+      for (const IncludeToken& v : values) files.push_back(v.String());
+      std::vector<const char*> names;
+      for (const std::string& f : files) names.push_back(f.c_str());
+      params->AddSampledSpectrumFiles(name, names.data(), n);
+    }
+    else if (type == "bool" && n > 0) {
+      std::unique_ptr<bool[]> b(new bool[n]);
+      for (int i = 0; i < n; ++i) {
+        std::string v =
+          values[i].IsString() ? values[i].String()
+          : std::string(values[i].start, values[i].length);
+        if (v != "true" && v != "false") {
+          Error("%s: value \"%s\" unknown for bool parameter \"%s\"",
+            filename.c_str(), v.c_str(), name.c_str());
+          return;
+        }
+        b[i] = v == "true";
+      }
+      params->AddBool(name, std::move(b), n);
+    }
+    else if ((type == "string" || type == "texture") && strings) {
+      std::unique_ptr<std::string[]> s(new std::string[n]);
+      for (int i = 0; i < n; ++i) s[i] = values[i].String();
+      if (type == "texture")
+        params->AddTexture(name, s[0]);
+      else
+        params->AddString(name, std::move(s), n);
+    }
+    else
+      Error("%s: unable to add parameter \"%s %s\"", filename.c_str(),
+        type.c_str(), name.c_str());
+  }
+
+  static bool ParseIncludeParams(const std::string& filename,
+    IncludeTokenizer& tokenizer, ParamSet* params) {
+    IncludeToken decl;
+    while (tokenizer.Peek(&decl) && decl.IsString()) {
+      tokenizer.Next(&decl);
+      std::istringstream declaration(decl.String());
+      std::string type, name;
+      if (!(declaration >> type >> name)) {
+        Error("%s: bad parameter declaration \"%s\"", filename.c_str(),
+          decl.String().c_str());
+        return false;
+      }
+
+      // Parameter values are either bracketed or a single one
+      IncludeToken value;
+      if (!tokenizer.Peek(&value)) {
+        Error("%s: premature end of file", filename.c_str());
+        return false;
+      }
+      bool bracketed = value.Is("[");
+      if (bracketed) tokenizer.Next(&value);
+      if (NumericTupleSize(type) > 0 && tokenizer.Peek(&value) &&
+        !value.IsString() && !value.Is("]")) {
+        int n = bracketed ? tokenizer.CountValues() : 1;
+        if (!AddNumericParam(filename, tokenizer, type, name, n, params)) {
+          Error("%s: expected numeric values for parameter \"%s %s\"",
+            filename.c_str(), type.c_str(), name.c_str());
+          return false;
+        }
+      }
+      else {
+        std::vector<IncludeToken> values;
+        if (!bracketed)
+          tokenizer.Next(&value), values.push_back(value);
+        else
+          while (tokenizer.Peek(&value) && !value.Is("]")) {
+            tokenizer.Next(&value);
+            values.push_back(value);
+          }
+        AddIncludeParam(filename, type, name, values, params);
+      }
+      if (bracketed && !(tokenizer.Next(&value) && value.Is("]"))) {
+        Error("%s: unterminated value list", filename.c_str());
+        return false;
+      }
+    }
+    return true;
+  }
+
+
+  // ShapeInclude Function Definitions
+  bool ParseShapeInclude(const std::string& filename, ShapeIncludeFile* file) {
+    std::string text;
+    if (!ReadIncludeFile(filename, &text)) return false;
+    // FNV-1a over the file's bytes
+    uint64_t hash = 14695981039346656037ull;
+    for (char c : text) {
+      hash ^= (uint8_t)c;
+      hash *= 1099511628211ull;
+    }
+    file->contentHash = hash;
+    IncludeTokenizer tokenizer(text);
+
+    // Reads _n_ numbers, optionally enclosed in brackets
+    auto readFloats = [&](Float* v, int n, const IncludeToken& directive) {
+      IncludeToken token;
+      bool bracketed = tokenizer.Peek(&token) && token.Is("[");
+      if (bracketed) tokenizer.Next(&token);
+      for (int i = 0; i < n; ++i)
+        if (!tokenizer.Next(&token) || !ParseFloat(token, &v[i])) {
+          Error("%s: expected %d numbers after \"%s\"", filename.c_str(), n,
+            std::string(directive.start, directive.length).c_str());
+          return false;
+        }
+      return !bracketed || (tokenizer.Next(&token) && token.Is("]"));
+    };
+
+    struct IncludeState {
+      Transform objectToInclude;
+      bool reverseOrientation = false;
+    };
+    IncludeState state;
+    std::vector<IncludeState> pushedStates;
+    std::vector<bool> pushedAttributes;  // true for attribute blocks
+    IncludeToken token;
+    while (tokenizer.Next(&token)) {
+      Float v[16];
+      if (token.Is("Shape")) {
+        IncludedShape shape;
+        if (!tokenizer.Next(&token) || !token.IsString()) {
+          Error("%s: expected shape name after \"Shape\"", filename.c_str());
+          return false;
+        }
+        shape.name = token.String();
+        if (!ParseIncludeParams(filename, tokenizer, &shape.params))
+          return false;
+        shape.objectToInclude = state.objectToInclude;
+        shape.reverseOrientation = state.reverseOrientation;
+        file->shapes.push_back(std::move(shape));
+      }
+      else if (token.Is("AttributeBegin") || token.Is("TransformBegin")) {
+        pushedStates.push_back(state);
+        pushedAttributes.push_back(token.Is("AttributeBegin"));
+      }
+      else if (token.Is("AttributeEnd") || token.Is("TransformEnd")) {
+        // Ending a block opened by the includer changes its state, and
+        // mismatched blocks are left to the full parser to report
+        bool attribute = token.Is("AttributeEnd");
+        if (pushedStates.empty() || pushedAttributes.back() != attribute)
+          return false;
+        if (attribute)
+          state = pushedStates.back();
+        else
+          state.objectToInclude = pushedStates.back().objectToInclude;
+        pushedStates.pop_back();
+        pushedAttributes.pop_back();
+      }
+      else if (token.Is("Translate")) {
+        if (!readFloats(v, 3, token)) return false;
+        state.objectToInclude =
+          state.objectToInclude * Translate(Vector3f(v[0], v[1], v[2]));
+      }
+      else if (token.Is("Rotate")) {
+        if (!readFloats(v, 4, token)) return false;
+        state.objectToInclude =
+          state.objectToInclude * Rotate(v[0], Vector3f(v[1], v[2], v[3]));
+      }
+      else if (token.Is("Scale")) {
+        if (!readFloats(v, 3, token)) return false;
+        state.objectToInclude =
+          state.objectToInclude * Scale(v[0], v[1], v[2]);
+      }
+      else if (token.Is("ConcatTransform")) {
+        if (!readFloats(v, 16, token)) return false;
+        state.objectToInclude =
+          state.objectToInclude *
+          Transform(Matrix4x4(v[0], v[4], v[8], v[12], v[1], v[5], v[9],
+            v[13], v[2], v[6], v[10], v[14], v[3], v[7],
+            v[11], v[15]));
+      }
+      else if (token.Is("ReverseOrientation"))
+        state.reverseOrientation = !state.reverseOrientation;
+      else
+        // Any other statement needs the full parser
+        return false;
+    }
+    // Blocks left open would change the includer's state
+    if (!pushedStates.empty()) return false;
+    file->trailingTransform = state.objectToInclude;
+    file->trailingReverseOrientation = state.reverseOrientation;
+    return true;
+  }
+
+}  // namespace pbrt
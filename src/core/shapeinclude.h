@@ -0,0 +1,83 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_CORE_SHAPEINCLUDE_H
+#define PBRT_CORE_SHAPEINCLUDE_H
+
+// core/shapeinclude.h*
+#include "pbrt.h"
+#include "paramset.h"
+#include "transform.h"
+
+namespace pbrt {
+
+  // ShapeInclude Declarations
+
+  // A _Shape_ statement read from a shape-only include file, along with the
+  // transformation and orientation set by the file's own statements.
+  // _objectToInclude_ maps the shape into the space that was current at the
+  // _Include_ statement.
+  struct IncludedShape {
+    std::string name;
+    ParamSet params;
+    Transform objectToInclude;
+    bool reverseOrientation = false;
+  };
+
+  // The contents of a shape-only include file: its shapes, and the
+  // transformation and orientation left in effect by its top-level
+  // statements, which carry over to the statements after the _Include_.
+  struct ShapeIncludeFile {
+    std::vector<IncludedShape> shapes;
+    Transform trailingTransform;
+    bool trailingReverseOrientation = false;
+    // Hash of the file's contents
+    uint64_t contentHash = 0;
+  };
+
+  // Parses _filename_ if it only contains shapes and the statements that
+  // transform them (relative transformations, _ReverseOrientation_ and
+  // balanced attribute and transform blocks), so that it can be parsed
+  // independently of the rest of the scene. Returns false without
+  // reporting an error for files that can't be read or hold anything else,
+  // which the caller then hands to the full parser. Safe to call from
+  // worker threads.
+  bool ParseShapeInclude(const std::string& filename, ShapeIncludeFile* file);
+
+}  // namespace pbrt
+
+#endif  // PBRT_CORE_SHAPEINCLUDE_H
@@ -425,7 +425,10 @@ namespace pbrt {
       return startTransform->HasScale() || endTransform->HasScale();
     }
     Bounds3f MotionBounds(const Bounds3f& b) const;
+    Bounds3f MotionBounds(const Bounds3f& b, Float time0, Float time1) const;
     Bounds3f BoundPointMotion(const Point3f& p) const;
+    Bounds3f BoundPointMotion(const Point3f& p, Float time0,
+      Float time1) const;
 
   private:
     // AnimatedTransform Private Data
@@ -0,0 +1,330 @@
+#include "wavefront.h"
+
+#include <algorithm>
+
+// Local declarations
+
+// Rays and per-path state of the paths that are still alive
+struct PathQueue {
+  void Clear() {
+    ray.clear();
+    pixel.clear();
+    beta.clear();
+    bounces.clear();
+    specularBounce.clear();
+  }
+  void Push(const RayDifferential& r, int p, const Spectrum& b, int depth,
+    bool specular) {
+    ray.push_back(r);
+    pixel.push_back(p);
+    beta.push_back(b);
+    bounces.push_back(depth);
+    specularBounce.push_back(specular);
+  }
+  int Size() const { return (int)ray.size(); }
+
+  std::vector<RayDifferential> ray;
+  std::vector<int> pixel;
+  std::vector<Spectrum> beta;
+  std::vector<int> bounces;
+  std::vector<bool> specularBounce;
+};
+
+// Shadow rays and the radiance they carry if unoccluded
+struct ShadowQueue {
+  void Clear() {
+    ray.clear();
+    pixel.clear();
+    light.clear();
+    Ld.clear();
+  }
+  void Push(const Ray& r, int p, int l, const Spectrum& L) {
+    ray.push_back(r);
+    pixel.push_back(p);
+    light.push_back(l);
+    Ld.push_back(L);
+  }
+  int Size() const { return (int)ray.size(); }
+
+  std::vector<Ray> ray;
+  std::vector<int> pixel;
+  std::vector<int> light;
+  std::vector<Spectrum> Ld;
+};
+
+// Key that orders rays along a Morton curve through the quantized
+// coordinates of their origins within _bounds_ and of their octahedrally
+// mapped directions, so that rays that start close together and head the
+// same way end up next to each other
+static uint64_t RaySortKey(const Ray& ray, const Bounds3f& bounds) {
+  const int bits = 10;
+  const Float scale = (1 << bits) - 1;
+  uint32_t q[5];
+  Vector3f o = bounds.Offset(ray.o);
+  for (int a = 0; a < 3; ++a)
+    q[a] = (uint32_t)(Clamp(o[a], 0, 1) * scale);
+  Vector3f d = ray.d / (std::abs(ray.d.x) + std::abs(ray.d.y) +
+    std::abs(ray.d.z));
+  Float u = d.x, v = d.y;
+  if (d.z < 0) {
+    u = (1 - std::abs(d.y)) * (d.x >= 0 ? 1 : -1);
+    v = (1 - std::abs(d.x)) * (d.y >= 0 ? 1 : -1);
+  }
+  q[3] = (uint32_t)(Clamp(.5f * u + .5f, 0, 1) * scale);
+  q[4] = (uint32_t)(Clamp(.5f * v + .5f, 0, 1) * scale);
+  uint64_t key = 0;
+  for (int b = bits - 1; b >= 0; --b)
+    for (int i = 0; i < 5; ++i) key = (key << 1) | ((q[i] >> b) & 1);
+  return key;
+}
+
+// Public method implementations
+
+void WavefrontPathIntegrator::Render(const Scene& scene) {
+  // Compute number of tiles, nTiles, to use for parallel rendering
+  Bounds2i sampleBounds = camera->film->GetSampleBounds();
+  Vector2i sampleExtent = sampleBounds.Diagonal();
+  Point2i nTiles((sampleExtent.x + tileSize - 1) / tileSize,
+    (sampleExtent.y + tileSize - 1) / tileSize);
+
+  ParallelFor2D(
+    [&](Point2i tile) {
+      // Compute sample bounds for tile
+      int x0 = sampleBounds.pMin.x + tile.x * tileSize;
+      int x1 = std::min(x0 + tileSize, sampleBounds.pMax.x);
+      int y0 = sampleBounds.pMin.y + tile.y * tileSize;
+      int y1 = std::min(y0 + tileSize, sampleBounds.pMax.y);
+      Bounds2i tileBounds(Point2i(x0, y0), Point2i(x1, y1));
+
+      // Render the tile's wavefront and merge it into the image
+      std::unique_ptr<FilmTile> filmTile =
+        camera->film->GetFilmTile(tileBounds);
+      RenderTile(scene, tileBounds, sampleBounds, *filmTile);
+      camera->film->MergeFilmTile(std::move(filmTile));
+    }, nTiles);
+
+  camera->film->WriteImage();
+}
+
+// Private method implementations
+
+void WavefrontPathIntegrator::SortRays(const Scene& scene, PathQueue& paths,
+  PathQueue& scratch, std::vector<std::pair<uint64_t, int>>& keys) const
+{
+  // Sort each window of the queue by ray key, keeping queue order for ties
+  int nPaths = paths.Size();
+  keys.resize(nPaths);
+  for (int k = 0; k < nPaths; ++k)
+    keys[k] = std::make_pair(RaySortKey(paths.ray[k], scene.WorldBound()), k);
+  for (int start = 0; start < nPaths; start += sortBufferSize)
+    std::sort(keys.begin() + start,
+      keys.begin() + std::min(start + sortBufferSize, nPaths));
+
+  // Reorder the paths' state to match
+  scratch.Clear();
+  for (const auto& key : keys) {
+    int k = key.second;
+    scratch.Push(paths.ray[k], paths.pixel[k], paths.beta[k],
+      paths.bounces[k], paths.specularBounce[k]);
+  }
+  std::swap(paths, scratch);
+}
+
+void WavefrontPathIntegrator::RenderTile(const Scene& scene,
+  const Bounds2i& tileBounds, const Bounds2i& sampleBounds,
+  FilmTile& filmTile) const
+{
+  MemoryArena arena;
+
+  // Give each pixel of the tile its own sampler so that all of the tile's
+  // paths can be advanced together
+  int nPixels = tileBounds.Area();
+  std::vector<Point2i> pixels;
+  std::vector<std::unique_ptr<Sampler>> pixelSamplers;
+  int sampleWidth = sampleBounds.pMax.x - sampleBounds.pMin.x;
+  for (Point2i pixel : tileBounds) {
+    int seed = (pixel.y - sampleBounds.pMin.y) * sampleWidth +
+      (pixel.x - sampleBounds.pMin.x);
+    pixels.push_back(pixel);
+    pixelSamplers.push_back(sampler->Clone(seed));
+    pixelSamplers.back()->StartPixel(pixel);
+  }
+
+  // Allocate queues for the tile's wavefront
+  std::vector<CameraSample> cameraSamples(nPixels);
+  std::vector<Float> rayWeights(nPixels);
+  std::vector<Spectrum> L(nPixels);
+  PathQueue paths, nextPaths;
+  ShadowQueue shadowRays;
+  std::unique_ptr<SurfaceInteraction[]> isects(new SurfaceInteraction[nPixels]);
+  std::unique_ptr<bool[]> hits(new bool[nPixels]);
+  std::vector<Ray*> packet;
+  std::vector<std::pair<uint64_t, int>> sortKeys;
+  std::vector<std::pair<const Material*, int>> shadeOrder;
+  const BxDFType nonSpecular = BxDFType(BSDF_ALL & ~BSDF_SPECULAR);
+
+  bool moreSamples;
+  do {
+    // Generate camera rays for the current sample of every pixel
+    paths.Clear();
+    for (int i = 0; i < nPixels; ++i) {
+      Sampler& pixelSampler = *pixelSamplers[i];
+      cameraSamples[i] = pixelSampler.GetCameraSample(pixels[i]);
+      RayDifferential ray;
+      rayWeights[i] = camera->GenerateRayDifferential(cameraSamples[i], &ray);
+      ray.ScaleDifferentials(1 / std::sqrt(pixelSampler.samplesPerPixel));
+      L[i] = Spectrum(0.f);
+      if (rayWeights[i] > 0) paths.Push(ray, i, Spectrum(1.f), 0, true);
+    }
+
+    for (bool cameraRays = true; paths.Size() > 0; cameraRays = false) {
+      int nPaths = paths.Size();
+
+      // Find closest intersections for all queued rays; camera rays, and
+      // later rays once sorted, are coherent enough to be traced as packets
+      if (!cameraRays && sortRays) SortRays(scene, paths, nextPaths, sortKeys);
+      if (cameraRays || sortRays) {
+        packet.clear();
+        for (RayDifferential& ray : paths.ray) packet.push_back(&ray);
+        scene.IntersectPacket(packet.data(), nPaths, isects.get(), hits.get());
+      }
+      else
+        for (int k = 0; k < nPaths; ++k)
+          hits[k] = scene.Intersect(paths.ray[k], &isects[k]);
+
+      // Add emitted light at path vertices and sort hits by material
+      shadeOrder.clear();
+      for (int k = 0; k < nPaths; ++k) {
+        int p = paths.pixel[k];
+        if (paths.specularBounce[k]) {
+          // Emission is only counted here where direct lighting was not
+          // sampled at the previous vertex
+          if (hits[k])
+            L[p] += paths.beta[k] * isects[k].Le(-paths.ray[k].d);
+          else
+            for (const auto& light : scene.lights)
+              L[p] += paths.beta[k] * light->Le(paths.ray[k]);
+        }
+        if (hits[k] && paths.bounces[k] < maxDepth)
+          shadeOrder.push_back(
+            std::make_pair(isects[k].primitive->GetMaterial(), k));
+      }
+      std::sort(shadeOrder.begin(), shadeOrder.end(),
+        [](const std::pair<const Material*, int>& a,
+          const std::pair<const Material*, int>& b) {
+        if (a.first != b.first)
+          return std::less<const Material*>()(a.first, b.first);
+        return a.second < b.second;
+      });
+
+      // Evaluate materials for the sorted hits
+      for (const auto& s : shadeOrder)
+        isects[s.second].ComputeScatteringFunctions(paths.ray[s.second],
+          arena, true);
+
+      // Sample one light for each hit and queue its shadow ray
+      shadowRays.Clear();
+      int nLights = scene.lights.size();
+      for (const auto& s : shadeOrder) {
+        int k = s.second, p = paths.pixel[k];
+        const SurfaceInteraction& isect = isects[k];
+        if (!isect.bsdf || nLights == 0 ||
+          isect.bsdf->NumComponents(nonSpecular) == 0)
+          continue;
+        Sampler& pixelSampler = *pixelSamplers[p];
+        int lightNum = std::min((int)(pixelSampler.Get1D() * nLights),
+          nLights - 1);
+        const Light& light = *scene.lights[lightNum];
+        Vector3f wi;
+        Float lightPdf;
+        VisibilityTester visibility;
+        Spectrum Li = light.Sample_Li(isect, pixelSampler.Get2D(), &wi,
+          &lightPdf, &visibility);
+        if (lightPdf == 0 || Li.IsBlack()) continue;
+        Spectrum f = isect.bsdf->f(isect.wo, wi, nonSpecular) *
+          AbsDot(wi, isect.shading.n);
+        if (!f.IsBlack())
+          shadowRays.Push(visibility.P0().SpawnRayTo(visibility.P1()), p,
+            lightNum, paths.beta[k] * f * Li * (Float)nLights / lightPdf);
+      }
+
+      // Trace shadow rays and accumulate unoccluded direct lighting
+      for (int start = 0; start < shadowRays.Size();
+        start += Scene::MaxShadowRayBatch) {
+        int n = std::min(shadowRays.Size() - start, Scene::MaxShadowRayBatch);
+        uint64_t unoccluded = scene.Unoccluded(&shadowRays.ray[start],
+          &shadowRays.light[start], n);
+        for (int j = 0; j < n; ++j)
+          if (unoccluded & (uint64_t(1) << j))
+            L[shadowRays.pixel[start + j]] += shadowRays.Ld[start + j];
+      }
+
+      // Sample BSDFs to extend the surviving paths
+      nextPaths.Clear();
+      for (const auto& s : shadeOrder) {
+        int k = s.second, p = paths.pixel[k];
+        const SurfaceInteraction& isect = isects[k];
+        if (!isect.bsdf) {
+          // Skip over medium boundaries without counting a bounce
+          nextPaths.Push(isect.SpawnRay(paths.ray[k].d), p, paths.beta[k],
+            paths.bounces[k], paths.specularBounce[k]);
+          continue;
+        }
+        Sampler& pixelSampler = *pixelSamplers[p];
+        Vector3f wi;
+        Float pdf;
+        BxDFType flags;
+        Spectrum f = isect.bsdf->Sample_f(isect.wo, &wi, pixelSampler.Get2D(),
+          &pdf, BSDF_ALL, &flags);
+        if (f.IsBlack() || pdf == 0.f) continue;
+        Spectrum beta = paths.beta[k] * f * AbsDot(wi, isect.shading.n) / pdf;
+        int bounces = paths.bounces[k] + 1;
+
+        // Possibly terminate the path with Russian roulette
+        if (bounces > 3) {
+          Float q = std::max((Float).05, 1 - beta.y());
+          if (pixelSampler.Get1D() < q) continue;
+          beta /= 1 - q;
+        }
+        nextPaths.Push(isect.SpawnRay(wi), p, beta, bounces,
+          (flags & BSDF_SPECULAR) != 0);
+      }
+      std::swap(paths, nextPaths);
+      arena.Reset();
+    }
+
+    // Add the pixels' radiance estimates to the film tile
+    for (int i = 0; i < nPixels; ++i)
+      filmTile.AddSample(cameraSamples[i].pFilm, CheckRadiance(L[i]),
+        rayWeights[i]);
+
+    moreSamples = false;
+    for (int i = 0; i < nPixels; ++i)
+      moreSamples |= pixelSamplers[i]->StartNextSample();
+  } while (moreSamples);
+}
+
+WavefrontPathIntegrator* CreateWavefrontPathIntegrator(
+  const ParamSet& params, std::shared_ptr<Sampler> sampler,
+  std::shared_ptr<const Camera> camera)
+{
+  int maxDepth = params.FindOneInt("maxdepth", 5);
+  int tileSize = params.FindOneInt("tilesize", 32);
+  if (tileSize < 1) {
+    Warning("\"tilesize\" must be positive. Using 32.");
+    tileSize = 32;
+  }
+  else if (tileSize > WavefrontPathIntegrator::MaxTileSize) {
+    Warning("\"tilesize\" %d is too large. Using %d.", tileSize,
+      WavefrontPathIntegrator::MaxTileSize);
+    tileSize = WavefrontPathIntegrator::MaxTileSize;
+  }
+  bool sortRays = params.FindOneBool("sortrays", false);
+  int sortBufferSize = params.FindOneInt("sortbuffersize", 4096);
+  if (sortBufferSize < 1) {
+    Warning("\"sortbuffersize\" must be positive. Using 4096.");
+    sortBufferSize = 4096;
+  }
+  return new WavefrontPathIntegrator(maxDepth, camera, sampler, tileSize,
+    sortRays, sortBufferSize);
+}
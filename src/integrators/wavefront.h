@@ -0,0 +1,51 @@
+#pragma once
+
+#include "integrator.h"
+
+struct PathQueue;
+
+// WavefrontPathIntegrator
+
+// Path tracer that advances the paths of all pixels in an image tile
+// together, one bounce at a time. Each bounce runs as a sequence of batched
+// passes over structure-of-arrays queues: intersection, material
+// evaluation (with hits sorted by material), shadow rays and BSDF sampling.
+// Optionally, the incoherent rays of later bounces are sorted by a Morton
+// key of their origins and directions, in windows of _sortBufferSize_ rays,
+// and traced as packets in that order.
+//
+// Since a tile's paths are all in flight at once, each pixel of the tile
+// has its own sampler and intersection record for the duration of the
+// tile; _tileSize_ is therefore limited to _MaxTileSize_.
+class WavefrontPathIntegrator : public Integrator {
+public:
+  // Public constants
+  static const int MaxTileSize = 64;
+
+  // Public methods
+  WavefrontPathIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
+    std::shared_ptr<Sampler> sampler, int tileSize = 32, bool sortRays = false,
+    int sortBufferSize = 4096)
+    : maxDepth(maxDepth), camera(camera), sampler(sampler),
+    tileSize(tileSize), sortRays(sortRays), sortBufferSize(sortBufferSize) {}
+  void Render(const Scene& scene);
+
+private:
+  // Private methods
+  void RenderTile(const Scene& scene, const Bounds2i& tileBounds,
+    const Bounds2i& sampleBounds, FilmTile& filmTile) const;
+  void SortRays(const Scene& scene, PathQueue& paths, PathQueue& scratch,
+    std::vector<std::pair<uint64_t, int>>& keys) const;
+
+  // Private Data
+  const int maxDepth;
+  std::shared_ptr<const Camera> camera;
+  std::shared_ptr<Sampler> sampler;
+  const int tileSize;
+  const bool sortRays;
+  const int sortBufferSize;
+};
+
+WavefrontPathIntegrator* CreateWavefrontPathIntegrator(
+  const ParamSet& params, std::shared_ptr<Sampler> sampler,
+  std::shared_ptr<const Camera> camera);
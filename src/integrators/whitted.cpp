@@ -2,11 +2,21 @@
 
 Spectrum WhittedIntegrator::Li(const RayDifferential& ray,
   const Scene& scene, Sampler& sampler, MemoryArena& arena, int depth) const
+{
+  // Find closest ray intersection
+  SurfaceInteraction isect;
+  bool foundIntersection = scene.Intersect(ray, &isect);
+  return LiFromIntersection(ray, foundIntersection, isect, scene, sampler,
+    arena, depth);
+}
+
+Spectrum WhittedIntegrator::LiFromIntersection(const RayDifferential& ray,
+  bool foundIntersection, SurfaceInteraction& isect, const Scene& scene,
+  Sampler& sampler, MemoryArena& arena, int depth) const
 {
   Spectrum L(0.f);
-  // Find closest ray intersection or return background radiance
-  SurfaceIntersection isect;
-  if (!scene.Intersect(ray, &isect)) {
+  // Return background radiance if the ray escaped the scene
+  if (!foundIntersection) {
     for (const auto& light : scene.lights)
       L += light->Le(ray);
     return L;
@@ -23,17 +33,33 @@ Spectrum WhittedIntegrator::Li(const RayDifferential& ray,
   // Compute emitted light if ray hit an area light source
   L += isect.Le(wo);
 
-  // Add contribution of each light source
-  for (const auto& light : scene.lights) {
+  // Add contribution of each light source; shadow rays are collected and
+  // traced in batches
+  Ray shadowRays[Scene::MaxShadowRayBatch];
+  int lightIndices[Scene::MaxShadowRayBatch];
+  Spectrum Ld[Scene::MaxShadowRayBatch];
+  int nShadowRays = 0;
+  auto traceShadowRays = [&]() {
+    uint64_t unoccluded = scene.Unoccluded(shadowRays, lightIndices, nShadowRays);
+    for (int j = 0; j < nShadowRays; ++j)
+      if (unoccluded & (uint64_t(1) << j)) L += Ld[j];
+    nShadowRays = 0;
+  };
+  for (size_t i = 0; i < scene.lights.size(); ++i) {
+    const std::shared_ptr<Light>& light = scene.lights[i];
     Vector3f wi;
     Float pdf;
     VisibilityTester visibility;
     Spectrum Li = light->Sample_Li(isect, sampler.Get2D(), &wi, &pdf, &visibility);
     if (Li.IsBlack() || pdf == 0) continue;
     Spectrum f = isect.bsdf->f(wo, wi);
-    if (!f.IsBlack() && visibility.Unoccluded(scene))
-      L += f * Li * AbsDot(wi, n) / pdf;
+    if (f.IsBlack()) continue;
+    shadowRays[nShadowRays] = visibility.P0().SpawnRayTo(visibility.P1());
+    lightIndices[nShadowRays] = i;
+    Ld[nShadowRays] = f * Li * AbsDot(wi, n) / pdf;
+    if (++nShadowRays == Scene::MaxShadowRayBatch) traceShadowRays();
   }
+  if (nShadowRays > 0) traceShadowRays();
 
   if (depth + 1 < maxDepth) {
     // Trace rays for specular reflection and refraction
@@ -10,8 +10,12 @@ public:
   WhittedIntegrator(int maxDepth, std::shared_ptr<const Camera> camera,
     std::shared_ptr<Sampler> sampler)
     : SamplerIntegrator(camera, sampler), maxDepth(maxDepth) {}
-  Sampler Li(const RayDifferential& ray, const Scene& scene,
+  Spectrum Li(const RayDifferential& ray, const Scene& scene,
     Sampler& sampler, MemoryArena& arena, int depth) const;
+  Spectrum LiFromIntersection(const RayDifferential& ray,
+    bool foundIntersection, SurfaceInteraction& isect, const Scene& scene,
+    Sampler& sampler, MemoryArena& arena, int depth) const;
+  bool ShadesFoundIntersections() const { return true; }
 
 private:
   // Private Data
@@ -8,12 +8,20 @@ int main(int argc, char* argv[]) {
     if (!strcmp(argv[i], "--ncores") || !strcmp(argv[i], "--nthreads"))
       options.nThreads = atoi(argv[++i]);
     else if (!strcmp(argv[i], "--outfile")) options.imageFile = argv[++i];
+    else if (!strcmp(argv[i], "--bvhcache")) options.bvhCacheDir = argv[++i];
+    else if (!strcmp(argv[i], "--meshcache"))
+      options.meshCacheMB = atoi(argv[++i]);
     else if (!strcmp(argv[i], "--quick")) options.quickRender = true;
     else if (!strcmp(argv[i], "--quiet")) options.quiet = true;
     else if (!strcmp(argv[i], "--verbose")) options.verbose = true;
+    else if (!strcmp(argv[i], "--cat")) options.cat = true;
+    else if (!strcmp(argv[i], "--toply")) options.toPly = true;
+    else if (!strcmp(argv[i], "--tobinary")) options.toBinary = argv[++i];
     else if (!strcmp(argv[i], "--help") || !strcmp(argv[i], "-h")) {
-      printf("usage: pbrt [--nthreads n] [--outfile filename] [--quick] [--quiet] "
-        "[--verbose] [--help] <filename.pbrt> ...\n");
+      printf("usage: pbrt [--nthreads n] [--outfile filename] "
+        "[--bvhcache dir] [--meshcache MB] [--quick] [--quiet] [--verbose] "
+        "[--cat] "
+        "[--toply] [--tobinary filename] [--help] <filename.pbrt> ...\n");
       return 0;
     }
     else filenames.push_back(argv[i]);
@@ -25,8 +33,9 @@ int main(int argc, char* argv[]) {
     ParseFile("-");
   }
   else {
+    // Binary scenes are replayed directly; everything else is tokenized
     for (const std::string& f : filenames)
-      if (!ParseFile(f))
+      if (!(IsBinarySceneFile(f) ? ParseBinaryScene(f) : ParseFile(f)))
         Error("Couldn't open scene file \"%s\"", f.c_str());
   }
 
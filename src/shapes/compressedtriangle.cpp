@@ -0,0 +1,861 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+// shapes/compressedtriangle.cpp*
+#include "shapes/compressedtriangle.h"
+#include "textures/constant.h"
+#include "paramset.h"
+#include "parallel.h"
+#include "sampling.h"
+#include "stats.h"
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+namespace pbrt {
+
+  STAT_MEMORY_COUNTER("Memory/Compressed triangle meshes", compressedMeshBytes);
+  STAT_PERCENT("Intersections/Ray-compressed triangle intersection tests",
+    nHits, nTests);
+  STAT_PERCENT("Compressed meshes/Cluster cache hits", nClusterHits,
+    nClusterLookups);
+  STAT_COUNTER("Compressed meshes/Clusters decompressed", nDecompressions);
+  STAT_COUNTER("Compressed meshes/Clusters evicted", nEvictions);
+
+  // CompressedTriangleMesh Local Definitions
+
+  // The decompressed world-space vertex data and cluster-local vertex
+  // indices of a cluster. Texture coordinates aren't compressed and are
+  // read from the mesh starting at _vertexOffset_.
+  struct MeshCluster {
+    uint32_t vertexOffset;
+    std::vector<Point3f> p;
+    std::vector<Normal3f> n;
+    std::vector<Vector3f> s;
+    std::vector<uint16_t> indices;
+    size_t Bytes() const {
+      return sizeof(*this) + p.size() * sizeof(Point3f) +
+        n.size() * sizeof(Normal3f) + s.size() * sizeof(Vector3f) +
+        indices.size() * sizeof(uint16_t);
+    }
+  };
+
+  static std::atomic<uint32_t> nextMeshId(1);
+
+  static inline uint64_t ClusterKey(uint32_t meshId, int c) {
+    return ((uint64_t)meshId << 32) | (uint32_t)c;
+  }
+
+  // Decompressed clusters of all meshes, most recently used first
+  struct MeshCacheEntry {
+    uint64_t key;
+    std::shared_ptr<const MeshCluster> cluster;
+  };
+  static std::mutex meshCacheMutex;
+  static std::list<MeshCacheEntry> meshCacheLRU;
+  static std::unordered_map<uint64_t, std::list<MeshCacheEntry>::iterator>
+    meshCacheIndex;
+  static size_t meshCacheBytes = 0;
+
+  // Each thread also keeps the clusters it used last in a small
+  // direct-mapped table, indexed by _ThreadIndex_, so that repeated lookups
+  // don't take the cache's lock. An evicted cluster stays alive until its
+  // slot is reused, so the cache may exceed its budget by up to
+  // _ThreadClusterSlots_ clusters per thread.
+  static PBRT_CONSTEXPR int ThreadClusterSlots = 16;
+  struct ThreadClusterSlot {
+    uint64_t key = 0;
+    std::shared_ptr<const MeshCluster> cluster;
+  };
+  struct ThreadClusterTable {
+    ThreadClusterSlot slots[ThreadClusterSlots];
+  };
+
+  static std::vector<ThreadClusterTable>& ThreadClusterTables() {
+    static std::vector<ThreadClusterTable> tables(MaxThreadIndex());
+    return tables;
+  }
+
+  static void WriteVarint(uint32_t v, std::vector<uint8_t>* out) {
+    while (v >= 0x80) {
+      out->push_back((uint8_t)(v | 0x80));
+      v >>= 7;
+    }
+    out->push_back((uint8_t)v);
+  }
+
+  static inline uint32_t ReadVarint(const uint8_t** ptr) {
+    uint32_t v = 0;
+    for (int shift = 0;; shift += 7) {
+      uint8_t b = *(*ptr)++;
+      v |= (uint32_t)(b & 0x7f) << shift;
+      if (!(b & 0x80)) return v;
+    }
+  }
+
+  // Packs values of up to 24 bits, least significant bits first
+  class BitWriter {
+  public:
+    BitWriter(std::vector<uint8_t>* out) : out(out) {}
+    void Write(uint32_t v, int nBits) {
+      buffer |= (uint64_t)v << nBuffered;
+      nBuffered += nBits;
+      for (; nBuffered >= 8; nBuffered -= 8, buffer >>= 8)
+        out->push_back((uint8_t)buffer);
+    }
+    void Flush() {
+      if (nBuffered > 0) out->push_back((uint8_t)buffer);
+      buffer = 0;
+      nBuffered = 0;
+    }
+
+  private:
+    std::vector<uint8_t>* out;
+    uint64_t buffer = 0;
+    int nBuffered = 0;
+  };
+
+  class BitReader {
+  public:
+    BitReader(const uint8_t* ptr) : ptr(ptr) {}
+    uint32_t Read(int nBits) {
+      for (; nBuffered < nBits; nBuffered += 8)
+        buffer |= (uint64_t)*ptr++ << nBuffered;
+      uint32_t v = (uint32_t)(buffer & ((1ull << nBits) - 1));
+      buffer >>= nBits;
+      nBuffered -= nBits;
+      return v;
+    }
+
+  private:
+    const uint8_t* ptr;
+    uint64_t buffer = 0;
+    int nBuffered = 0;
+  };
+
+  // Maps a direction to the octahedron $|x|+|y|+|z|=1$, unfolds the lower
+  // half onto the square $[-1,1]^2$ and quantizes it to 16 bits per axis.
+  // Zero-length vectors are stored as $+z$.
+  static uint32_t EncodeOctahedral(const Vector3f& v) {
+    Float sum = std::abs(v.x) + std::abs(v.y) + std::abs(v.z);
+    if (sum == 0) return 0x80008000u;
+    Float x = v.x / sum, y = v.y / sum;
+    if (v.z < 0) {
+      Float ox = x;
+      x = (1 - std::abs(y)) * std::copysign((Float)1, ox);
+      y = (1 - std::abs(ox)) * std::copysign((Float)1, y);
+    }
+    auto quantize = [](Float f) {
+      return (uint32_t)std::round(Clamp((f + 1) / 2, 0, 1) * 65535);
+    };
+    return quantize(x) | (quantize(y) << 16);
+  }
+
+  static Vector3f DecodeOctahedral(uint32_t e) {
+    Vector3f v(-1 + 2 * (Float)(e & 0xffff) / 65535,
+      -1 + 2 * (Float)(e >> 16) / 65535, 0);
+    v.z = 1 - std::abs(v.x) - std::abs(v.y);
+    if (v.z < 0) {
+      Float ox = v.x;
+      v.x = (1 - std::abs(v.y)) * std::copysign((Float)1, ox);
+      v.y = (1 - std::abs(ox)) * std::copysign((Float)1, v.y);
+    }
+    return Normalize(v);
+  }
+
+  // CompressedTriangleMesh Method Definitions
+  CompressedTriangleMesh::CompressedTriangleMesh(
+    const Transform& ObjectToWorld, int nTriangles, const int* vertexIndices,
+    int nVertices, const Point3f* P, const Vector3f* S, const Normal3f* N,
+    const Point2f* UV, const std::shared_ptr<Texture<Float>>& alphaMask,
+    const std::shared_ptr<Texture<Float>>& shadowAlphaMask,
+    const int* fIndices)
+    : id(nextMeshId++),
+    nTriangles(nTriangles),
+    alphaMask(alphaMask),
+    shadowAlphaMask(shadowAlphaMask) {
+    // Set up the quantization grid over the world-space mesh bounds;
+    // positions are transformed again where they're quantized rather than
+    // kept in a temporary array
+    Bounds3f bounds;
+    for (int i = 0; i < nVertices; ++i)
+      bounds = Union(bounds, ObjectToWorld(P[i]));
+    const uint32_t maxQ = (1u << PositionBits) - 1;
+    pMin = bounds.pMin;
+    step = bounds.Diagonal() / maxQ;
+    auto quantize = [&](const Point3f& p, int a) {
+      if (step[a] == 0) return 0u;
+      return (uint32_t)Clamp(std::round((p[a] - pMin[a]) / step[a]), 0, maxQ);
+    };
+    if (fIndices) faceIndices.assign(fIndices, fIndices + nTriangles);
+
+    int nClusters = (nTriangles + ClusterTriangles - 1) / ClusterTriangles;
+    clusters.resize(nClusters);
+    std::vector<int> localIndex(nVertices, -1);
+    std::vector<int> used;
+    std::vector<uint32_t> q;
+    uint32_t nClusterVertices = 0;
+    for (int c = 0; c < nClusters; ++c) {
+      Cluster& cluster = clusters[c];
+      cluster.vertexOffset = nClusterVertices;
+      cluster.indexOffset = indexData.size();
+
+      // Number the cluster's vertices in order of first use, so that the
+      // index deltas stay small, and delta-code the indices
+      int start = c * ClusterTriangles;
+      int end = std::min(start + ClusterTriangles, nTriangles);
+      int prev = 0;
+      used.clear();
+      for (int i = 3 * start; i < 3 * end; ++i) {
+        int v = vertexIndices[i];
+        if (localIndex[v] == -1) {
+          localIndex[v] = used.size();
+          used.push_back(v);
+        }
+        int32_t delta = localIndex[v] - prev;
+        WriteVarint(((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31),
+          &indexData);
+        prev = localIndex[v];
+      }
+      cluster.nVertices = used.size();
+      nClusterVertices += used.size();
+
+      // Quantize the cluster's vertices and pack their offsets from the
+      // cluster's minimum grid point with as many bits as its extent needs
+      q.resize(3 * used.size());
+      uint32_t qMax[3] = { 0, 0, 0 };
+      for (int a = 0; a < 3; ++a) cluster.qMin[a] = maxQ;
+      for (size_t i = 0; i < used.size(); ++i) {
+        Point3f p = ObjectToWorld(P[used[i]]);
+        for (int a = 0; a < 3; ++a) {
+          q[3 * i + a] = quantize(p, a);
+          cluster.qMin[a] = std::min(cluster.qMin[a], q[3 * i + a]);
+          qMax[a] = std::max(qMax[a], q[3 * i + a]);
+        }
+      }
+      for (int a = 0; a < 3; ++a) {
+        cluster.bits[a] = 0;
+        while ((qMax[a] - cluster.qMin[a]) >> cluster.bits[a])
+          ++cluster.bits[a];
+      }
+      cluster.positionOffset = positionData.size();
+      BitWriter writer(&positionData);
+      for (size_t i = 0; i < used.size(); ++i)
+        for (int a = 0; a < 3; ++a)
+          writer.Write(q[3 * i + a] - cluster.qMin[a], cluster.bits[a]);
+      writer.Flush();
+
+      // Store the remaining vertex attributes per cluster vertex
+      for (int v : used) {
+        if (N) n.push_back(EncodeOctahedral(Vector3f(ObjectToWorld(N[v]))));
+        if (S) s.push_back(EncodeOctahedral(ObjectToWorld(S[v])));
+        if (UV) uv.push_back(UV[v]);
+        localIndex[v] = -1;
+      }
+    }
+    positionData.shrink_to_fit();
+    indexData.shrink_to_fit();
+    n.shrink_to_fit();
+    s.shrink_to_fit();
+    uv.shrink_to_fit();
+    compressedMeshBytes += sizeof(*this) + clusters.size() * sizeof(Cluster) +
+      positionData.size() + indexData.size() +
+      (n.size() + s.size()) * sizeof(uint32_t) + uv.size() * sizeof(Point2f) +
+      faceIndices.size() * sizeof(int);
+  }
+
+  CompressedTriangleMesh::~CompressedTriangleMesh() {
+    // Drop the mesh's clusters from the cache
+    std::lock_guard<std::mutex> lock(meshCacheMutex);
+    for (size_t c = 0; c < clusters.size(); ++c) {
+      auto iter = meshCacheIndex.find(ClusterKey(id, c));
+      if (iter == meshCacheIndex.end()) continue;
+      meshCacheBytes -= iter->second->cluster->Bytes();
+      meshCacheLRU.erase(iter->second);
+      meshCacheIndex.erase(iter);
+    }
+  }
+
+  std::shared_ptr<const MeshCluster> CompressedTriangleMesh::decompress(
+    int c) const {
+    ++nDecompressions;
+    const Cluster& cluster = clusters[c];
+    int start = c * ClusterTriangles;
+    int end = std::min(start + ClusterTriangles, nTriangles);
+    std::shared_ptr<MeshCluster> mc = std::make_shared<MeshCluster>();
+    mc->vertexOffset = cluster.vertexOffset;
+
+    // Reconstruct the vertex positions from their grid points; every
+    // cluster computes a shared vertex's position the same way
+    mc->p.resize(cluster.nVertices);
+    BitReader reader(&positionData[cluster.positionOffset]);
+    for (Point3f& p : mc->p)
+      for (int a = 0; a < 3; ++a)
+        p[a] = pMin[a] +
+          (cluster.qMin[a] + reader.Read(cluster.bits[a])) * step[a];
+    if (!n.empty()) {
+      mc->n.resize(cluster.nVertices);
+      for (int i = 0; i < cluster.nVertices; ++i)
+        mc->n[i] = Normal3f(DecodeOctahedral(n[cluster.vertexOffset + i]));
+    }
+    if (!s.empty()) {
+      mc->s.resize(cluster.nVertices);
+      for (int i = 0; i < cluster.nVertices; ++i)
+        mc->s[i] = DecodeOctahedral(s[cluster.vertexOffset + i]);
+    }
+
+    // Decode the delta-coded vertex indices
+    mc->indices.resize(3 * (end - start));
+    const uint8_t* ptr = &indexData[cluster.indexOffset];
+    int32_t index = 0;
+    for (uint16_t& vi : mc->indices) {
+      uint32_t u = ReadVarint(&ptr);
+      index += (int32_t)(u >> 1) ^ -(int32_t)(u & 1);
+      vi = index;
+    }
+    return mc;
+  }
+
+  const MeshCluster& CompressedTriangleMesh::Lookup(int c) const {
+    ++nClusterLookups;
+    uint64_t key = ClusterKey(id, c);
+    ThreadClusterSlot& slot = ThreadClusterTables()[ThreadIndex]
+      .slots[(key * 0x9e3779b97f4a7c15ull) >> 60];
+    if (slot.key == key) {
+      ++nClusterHits;
+      return *slot.cluster;
+    }
+
+    // Find the cluster in the shared cache or decompress it. Decompression
+    // happens outside of the lock, so another thread may add the same
+    // cluster in the meantime; its copy is then used instead.
+    std::shared_ptr<const MeshCluster> cluster;
+    {
+      std::lock_guard<std::mutex> lock(meshCacheMutex);
+      auto iter = meshCacheIndex.find(key);
+      if (iter != meshCacheIndex.end()) {
+        meshCacheLRU.splice(meshCacheLRU.begin(), meshCacheLRU, iter->second);
+        cluster = iter->second->cluster;
+        ++nClusterHits;
+      }
+    }
+    if (!cluster) {
+      std::shared_ptr<const MeshCluster> decompressed = decompress(c);
+      // Evicted clusters are freed after the lock is released
+      std::vector<std::shared_ptr<const MeshCluster>> evicted;
+      std::lock_guard<std::mutex> lock(meshCacheMutex);
+      auto iter = meshCacheIndex.find(key);
+      if (iter != meshCacheIndex.end()) {
+        meshCacheLRU.splice(meshCacheLRU.begin(), meshCacheLRU, iter->second);
+        cluster = iter->second->cluster;
+      }
+      else {
+        cluster = std::move(decompressed);
+        meshCacheLRU.push_front(MeshCacheEntry{ key, cluster });
+        meshCacheIndex[key] = meshCacheLRU.begin();
+        meshCacheBytes += cluster->Bytes();
+
+        // Evict the least recently used clusters while over budget, always
+        // keeping the new one
+        size_t budget = (size_t)PbrtOptions.meshCacheMB << 20;
+        while (meshCacheBytes > budget && meshCacheLRU.size() > 1) {
+          MeshCacheEntry& lru = meshCacheLRU.back();
+          meshCacheBytes -= lru.cluster->Bytes();
+          meshCacheIndex.erase(lru.key);
+          evicted.push_back(std::move(lru.cluster));
+          meshCacheLRU.pop_back();
+          ++nEvictions;
+        }
+      }
+    }
+    slot.key = key;
+    slot.cluster = std::move(cluster);
+    return *slot.cluster;
+  }
+
+  void ClearMeshCache() {
+    for (ThreadClusterTable& table : ThreadClusterTables())
+      for (ThreadClusterSlot& slot : table.slots) slot = ThreadClusterSlot();
+    std::lock_guard<std::mutex> lock(meshCacheMutex);
+    meshCacheLRU.clear();
+    meshCacheIndex.clear();
+    meshCacheBytes = 0;
+  }
+
+  // CompressedTriangle Method Definitions
+  const MeshCluster& CompressedTriangle::lookup(const uint16_t** v) const {
+    const MeshCluster& cluster =
+      mesh->Lookup(triangle >> CompressedTriangleMesh::LogClusterTriangles);
+    *v = &cluster.indices[3 * (triangle &
+      (CompressedTriangleMesh::ClusterTriangles - 1))];
+    return cluster;
+  }
+
+  void CompressedTriangle::getUVs(const MeshCluster& cluster,
+    const uint16_t* v, Point2f uv[3]) const {
+    if (!mesh->uv.empty()) {
+      for (int i = 0; i < 3; ++i) uv[i] = mesh->uv[cluster.vertexOffset + v[i]];
+    }
+    else {
+      uv[0] = Point2f(0, 0);
+      uv[1] = Point2f(1, 0);
+      uv[2] = Point2f(1, 1);
+    }
+  }
+
+  Bounds3f CompressedTriangle::ObjectBound() const {
+    const uint16_t* v;
+    const MeshCluster& cluster = lookup(&v);
+    return Union(Bounds3f((*WorldToObject)(cluster.p[v[0]]),
+      (*WorldToObject)(cluster.p[v[1]])),
+      (*WorldToObject)(cluster.p[v[2]]));
+  }
+
+  Bounds3f CompressedTriangle::WorldBound() const {
+    const uint16_t* v;
+    const MeshCluster& cluster = lookup(&v);
+    return Union(Bounds3f(cluster.p[v[0]], cluster.p[v[1]]), cluster.p[v[2]]);
+  }
+
+  // The watertight ray-triangle test of _Triangle::Intersect()_; sets
+  // *_tHit_ and the barycentric coordinates _b_ of the hit point.
+  bool CompressedTriangle::intersect(const Ray& ray, const Point3f p[3],
+    Float* tHit, Float b[3]) const {
+    // Translate vertices based on ray origin
+    Point3f p0t = p[0] - Vector3f(ray.o);
+    Point3f p1t = p[1] - Vector3f(ray.o);
+    Point3f p2t = p[2] - Vector3f(ray.o);
+
+    // Permute components of triangle vertices and ray direction
+    int kz = MaxDimension(Abs(ray.d));
+    int kx = kz + 1;
+    if (kx == 3) kx = 0;
+    int ky = kx + 1;
+    if (ky == 3) ky = 0;
+    Vector3f d = Permute(ray.d, kx, ky, kz);
+    p0t = Permute(p0t, kx, ky, kz);
+    p1t = Permute(p1t, kx, ky, kz);
+    p2t = Permute(p2t, kx, ky, kz);
+
+    // Apply shear transformation to translated vertex positions
+    Float Sx = -d.x / d.z;
+    Float Sy = -d.y / d.z;
+    Float Sz = 1.f / d.z;
+    p0t.x += Sx * p0t.z;
+    p0t.y += Sy * p0t.z;
+    p1t.x += Sx * p1t.z;
+    p1t.y += Sy * p1t.z;
+    p2t.x += Sx * p2t.z;
+    p2t.y += Sy * p2t.z;
+
+    // Compute edge function coefficients _e0_, _e1_, and _e2_
+    Float e0 = p1t.x * p2t.y - p1t.y * p2t.x;
+    Float e1 = p2t.x * p0t.y - p2t.y * p0t.x;
+    Float e2 = p0t.x * p1t.y - p0t.y * p1t.x;
+
+    // Fall back to double precision test at triangle edges
+    if (sizeof(Float) == sizeof(float) &&
+      (e0 == 0.0f || e1 == 0.0f || e2 == 0.0f)) {
+      double p2txp1ty = (double)p2t.x * (double)p1t.y;
+      double p2typ1tx = (double)p2t.y * (double)p1t.x;
+      e0 = (float)(p2typ1tx - p2txp1ty);
+      double p0txp2ty = (double)p0t.x * (double)p2t.y;
+      double p0typ2tx = (double)p0t.y * (double)p2t.x;
+      e1 = (float)(p0typ2tx - p0txp2ty);
+      double p1txp0ty = (double)p1t.x * (double)p0t.y;
+      double p1typ0tx = (double)p1t.y * (double)p0t.x;
+      e2 = (float)(p1typ0tx - p1txp0ty);
+    }
+
+    // Perform triangle edge and determinant tests
+    if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0))
+      return false;
+    Float det = e0 + e1 + e2;
+    if (det == 0) return false;
+
+    // Compute scaled hit distance to triangle and test against ray $t$ range
+    p0t.z *= Sz;
+    p1t.z *= Sz;
+    p2t.z *= Sz;
+    Float tScaled = e0 * p0t.z + e1 * p1t.z + e2 * p2t.z;
+    if (det < 0 && (tScaled >= 0 || tScaled < ray.tMax * det))
+      return false;
+    else if (det > 0 && (tScaled <= 0 || tScaled > ray.tMax * det))
+      return false;
+
+    // Compute barycentric coordinates and $t$ value for triangle intersection
+    Float invDet = 1 / det;
+    b[0] = e0 * invDet;
+    b[1] = e1 * invDet;
+    b[2] = e2 * invDet;
+    Float t = tScaled * invDet;
+
+    // Ensure that computed triangle $t$ is conservatively greater than zero
+    Float maxZt = MaxComponent(Abs(Vector3f(p0t.z, p1t.z, p2t.z)));
+    Float deltaZ = gamma(3) * maxZt;
+    Float maxXt = MaxComponent(Abs(Vector3f(p0t.x, p1t.x, p2t.x)));
+    Float maxYt = MaxComponent(Abs(Vector3f(p0t.y, p1t.y, p2t.y)));
+    Float deltaX = gamma(5) * (maxXt + maxZt);
+    Float deltaY = gamma(5) * (maxYt + maxZt);
+    Float deltaE =
+      2 * (gamma(2) * maxXt * maxYt + deltaY * maxXt + deltaX * maxYt);
+    Float maxE = MaxComponent(Abs(Vector3f(e0, e1, e2)));
+    Float deltaT = 3 *
+      (gamma(3) * maxE * maxZt + deltaE * maxZt + deltaZ * maxE) *
+      std::abs(invDet);
+    if (t <= deltaT) return false;
+    *tHit = t;
+    return true;
+  }
+
+  // Computes the triangle's partial derivatives; returns false if the
+  // triangle is degenerate.
+  static bool TrianglePartials(const Point3f p[3], const Point2f uv[3],
+    Vector3f* dpdu, Vector3f* dpdv) {
+    Vector2f duv02 = uv[0] - uv[2], duv12 = uv[1] - uv[2];
+    Vector3f dp02 = p[0] - p[2], dp12 = p[1] - p[2];
+    Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
+    bool degenerateUV = std::abs(determinant) < 1e-8;
+    if (!degenerateUV) {
+      Float invdet = 1 / determinant;
+      *dpdu = (duv12[1] * dp02 - duv02[1] * dp12) * invdet;
+      *dpdv = (-duv12[0] * dp02 + duv02[0] * dp12) * invdet;
+    }
+    if (degenerateUV || Cross(*dpdu, *dpdv).LengthSquared() == 0) {
+      // Handle zero determinant for triangle partial derivative matrix
+      Vector3f ng = Cross(p[2] - p[0], p[1] - p[0]);
+      if (ng.LengthSquared() == 0) return false;
+      CoordinateSystem(Normalize(ng), dpdu, dpdv);
+    }
+    return true;
+  }
+
+  bool CompressedTriangle::Intersect(const Ray& ray, Float* tHit,
+    SurfaceInteraction* isect, bool testAlphaTexture) const {
+    ProfilePhase prof(Prof::TriIntersect);
+    ++nTests;
+    const uint16_t* v;
+    const MeshCluster& cluster = lookup(&v);
+    const Point3f p[3] = { cluster.p[v[0]], cluster.p[v[1]],
+                           cluster.p[v[2]] };
+    Float t, b[3];
+    if (!intersect(ray, p, &t, b)) return false;
+
+    // Compute triangle partial derivatives
+    Point2f uv[3];
+    getUVs(cluster, v, uv);
+    Vector3f dpdu, dpdv;
+    if (!TrianglePartials(p, uv, &dpdu, &dpdv))
+      // The triangle is actually degenerate; the intersection is bogus.
+      return false;
+
+    // Compute error bounds for triangle intersection
+    Float xAbsSum = (std::abs(b[0] * p[0].x) + std::abs(b[1] * p[1].x) +
+      std::abs(b[2] * p[2].x));
+    Float yAbsSum = (std::abs(b[0] * p[0].y) + std::abs(b[1] * p[1].y) +
+      std::abs(b[2] * p[2].y));
+    Float zAbsSum = (std::abs(b[0] * p[0].z) + std::abs(b[1] * p[1].z) +
+      std::abs(b[2] * p[2].z));
+    Vector3f pError = gamma(7) * Vector3f(xAbsSum, yAbsSum, zAbsSum);
+
+    // Interpolate $(u,v)$ parametric coordinates and hit point
+    Point3f pHit = b[0] * p[0] + b[1] * p[1] + b[2] * p[2];
+    Point2f uvHit = b[0] * uv[0] + b[1] * uv[1] + b[2] * uv[2];
+
+    // Test intersection against alpha texture, if present
+    if (testAlphaTexture && mesh->alphaMask) {
+      SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
+        dpdu, dpdv, Normal3f(0, 0, 0), Normal3f(0, 0, 0), ray.time, this);
+      if (mesh->alphaMask->Evaluate(isectLocal) == 0) return false;
+    }
+
+    // Fill in _SurfaceInteraction_ from triangle hit
+    *isect = SurfaceInteraction(pHit, pError, uvHit, -ray.d, dpdu, dpdv,
+      Normal3f(0, 0, 0), Normal3f(0, 0, 0), ray.time, this,
+      mesh->faceIndices.empty() ? 0 : mesh->faceIndices[triangle]);
+
+    // Override surface normal in _isect_ for triangle
+    isect->n = isect->shading.n =
+      Normal3f(Normalize(Cross(p[0] - p[2], p[1] - p[2])));
+    if (reverseOrientation ^ transformSwapsHandedness)
+      isect->n = isect->shading.n = -isect->n;
+
+    if (!cluster.n.empty() || !cluster.s.empty()) {
+      // Initialize _CompressedTriangle_ shading geometry
+
+      // Compute shading normal _ns_ for triangle
+      Normal3f ns;
+      if (!cluster.n.empty()) {
+        ns = b[0] * cluster.n[v[0]] + b[1] * cluster.n[v[1]] +
+          b[2] * cluster.n[v[2]];
+        ns = ns.LengthSquared() > 0 ? Normalize(ns) : isect->n;
+      }
+      else
+        ns = isect->n;
+
+      // Compute shading tangent _ss_ for triangle
+      Vector3f ss;
+      if (!cluster.s.empty()) {
+        ss = b[0] * cluster.s[v[0]] + b[1] * cluster.s[v[1]] +
+          b[2] * cluster.s[v[2]];
+        if (ss.LengthSquared() == 0) ss = isect->dpdu;
+      }
+      else
+        ss = isect->dpdu;
+      ss = Normalize(ss);
+
+      // Compute shading bitangent _ts_ for triangle and adjust _ss_
+      Vector3f ts = Cross(ss, ns);
+      if (ts.LengthSquared() > 0.f) {
+        ts = Normalize(ts);
+        ss = Cross(ts, ns);
+      }
+      else
+        CoordinateSystem((Vector3f)ns, &ss, &ts);
+
+      // Compute $\dndu$ and $\dndv$ for triangle shading geometry
+      Normal3f dndu, dndv;
+      if (!cluster.n.empty()) {
+        Vector2f duv02 = uv[0] - uv[2];
+        Vector2f duv12 = uv[1] - uv[2];
+        Normal3f dn1 = cluster.n[v[0]] - cluster.n[v[2]];
+        Normal3f dn2 = cluster.n[v[1]] - cluster.n[v[2]];
+        Float determinant = duv02[0] * duv12[1] - duv02[1] * duv12[0];
+        bool degenerateUV = std::abs(determinant) < 1e-8;
+        if (degenerateUV) {
+          Vector3f dn = Cross(Vector3f(cluster.n[v[2]] - cluster.n[v[0]]),
+            Vector3f(cluster.n[v[1]] - cluster.n[v[0]]));
+          if (dn.LengthSquared() == 0)
+            dndu = dndv = Normal3f(0, 0, 0);
+          else {
+            Vector3f dnu, dnv;
+            CoordinateSystem(dn, &dnu, &dnv);
+            dndu = Normal3f(dnu);
+            dndv = Normal3f(dnv);
+          }
+        }
+        else {
+          Float invDet = 1 / determinant;
+          dndu = (duv12[1] * dn1 - duv02[1] * dn2) * invDet;
+          dndv = (-duv12[0] * dn1 + duv02[0] * dn2) * invDet;
+        }
+      }
+      else
+        dndu = dndv = Normal3f(0, 0, 0);
+      if (reverseOrientation) ts = -ts;
+      isect->SetShadingGeometry(ss, ts, dndu, dndv, true);
+    }
+    *tHit = t;
+    ++nHits;
+    return true;
+  }
+
+  bool CompressedTriangle::IntersectP(const Ray& ray,
+    bool testAlphaTexture) const {
+    ProfilePhase prof(Prof::TriIntersectP);
+    ++nTests;
+    const uint16_t* v;
+    const MeshCluster& cluster = lookup(&v);
+    const Point3f p[3] = { cluster.p[v[0]], cluster.p[v[1]],
+                           cluster.p[v[2]] };
+    Float t, b[3];
+    if (!intersect(ray, p, &t, b)) return false;
+
+    // Test shadow ray intersection against alpha texture, if present
+    if (testAlphaTexture && (mesh->alphaMask || mesh->shadowAlphaMask)) {
+      Point2f uv[3];
+      getUVs(cluster, v, uv);
+      Vector3f dpdu, dpdv;
+      if (!TrianglePartials(p, uv, &dpdu, &dpdv)) return false;
+      Point3f pHit = b[0] * p[0] + b[1] * p[1] + b[2] * p[2];
+      Point2f uvHit = b[0] * uv[0] + b[1] * uv[1] + b[2] * uv[2];
+      SurfaceInteraction isectLocal(pHit, Vector3f(0, 0, 0), uvHit, -ray.d,
+        dpdu, dpdv, Normal3f(0, 0, 0), Normal3f(0, 0, 0), ray.time, this);
+      if (mesh->alphaMask && mesh->alphaMask->Evaluate(isectLocal) == 0)
+        return false;
+      if (mesh->shadowAlphaMask &&
+        mesh->shadowAlphaMask->Evaluate(isectLocal) == 0)
+        return false;
+    }
+    ++nHits;
+    return true;
+  }
+
+  Float CompressedTriangle::Area() const {
+    const uint16_t* v;
+    const MeshCluster& cluster = lookup(&v);
+    const Point3f& p0 = cluster.p[v[0]];
+    return 0.5 * Cross(cluster.p[v[1]] - p0, cluster.p[v[2]] - p0).Length();
+  }
+
+  Interaction CompressedTriangle::Sample(const Point2f& u, Float* pdf) const {
+    const uint16_t* v;
+    const MeshCluster& cluster = lookup(&v);
+    const Point3f& p0 = cluster.p[v[0]];
+    const Point3f& p1 = cluster.p[v[1]];
+    const Point3f& p2 = cluster.p[v[2]];
+    Point2f b = UniformSampleTriangle(u);
+    Interaction it;
+    it.p = b[0] * p0 + b[1] * p1 + (1 - b[0] - b[1]) * p2;
+    // Compute surface normal for sampled point on triangle
+    it.n = Normalize(Normal3f(Cross(p1 - p0, p2 - p0)));
+    if (!cluster.n.empty()) {
+      Normal3f ns(b[0] * cluster.n[v[0]] + b[1] * cluster.n[v[1]] +
+        (1 - b[0] - b[1]) * cluster.n[v[2]]);
+      it.n = Faceforward(it.n, ns);
+    }
+    else if (reverseOrientation ^ transformSwapsHandedness)
+      it.n *= -1;
+
+    // Compute error bounds for sampled point on triangle
+    Point3f pAbsSum = Abs(b[0] * p0) + Abs(b[1] * p1) +
+      Abs((1 - b[0] - b[1]) * p2);
+    it.pError = gamma(6) * Vector3f(pAbsSum.x, pAbsSum.y, pAbsSum.z);
+    *pdf = 1 / (0.5 * Cross(p1 - p0, p2 - p0).Length());
+    return it;
+  }
+
+  std::vector<std::shared_ptr<Shape>> CreateCompressedTriangleMesh(
+    const Transform* ObjectToWorld, const Transform* WorldToObject,
+    bool reverseOrientation, int nTriangles, const int* vertexIndices,
+    int nVertices, const Point3f* p, const Vector3f* s, const Normal3f* n,
+    const Point2f* uv, const std::shared_ptr<Texture<Float>>& alphaTexture,
+    const std::shared_ptr<Texture<Float>>& shadowAlphaTexture,
+    const int* faceIndices) {
+    std::shared_ptr<const CompressedTriangleMesh> mesh =
+      std::make_shared<CompressedTriangleMesh>(*ObjectToWorld, nTriangles,
+        vertexIndices, nVertices, p, s, n, uv, alphaTexture,
+        shadowAlphaTexture, faceIndices);
+    std::vector<std::shared_ptr<Shape>> tris;
+    tris.reserve(nTriangles);
+    for (int i = 0; i < nTriangles; ++i)
+      tris.push_back(std::make_shared<CompressedTriangle>(ObjectToWorld,
+        WorldToObject, reverseOrientation, mesh, i));
+    return tris;
+  }
+
+  std::vector<std::shared_ptr<Shape>> CreateCompressedTriangleMeshShape(
+    const Transform* o2w, const Transform* w2o, bool reverseOrientation,
+    const ParamSet& params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>>* floatTextures) {
+    int nvi, npi, nuvi, nsi, nni;
+    const int* vi = params.FindInt("indices", &nvi);
+    const Point3f* P = params.FindPoint3f("P", &npi);
+    const Point2f* uvs = params.FindPoint2f("uv", &nuvi);
+    if (!uvs) uvs = params.FindPoint2f("st", &nuvi);
+    std::vector<Point2f> tempUVs;
+    if (!uvs) {
+      const Float* fuv = params.FindFloat("uv", &nuvi);
+      if (!fuv) fuv = params.FindFloat("st", &nuvi);
+      if (fuv) {
+        nuvi /= 2;
+        tempUVs.reserve(nuvi);
+        for (int i = 0; i < nuvi; ++i)
+          tempUVs.push_back(Point2f(fuv[2 * i], fuv[2 * i + 1]));
+        uvs = tempUVs.data();
+      }
+    }
+    if (uvs) {
+      if (nuvi < npi) {
+        Error("Not enough of \"uv\"s for triangle mesh.  Expected %d, "
+          "found %d.  Discarding.", npi, nuvi);
+        uvs = nullptr;
+      }
+      else if (nuvi > npi)
+        Warning("More \"uv\"s provided than will be used for triangle "
+          "mesh.  (%d expcted, %d found)", npi, nuvi);
+    }
+    if (!vi) {
+      if (npi == 3) {
+        // Special case: if there's just one triangle and no indices, use P
+        static int defaultVertexIndices[3] = { 0, 1, 2 };
+        vi = defaultVertexIndices;
+        nvi = 3;
+      }
+      else {
+        Error("Vertex indices \"indices\" not provided with triangle mesh "
+          "shape");
+        return std::vector<std::shared_ptr<Shape>>();
+      }
+    }
+    if (!P) {
+      Error("Vertex positions \"P\" not provided with triangle mesh shape");
+      return std::vector<std::shared_ptr<Shape>>();
+    }
+    const Vector3f* S = params.FindVector3f("S", &nsi);
+    if (S && nsi != npi) {
+      Error("Number of \"S\"s for triangle mesh must match \"P\"s");
+      S = nullptr;
+    }
+    const Normal3f* N = params.FindNormal3f("N", &nni);
+    if (N && nni != npi) {
+      Error("Number of \"N\"s for triangle mesh must match \"P\"s");
+      N = nullptr;
+    }
+    for (int i = 0; i < nvi; ++i)
+      if (vi[i] < 0 || vi[i] >= npi) {
+        Error("trianglemesh has out of-bounds vertex index %d (%d \"P\" "
+          "values were given", vi[i], npi);
+        return std::vector<std::shared_ptr<Shape>>();
+      }
+    if (nvi < 3) return std::vector<std::shared_ptr<Shape>>();
+
+    int nfi;
+    const int* faceIndices = params.FindInt("faceIndices", &nfi);
+    if (faceIndices && nfi != nvi / 3) {
+      Error("Number of face indices, %d, doesn't match number of faces, %d",
+        nfi, nvi / 3);
+      faceIndices = nullptr;
+    }
+
+    // Look up alpha textures
+    std::shared_ptr<Texture<Float>> alphaTex, shadowAlphaTex;
+    for (int i = 0; i < 2; ++i) {
+      const char* name = i == 0 ? "alpha" : "shadowalpha";
+      std::shared_ptr<Texture<Float>>& tex = i == 0 ? alphaTex : shadowAlphaTex;
+      std::string texName = params.FindTexture(name);
+      if (texName != "") {
+        if (floatTextures && floatTextures->find(texName) !=
+          floatTextures->end())
+          tex = (*floatTextures)[texName];
+        else
+          Error("Couldn't find float texture \"%s\" for \"%s\" parameter",
+            texName.c_str(), name);
+      }
+      else if (params.FindOneFloat(name, 1.f) == 0.f)
+        tex.reset(new ConstantTexture<Float>(0.f));
+    }
+    return CreateCompressedTriangleMesh(o2w, w2o, reverseOrientation,
+      nvi / 3, vi, npi, P, S, N, uvs, alphaTex, shadowAlphaTex, faceIndices);
+  }
+
+}  // namespace pbrt
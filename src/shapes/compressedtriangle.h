@@ -0,0 +1,156 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_SHAPES_COMPRESSEDTRIANGLE_H
+#define PBRT_SHAPES_COMPRESSEDTRIANGLE_H
+
+// shapes/compressedtriangle.h*
+#include "shape.h"
+#include "texture.h"
+#include <map>
+
+namespace pbrt {
+
+  // CompressedTriangleMesh Forward Declarations
+  struct MeshCluster;
+
+  // CompressedTriangleMesh Declarations
+
+  // A triangle mesh that is only kept in compressed form. Triangles are
+  // split into clusters of _ClusterTriangles_. World-space positions are
+  // quantized to a grid of _PositionBits_ bits per axis over the mesh's
+  // bounds, and each cluster bit-packs the offsets of the vertices it uses
+  // from its own minimum grid point; since the grid is shared, a vertex
+  // used by several clusters is reconstructed identically by all of them
+  // and the mesh stays watertight. Normals and tangents are stored
+  // octahedrally encoded in 32 bits, and cluster-local vertex indices are
+  // delta-coded as variable-length integers. Clusters are decompressed on
+  // first use into a cache that is shared by all meshes and bounded by
+  // _Options::meshCacheMB_.
+  struct CompressedTriangleMesh {
+    // CompressedTriangleMesh Public Methods
+    CompressedTriangleMesh(const Transform& ObjectToWorld, int nTriangles,
+      const int* vertexIndices, int nVertices, const Point3f* P,
+      const Vector3f* S, const Normal3f* N, const Point2f* uv,
+      const std::shared_ptr<Texture<Float>>& alphaMask,
+      const std::shared_ptr<Texture<Float>>& shadowAlphaMask,
+      const int* faceIndices);
+    ~CompressedTriangleMesh();
+    // Returns cluster _c_ decompressed; the reference stays valid until
+    // the calling thread's next lookup.
+    const MeshCluster& Lookup(int c) const;
+    static PBRT_CONSTEXPR int LogClusterTriangles = 10;
+    static PBRT_CONSTEXPR int ClusterTriangles = 1 << LogClusterTriangles;
+    static PBRT_CONSTEXPR int PositionBits = 21;
+
+    // CompressedTriangleMesh Data
+    struct Cluster {
+      uint32_t qMin[3];
+      uint8_t bits[3];
+      uint16_t nVertices;
+      uint32_t vertexOffset;
+      uint64_t positionOffset, indexOffset;
+    };
+    const uint32_t id;
+    const int nTriangles;
+    Point3f pMin;
+    Vector3f step;
+    std::vector<Cluster> clusters;
+    std::vector<uint8_t> positionData, indexData;
+    // Per cluster vertex, empty if the mesh doesn't have them
+    std::vector<uint32_t> n, s;
+    std::vector<Point2f> uv;
+    std::vector<int> faceIndices;
+    std::shared_ptr<Texture<Float>> alphaMask, shadowAlphaMask;
+
+  private:
+    // CompressedTriangleMesh Private Methods
+    std::shared_ptr<const MeshCluster> decompress(int c) const;
+  };
+
+  class CompressedTriangle : public Shape {
+  public:
+    // CompressedTriangle Public Methods
+    CompressedTriangle(const Transform* ObjectToWorld,
+      const Transform* WorldToObject, bool reverseOrientation,
+      const std::shared_ptr<const CompressedTriangleMesh>& mesh,
+      int triangle)
+      : Shape(ObjectToWorld, WorldToObject, reverseOrientation),
+      mesh(mesh),
+      triangle(triangle) {}
+    Bounds3f ObjectBound() const;
+    Bounds3f WorldBound() const;
+    bool Intersect(const Ray& ray, Float* tHit, SurfaceInteraction* isect,
+      bool testAlphaTexture = true) const;
+    bool IntersectP(const Ray& ray, bool testAlphaTexture = true) const;
+    Float Area() const;
+    using Shape::Sample;  // Bring in the other Sample() overload.
+    Interaction Sample(const Point2f& u, Float* pdf) const;
+
+  private:
+    // CompressedTriangle Private Methods
+    const MeshCluster& lookup(const uint16_t** v) const;
+    bool intersect(const Ray& ray, const Point3f p[3], Float* tHit,
+      Float b[3]) const;
+    void getUVs(const MeshCluster& cluster, const uint16_t* v,
+      Point2f uv[3]) const;
+
+    // CompressedTriangle Private Data
+    std::shared_ptr<const CompressedTriangleMesh> mesh;
+    int triangle;
+  };
+
+  std::vector<std::shared_ptr<Shape>> CreateCompressedTriangleMesh(
+    const Transform* ObjectToWorld, const Transform* WorldToObject,
+    bool reverseOrientation, int nTriangles, const int* vertexIndices,
+    int nVertices, const Point3f* p, const Vector3f* s, const Normal3f* n,
+    const Point2f* uv, const std::shared_ptr<Texture<Float>>& alphaTexture,
+    const std::shared_ptr<Texture<Float>>& shadowAlphaTexture,
+    const int* faceIndices = nullptr);
+  // Takes the parameters of a "trianglemesh" shape, as
+  // _CreateTriangleMeshShape()_ does.
+  std::vector<std::shared_ptr<Shape>> CreateCompressedTriangleMeshShape(
+    const Transform* o2w, const Transform* w2o, bool reverseOrientation,
+    const ParamSet& params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>>* floatTextures);
+
+  // Drops the decompressed clusters of all meshes, including those held by
+  // the threads; must not be called while rays are being traced.
+  void ClearMeshCache();
+
+}  // namespace pbrt
+
+#endif  // PBRT_SHAPES_COMPRESSEDTRIANGLE_H
@@ -0,0 +1,507 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+// shapes/mappedply.cpp*
+#include "shapes/mappedply.h"
+#include "shapes/compressedtriangle.h"
+#include "shapes/triangle.h"
+#include "textures/constant.h"
+#include "nestedparallel.h"
+#include "parallel.h"
+#include "paramset.h"
+#include "stats.h"
+#include <atomic>
+#include <cstring>
+#include <sstream>
+#ifdef PBRT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace pbrt {
+
+  STAT_COUNTER("Scene/PLY files memory mapped", mappedPLYFiles);
+  STAT_COUNTER("Scene/PLY position arrays used in place", inPlacePositions);
+
+  // MappedPLY Local Declarations
+  enum class PLYType {
+    Int8, UInt8, Int16, UInt16, Int32, UInt32, Float32, Float64, Invalid
+  };
+
+  struct PLYProperty {
+    std::string name;
+    PLYType type;                          // value type, or list item type
+    PLYType countType = PLYType::Invalid;  // list length type, for lists
+    int offset = 0;  // byte offset within items of fixed size
+  };
+
+  struct PLYElement {
+    std::string name;
+    int64_t count = 0;
+    std::vector<PLYProperty> properties;
+    int stride = 0;  // item size in bytes, or 0 if it has list properties
+    const PLYProperty* Find(const char* name) const {
+      for (const PLYProperty& prop : properties)
+        if (prop.name == name) return &prop;
+      return nullptr;
+    }
+  };
+
+  class MappedPLYFile {
+  public:
+    // MappedPLYFile Public Methods
+    MappedPLYFile(const std::string& filename) {
+#ifdef PBRT_HAVE_MMAP
+      int fd = open(filename.c_str(), O_RDONLY);
+      if (fd < 0) return;
+      struct stat s;
+      if (fstat(fd, &s) == 0 && s.st_size > 0) {
+        void* ptr = mmap(nullptr, s.st_size, PROT_READ, MAP_FILE | MAP_SHARED,
+          fd, 0);
+        if (ptr != MAP_FAILED) {
+          data = (const uint8_t*)ptr;
+          size = s.st_size;
+        }
+      }
+      close(fd);
+#endif
+    }
+    ~MappedPLYFile() {
+#ifdef PBRT_HAVE_MMAP
+      if (data) munmap((void*)data, size);
+#endif
+    }
+
+    // MappedPLYFile Public Data
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+  };
+
+  // MappedPLY Utility Functions
+  static PLYType ParsePLYType(const std::string& s) {
+    if (s == "char" || s == "int8") return PLYType::Int8;
+    if (s == "uchar" || s == "uint8") return PLYType::UInt8;
+    if (s == "short" || s == "int16") return PLYType::Int16;
+    if (s == "ushort" || s == "uint16") return PLYType::UInt16;
+    if (s == "int" || s == "int32") return PLYType::Int32;
+    if (s == "uint" || s == "uint32") return PLYType::UInt32;
+    if (s == "float" || s == "float32") return PLYType::Float32;
+    if (s == "double" || s == "float64") return PLYType::Float64;
+    return PLYType::Invalid;
+  }
+
+  static int PLYTypeSize(PLYType t) {
+    switch (t) {
+    case PLYType::Int8:
+    case PLYType::UInt8:
+      return 1;
+    case PLYType::Int16:
+    case PLYType::UInt16:
+      return 2;
+    case PLYType::Int32:
+    case PLYType::UInt32:
+    case PLYType::Float32:
+      return 4;
+    case PLYType::Float64:
+      return 8;
+    default:
+      return 0;
+    }
+  }
+
+  template <typename T>
+  inline T LoadUnaligned(const uint8_t* p) {
+    T v;
+    memcpy(&v, p, sizeof(T));
+    return v;
+  }
+
+  // Reads a little-endian value of type _t_; only called on little-endian
+  // hosts
+  inline double ReadPLYValue(const uint8_t* p, PLYType t) {
+    switch (t) {
+    case PLYType::Int8:
+      return LoadUnaligned<int8_t>(p);
+    case PLYType::UInt8:
+      return LoadUnaligned<uint8_t>(p);
+    case PLYType::Int16:
+      return LoadUnaligned<int16_t>(p);
+    case PLYType::UInt16:
+      return LoadUnaligned<uint16_t>(p);
+    case PLYType::Int32:
+      return LoadUnaligned<int32_t>(p);
+    case PLYType::UInt32:
+      return LoadUnaligned<uint32_t>(p);
+    case PLYType::Float32:
+      return LoadUnaligned<float>(p);
+    case PLYType::Float64:
+      return LoadUnaligned<double>(p);
+    default:
+      return 0;
+    }
+  }
+
+  inline int64_t ReadPLYInt(const uint8_t* p, PLYType t) {
+    return (int64_t)ReadPLYValue(p, t);
+  }
+
+  static bool IsLittleEndianHost() {
+    uint16_t one = 1;
+    uint8_t first;
+    memcpy(&first, &one, 1);
+    return first == 1;
+  }
+
+  // Parses the header of a binary little-endian PLY file, returning false
+  // for any other kind of file
+  static bool ParsePLYHeader(const MappedPLYFile& file,
+    std::vector<PLYElement>* elements, size_t* headerSize) {
+    const char* text = (const char*)file.data;
+    size_t pos = 0;
+    bool first = true, binaryLE = false;
+    while (pos < file.size) {
+      const char* end = (const char*)memchr(text + pos, '\n', file.size - pos);
+      if (!end) return false;
+      std::string line(text + pos, end);
+      pos = end - text + 1;
+      if (!line.empty() && line.back() == '\r') line.pop_back();
+      std::istringstream tokens(line);
+      std::string keyword;
+      tokens >> keyword;
+      if (first) {
+        if (keyword != "ply") return false;
+        first = false;
+      }
+      else if (keyword == "format") {
+        std::string format;
+        tokens >> format;
+        binaryLE = format == "binary_little_endian";
+      }
+      else if (keyword == "element") {
+        PLYElement element;
+        if (!(tokens >> element.name >> element.count) || element.count < 0)
+          return false;
+        elements->push_back(element);
+      }
+      else if (keyword == "property") {
+        if (elements->empty()) return false;
+        PLYProperty prop;
+        std::string type;
+        tokens >> type;
+        if (type == "list") {
+          std::string countType, itemType;
+          tokens >> countType >> itemType;
+          prop.countType = ParsePLYType(countType);
+          if (prop.countType == PLYType::Invalid) return false;
+          type = itemType;
+        }
+        prop.type = ParsePLYType(type);
+        if (prop.type == PLYType::Invalid || !(tokens >> prop.name))
+          return false;
+        elements->back().properties.push_back(prop);
+      }
+      else if (keyword == "end_header") {
+        *headerSize = pos;
+        break;
+      }
+      else if (keyword != "comment" && keyword != "obj_info" &&
+        !keyword.empty())
+        return false;
+    }
+    if (!binaryLE || *headerSize == 0) return false;
+
+    // Compute property offsets of elements with fixed-size items
+    for (PLYElement& element : *elements) {
+      int offset = 0;
+      for (PLYProperty& prop : element.properties) {
+        if (prop.countType != PLYType::Invalid) {
+          offset = 0;
+          break;
+        }
+        prop.offset = offset;
+        offset += PLYTypeSize(prop.type);
+      }
+      element.stride = offset;
+    }
+    return true;
+  }
+
+  // Returns the first of the given properties that _element_ has
+  static const PLYProperty* FindPLYProperty(const PLYElement& element,
+    std::initializer_list<const char*> names) {
+    for (const char* name : names)
+      if (const PLYProperty* prop = element.Find(name)) return prop;
+    return nullptr;
+  }
+
+  static PBRT_CONSTEXPR int64_t LoadChunkSize = 64 * 1024;
+
+  // MappedPLY Function Definitions
+  std::vector<std::shared_ptr<Shape>> CreateMappedPLYMesh(
+    const Transform* o2w, const Transform* w2o, bool reverseOrientation,
+    const ParamSet& params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>>* floatTextures,
+    bool* handled) {
+    *handled = false;
+    const std::string filename = params.FindOneFilename("filename", "");
+    if (filename.empty() || !IsLittleEndianHost()) return {};
+    MappedPLYFile file(filename);
+    if (!file.data) return {};
+    std::vector<PLYElement> elements;
+    size_t headerSize = 0;
+    if (!ParsePLYHeader(file, &elements, &headerSize)) return {};
+
+    // Locate the vertex and face data; elements before them must have
+    // fixed-size items so that their extent is known
+    const PLYElement* vertices = nullptr, * faces = nullptr;
+    const uint8_t* vertexData = nullptr, * faceData = nullptr;
+    size_t offset = headerSize;
+    for (const PLYElement& element : elements) {
+      if (element.name == "vertex") {
+        vertices = &element;
+        vertexData = file.data + offset;
+      }
+      else if (element.name == "face") {
+        faces = &element;
+        faceData = file.data + offset;
+      }
+      if (vertices && faces) break;
+      if (element.stride == 0 && element.count > 0) return {};
+      offset += (size_t)element.stride * element.count;
+    }
+    if (!vertices || !faces || vertices->stride == 0 ||
+      vertexData + (size_t)vertices->stride * vertices->count >
+      file.data + file.size)
+      return {};
+    const PLYProperty* px = vertices->Find("x");
+    const PLYProperty* py = vertices->Find("y");
+    const PLYProperty* pz = vertices->Find("z");
+    const PLYProperty* nx = vertices->Find("nx");
+    const PLYProperty* ny = vertices->Find("ny");
+    const PLYProperty* nz = vertices->Find("nz");
+    const PLYProperty* pu =
+      FindPLYProperty(*vertices, { "u", "s", "texture_u", "texture_s" });
+    const PLYProperty* pv =
+      FindPLYProperty(*vertices, { "v", "t", "texture_v", "texture_t" });
+    if (!px || !py || !pz) return {};
+
+    // Faces must consist of a list of vertex indices and, optionally,
+    // fixed-size scalar properties such as _face_indices_
+    const PLYProperty* indexList = nullptr;
+    const PLYProperty* faceIndex = faces->Find("face_indices");
+    int faceFixedSize = 0;
+    for (const PLYProperty& prop : faces->properties) {
+      if (prop.countType != PLYType::Invalid) {
+        if (indexList ||
+          (prop.name != "vertex_indices" && prop.name != "vertex_index"))
+          return {};
+        indexList = &prop;
+      }
+      else
+        faceFixedSize += PLYTypeSize(prop.type);
+    }
+    if (!indexList || (faceIndex && faceIndex->countType != PLYType::Invalid))
+      return {};
+    *handled = true;
+    ++mappedPLYFiles;
+    int nVertices = vertices->count;
+    int stride = vertices->stride;
+
+    // Use the positions in place if they are stored as a packed,
+    // suitably aligned array of _Point3f_s; decode them otherwise
+    std::unique_ptr<Point3f[]> decodedP;
+    const Point3f* P = nullptr;
+    if (sizeof(Float) == 4 && stride == 12 && px->offset == 0 &&
+      py->offset == 4 && pz->offset == 8 && px->type == PLYType::Float32 &&
+      py->type == PLYType::Float32 && pz->type == PLYType::Float32 &&
+      (uintptr_t)vertexData % alignof(Point3f) == 0) {
+      P = (const Point3f*)vertexData;
+      ++inPlacePositions;
+    }
+    else
+      decodedP.reset(new Point3f[nVertices]);
+    std::unique_ptr<Normal3f[]> N;
+    if (nx && ny && nz) N.reset(new Normal3f[nVertices]);
+    std::unique_ptr<Point2f[]> uv;
+    if (pu && pv) uv.reset(new Point2f[nVertices]);
+    if (decodedP || N || uv) {
+      int64_t nChunks = (nVertices + LoadChunkSize - 1) / LoadChunkSize;
+      NestableParallelFor([&](int64_t c) {
+        int64_t end = std::min<int64_t>((c + 1) * LoadChunkSize, nVertices);
+        for (int64_t i = c * LoadChunkSize; i < end; ++i) {
+          const uint8_t* v = vertexData + i * stride;
+          if (decodedP)
+            decodedP[i] = Point3f(ReadPLYValue(v + px->offset, px->type),
+              ReadPLYValue(v + py->offset, py->type),
+              ReadPLYValue(v + pz->offset, pz->type));
+          if (N)
+            N[i] = Normal3f(ReadPLYValue(v + nx->offset, nx->type),
+              ReadPLYValue(v + ny->offset, ny->type),
+              ReadPLYValue(v + nz->offset, nz->type));
+          if (uv)
+            uv[i] = Point2f(ReadPLYValue(v + pu->offset, pu->type),
+              ReadPLYValue(v + pv->offset, pv->type));
+        }
+      }, nChunks);
+      if (decodedP) P = decodedP.get();
+    }
+
+    // Find the offsets of the index list and face index within a face,
+    // which are fixed given the list length
+    int countSize = PLYTypeSize(indexList->countType);
+    int itemSize = PLYTypeSize(indexList->type);
+    int listOffset = 0, faceIndexOffset = 0;
+    bool seenList = false, seenFaceIndex = false, faceIndexAfterList = false;
+    for (const PLYProperty& prop : faces->properties) {
+      if (&prop == indexList) {
+        seenList = true;
+        continue;
+      }
+      if (&prop == faceIndex) {
+        seenFaceIndex = true;
+        faceIndexAfterList = seenList;
+      }
+      int size = PLYTypeSize(prop.type);
+      if (!seenList) listOffset += size;
+      if (!seenFaceIndex) faceIndexOffset += size;
+    }
+    auto faceIndexAt = [&](const uint8_t* f, int length) {
+      // Properties after the list follow its variable-length items
+      int o = faceIndexOffset;
+      if (faceIndexAfterList) o += countSize + length * itemSize;
+      return (int)ReadPLYInt(f + o, faceIndex->type);
+    };
+
+    // Decode triangles in parallel when every face is a triangle, so that
+    // faces have a fixed size; otherwise walk the faces in order
+    int nFaces = faces->count;
+    const uint8_t* fileEnd = file.data + file.size;
+    std::vector<int> indices, faceIndices;
+    int triSize = faceFixedSize + countSize + 3 * itemSize;
+    bool allTriangles = faceData + (size_t)triSize * nFaces <= fileEnd;
+    if (allTriangles) {
+      indices.resize(3 * (size_t)nFaces);
+      if (faceIndex) faceIndices.resize(nFaces);
+      std::atomic<bool> fixedSize(true);
+      int64_t nChunks = (nFaces + LoadChunkSize - 1) / LoadChunkSize;
+      NestableParallelFor([&](int64_t c) {
+        int64_t end = std::min<int64_t>((c + 1) * LoadChunkSize, nFaces);
+        for (int64_t i = c * LoadChunkSize; i < end && fixedSize; ++i) {
+          const uint8_t* f = faceData + i * triSize;
+          if (ReadPLYInt(f + listOffset, indexList->countType) != 3) {
+            fixedSize = false;
+            break;
+          }
+          const uint8_t* items = f + listOffset + countSize;
+          for (int j = 0; j < 3; ++j)
+            indices[3 * i + j] =
+              (int)ReadPLYInt(items + j * itemSize, indexList->type);
+          if (faceIndex) faceIndices[i] = faceIndexAt(f, 3);
+        }
+      }, nChunks);
+      allTriangles = fixedSize;
+    }
+    if (!allTriangles) {
+      indices.clear();
+      faceIndices.clear();
+      const uint8_t* f = faceData;
+      for (int i = 0; i < nFaces; ++i) {
+        if (f + listOffset + countSize > fileEnd) {
+          Error("%s: PLY file is truncated", filename.c_str());
+          return {};
+        }
+        int length = (int)ReadPLYInt(f + listOffset, indexList->countType);
+        int faceSize = faceFixedSize + countSize + length * itemSize;
+        if (length < 0 || f + faceSize > fileEnd) {
+          Error("%s: PLY file is truncated", filename.c_str());
+          return {};
+        }
+        const uint8_t* items = f + listOffset + countSize;
+        int v[4];
+        for (int j = 0; j < std::min(length, 4); ++j)
+          v[j] = (int)ReadPLYInt(items + j * itemSize, indexList->type);
+        if (length == 3 || length == 4) {
+          // Split quads into two triangles as _CreatePLYMesh()_ does
+          indices.insert(indices.end(), { v[0], v[1], v[2] });
+          if (length == 4) indices.insert(indices.end(), { v[3], v[0], v[2] });
+          if (faceIndex) {
+            int fi = faceIndexAt(f, length);
+            faceIndices.insert(faceIndices.end(), length == 4 ? 2 : 1, fi);
+          }
+        }
+        else
+          Warning("%s: Ignoring face with %d vertices (only triangles and "
+            "quads are supported!)", filename.c_str(), length);
+        f += faceSize;
+      }
+    }
+    for (int index : indices)
+      if (index < 0 || index >= nVertices) {
+        Error("%s: PLY vertex index %d out of range", filename.c_str(),
+          index);
+        return {};
+      }
+
+    // Look up alpha textures
+    std::shared_ptr<Texture<Float>> alphaTex, shadowAlphaTex;
+    for (int i = 0; i < 2; ++i) {
+      const char* name = i == 0 ? "alpha" : "shadowalpha";
+      std::shared_ptr<Texture<Float>>& tex = i == 0 ? alphaTex : shadowAlphaTex;
+      std::string texName = params.FindTexture(name);
+      if (texName != "") {
+        if (floatTextures && floatTextures->find(texName) !=
+          floatTextures->end())
+          tex = (*floatTextures)[texName];
+        else
+          Error("Couldn't find float texture \"%s\" for \"%s\" parameter",
+            texName.c_str(), name);
+      }
+      else if (params.FindOneFloat(name, 1.f) == 0.f)
+        tex.reset(new ConstantTexture<Float>(0.f));
+    }
+
+    // The mesh transforms the positions into its own world-space array, or
+    // compresses them, after which the mapping is released
+    if (PbrtOptions.meshCacheMB > 0)
+      return CreateCompressedTriangleMesh(o2w, w2o, reverseOrientation,
+        indices.size() / 3, indices.data(), nVertices, P, nullptr, N.get(),
+        uv.get(), alphaTex, shadowAlphaTex,
+        faceIndices.empty() ? nullptr : faceIndices.data());
+    return CreateTriangleMesh(o2w, w2o, reverseOrientation,
+      indices.size() / 3, indices.data(), nVertices, P, nullptr, N.get(),
+      uv.get(), alphaTex, shadowAlphaTex,
+      faceIndices.empty() ? nullptr : faceIndices.data());
+  }
+
+}  // namespace pbrt
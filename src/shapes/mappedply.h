@@ -0,0 +1,63 @@
+
+/*
+    pbrt source code is Copyright(c) 1998-2016
+                        Matt Pharr, Greg Humphreys, and Wenzel Jakob.
+
+    This file is part of pbrt.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+
+    - Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+
+    - Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in the
+      documentation and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+    IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+    TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+    PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+#if defined(_MSC_VER)
+#define NOMINMAX
+#pragma once
+#endif
+
+#ifndef PBRT_SHAPES_MAPPEDPLY_H
+#define PBRT_SHAPES_MAPPEDPLY_H
+
+// shapes/mappedply.h*
+#include "pbrt.h"
+#include <map>
+
+namespace pbrt {
+
+  // MappedPLY Declarations
+
+  // Creates the triangles of a binary little-endian PLY file read through a
+  // memory mapping. Vertex positions are handed to the mesh in place when
+  // the file stores them as a packed float array; otherwise vertices and
+  // faces are decoded in parallel. Sets *_handled_ to false, without
+  // reporting an error, for files this loader doesn't support, so that the
+  // caller can fall back to _CreatePLYMesh()_.
+  std::vector<std::shared_ptr<Shape>> CreateMappedPLYMesh(
+    const Transform* o2w, const Transform* w2o, bool reverseOrientation,
+    const ParamSet& params,
+    std::map<std::string, std::shared_ptr<Texture<Float>>>* floatTextures,
+    bool* handled);
+
+}  // namespace pbrt
+
+#endif  // PBRT_SHAPES_MAPPEDPLY_H